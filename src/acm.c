@@ -0,0 +1,239 @@
+/*
+   acm.c
+
+   This file is part of GNU Anubis.
+   Copyright (C) 2020 The Anubis Team.
+
+   GNU Anubis is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   GNU Anubis is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU Anubis.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "headers.h"
+#include "extern.h"
+
+/* Multiple string matching (Aho-Corasick).
+
+   A set of literal strings is compiled into a deterministic automaton
+   that finds all their occurrences in a text in a single pass.
+   Matching ignores the case of ASCII letters.  Texts with non-ASCII
+   bytes are not scanned, since the case-insensitive matching of the
+   regex engine depends on the locale for them.
+
+   To keep the transition table small, the bytes are mapped to classes:
+   each byte that occurs in the strings gets a class of its own (upper
+   and lower case letters sharing one), and all other bytes fall into
+   class 0, which leads back to the root from any state. */
+
+struct acm
+{
+  size_t npat;			/* Number of strings */
+  size_t maxpat;		/* Allocated size of the arrays below */
+  char **pat;			/* The strings */
+  size_t *patlen;		/* Their lengths */
+  int *patnext;			/* Next string ending at the same node,
+				   or -1 */
+
+  u_char cls[256];		/* Byte classes */
+  size_t ncls;			/* Number of classes */
+  size_t nnodes;		/* Number of states */
+  int *delta;			/* Transitions: nnodes rows of ncls */
+  int *fail;			/* Failure links */
+  int *out;			/* First string ending at each node, or -1 */
+  int *dict;			/* Nearest node on the failure chain with
+				   an output, or 0 */
+};
+
+ACM
+acm_create (void)
+{
+  return xzalloc (sizeof (struct acm));
+}
+
+/* Add the string `str' of `len' bytes (at least one) to `acm' and
+   return its index.  Strings must not be added once the automaton is
+   compiled. */
+int
+acm_add (ACM acm, const char *str, size_t len)
+{
+  if (acm->npat == acm->maxpat)
+    {
+      size_t n = acm->maxpat;
+
+      acm->pat = x2nrealloc (acm->pat, &n, sizeof (acm->pat[0]));
+      acm->patlen = xrealloc (acm->patlen, n * sizeof (acm->patlen[0]));
+      acm->patnext = xrealloc (acm->patnext, n * sizeof (acm->patnext[0]));
+      acm->maxpat = n;
+    }
+  acm->pat[acm->npat] = xmalloc (len);
+  memcpy (acm->pat[acm->npat], str, len);
+  acm->patlen[acm->npat] = len;
+  acm->patnext[acm->npat] = -1;
+  return acm->npat++;
+}
+
+#define DELTA(a,s,c) ((a)->delta[(s) * (a)->ncls + (c)])
+#define ASCII_LOWER(c) ((c) >= 'A' && (c) <= 'Z' ? (c) - 'A' + 'a' : (c))
+#define ASCII_UPPER(c) ((c) >= 'a' && (c) <= 'z' ? (c) - 'a' + 'A' : (c))
+
+/* Return the class of the byte `c', assigning a new one if needed */
+static int
+acm_class (ACM acm, u_char c)
+{
+  c = ASCII_LOWER (c);
+  if (!acm->cls[c])
+    {
+      acm->cls[c] = acm->ncls++;
+      acm->cls[ASCII_UPPER (c)] = acm->cls[c];
+    }
+  return acm->cls[c];
+}
+
+/* Build the automaton */
+void
+acm_compile (ACM acm)
+{
+  size_t i, j, max = 1, head, tail;
+  int *queue;
+
+  /* Assign the classes and bound the number of states */
+  memset (acm->cls, 0, sizeof (acm->cls));
+  acm->ncls = 1;
+  for (i = 0; i < acm->npat; i++)
+    {
+      for (j = 0; j < acm->patlen[i]; j++)
+	acm_class (acm, acm->pat[i][j]);
+      max += acm->patlen[i];
+    }
+
+  acm->delta = xmalloc (max * acm->ncls * sizeof (acm->delta[0]));
+  acm->fail = xcalloc (max, sizeof (acm->fail[0]));
+  acm->out = xmalloc (max * sizeof (acm->out[0]));
+  acm->dict = xcalloc (max, sizeof (acm->dict[0]));
+  for (i = 0; i < max * acm->ncls; i++)
+    acm->delta[i] = -1;
+  for (i = 0; i < max; i++)
+    acm->out[i] = -1;
+
+  /* Build the trie */
+  acm->nnodes = 1;
+  for (i = 0; i < acm->npat; i++)
+    {
+      int s = 0;
+
+      for (j = 0; j < acm->patlen[i]; j++)
+	{
+	  int c = acm->cls[(u_char) acm->pat[i][j]];
+
+	  if (DELTA (acm, s, c) == -1)
+	    DELTA (acm, s, c) = acm->nnodes++;
+	  s = DELTA (acm, s, c);
+	}
+      acm->patnext[i] = acm->out[s];
+      acm->out[s] = i;
+    }
+
+  /* Compute the failure links breadth-first, and complete the
+     transitions */
+  queue = xmalloc (acm->nnodes * sizeof (queue[0]));
+  head = tail = 0;
+  for (j = 0; j < acm->ncls; j++)
+    {
+      int t = DELTA (acm, 0, j);
+
+      if (t == -1)
+	DELTA (acm, 0, j) = 0;
+      else
+	{
+	  acm->fail[t] = 0;
+	  queue[tail++] = t;
+	}
+    }
+  while (head < tail)
+    {
+      int s = queue[head++];
+      int f = acm->fail[s];
+
+      acm->dict[s] = acm->out[f] != -1 ? f : acm->dict[f];
+      for (j = 0; j < acm->ncls; j++)
+	{
+	  int t = DELTA (acm, s, j);
+
+	  if (t == -1)
+	    DELTA (acm, s, j) = DELTA (acm, f, j);
+	  else
+	    {
+	      acm->fail[t] = DELTA (acm, f, j);
+	      queue[tail++] = t;
+	    }
+	}
+    }
+  free (queue);
+}
+
+/* Scan the `len' bytes of `text'.  For each string found in it, set
+   ACM_FOUND in the corresponding element of `hits', and ACM_WHOLE if it
+   spans the whole text.  Return 0 on success, and -1 if the text has
+   non-ASCII bytes, in which case `hits' is incomplete. */
+int
+acm_scan (ACM acm, const char *text, size_t len, u_char *hits)
+{
+  size_t i;
+  int s = 0;
+
+  for (i = 0; i < len; i++)
+    {
+      int n, p;
+
+      if (!isascii ((u_char) text[i]))
+	return -1;
+      s = DELTA (acm, s, acm->cls[(u_char) text[i]]);
+      for (n = acm->out[s] != -1 ? s : acm->dict[s]; n; n = acm->dict[n])
+	for (p = acm->out[n]; p != -1; p = acm->patnext[p])
+	  {
+	    hits[p] |= ACM_FOUND;
+	    if (i + 1 == len && acm->patlen[p] == len)
+	      hits[p] |= ACM_WHOLE;
+	  }
+    }
+  return 0;
+}
+
+/* Return the number of strings in `acm' */
+size_t
+acm_count (ACM acm)
+{
+  return acm->npat;
+}
+
+void
+acm_free (ACM *pacm)
+{
+  ACM acm = *pacm;
+  size_t i;
+
+  if (!acm)
+    return;
+  for (i = 0; i < acm->npat; i++)
+    free (acm->pat[i]);
+  free (acm->pat);
+  free (acm->patlen);
+  free (acm->patnext);
+  free (acm->delta);
+  free (acm->fail);
+  free (acm->out);
+  free (acm->dict);
+  free (acm);
+  *pacm = NULL;
+}
+
+/* EOF */
@@ -0,0 +1,399 @@
+/*
+   admission.c
+
+   This file is part of GNU Anubis.
+   Copyright (C) 2001-2020 The Anubis Team.
+
+   GNU Anubis is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   GNU Anubis is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU Anubis.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "headers.h"
+#include "extern.h"
+#include <sys/mman.h>
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETPSHARED
+# include <pthread.h>
+#endif
+
+/* Admission control.
+
+   Each incoming connection is checked against the following limits
+   before any SMTP processing takes place:
+
+   max-clients            - total number of simultaneous sessions;
+   max-clients-per-ip     - number of simultaneous sessions from a
+                            single source address;
+   connection-rate-per-ip - number of connections a single source
+                            address may open within a time interval.
+			    The rate is enforced using a token bucket
+			    that holds at most that number of tokens and
+			    is refilled continuously.
+
+   The state is kept in a table in a shared memory segment, created by
+   the master process before it starts any workers.  The master copies
+   the limits to the table each time it (re)reads the configuration, so
+   that changes take effect immediately in all workers.  The table is
+   protected by a process-shared mutex.  Per-address entries live in an
+   open-addressing hash table of fixed size; entries that hold no
+   sessions and have a full token bucket are equivalent to unused ones
+   and get reclaimed. */
+
+unsigned max_clients = MAXCLIENTS;
+unsigned max_clients_per_ip;
+unsigned connection_rate_count;
+unsigned connection_rate_interval = 60;
+
+#define ADMISSION_TABLE_SIZE 4096
+#define ADMISSION_PROBE_MAX  16
+
+#ifndef MAP_ANONYMOUS
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+struct admission_entry
+{
+  int family;                  /* Address family, 0 if unused */
+  unsigned char addr[16];      /* Address */
+  unsigned active;             /* Number of sessions */
+  double tokens;               /* Tokens left in the bucket */
+  unsigned long long stamp;    /* Time of the last refill (ms) */
+};
+
+struct admission_table
+{
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETPSHARED
+  pthread_mutex_t mutex;
+#endif
+  unsigned max_clients;        /* Copies of the configuration settings */
+  unsigned max_per_ip;
+  unsigned rate_count;
+  unsigned rate_interval;
+  unsigned active;             /* Total number of sessions */
+  struct admission_entry entry[ADMISSION_TABLE_SIZE];
+};
+
+static struct admission_table *table;
+
+static unsigned long long
+now_ms (void)
+{
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  return (unsigned long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void
+table_lock (void)
+{
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETPSHARED
+  int rc = pthread_mutex_lock (&table->mutex);
+# ifdef HAVE_PTHREAD_MUTEX_CONSISTENT
+  /* The previous owner died while holding the lock.  The entries are
+     updated in a way that leaves them consistent at any moment, so it
+     is safe to proceed. */
+  if (rc == EOWNERDEAD)
+    pthread_mutex_consistent (&table->mutex);
+# endif
+#endif
+}
+
+static void
+table_unlock (void)
+{
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETPSHARED
+  pthread_mutex_unlock (&table->mutex);
+#endif
+}
+
+/* Create the admission table.  Called by the master before starting
+   workers. */
+void
+admission_init (void)
+{
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETPSHARED
+  pthread_mutexattr_t attr;
+  void *p;
+
+  p = mmap (NULL, sizeof (*table), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    {
+      anubis_error (0, errno,
+		    _("cannot create admission table; "
+		      "connection limits disabled"));
+      return;
+    }
+  table = p;
+  pthread_mutexattr_init (&attr);
+  pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+# ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+  pthread_mutexattr_setrobust (&attr, PTHREAD_MUTEX_ROBUST);
+# endif
+  pthread_mutex_init (&table->mutex, &attr);
+  pthread_mutexattr_destroy (&attr);
+  admission_configure ();
+#else
+  anubis_warning (0, _("connection limits are not supported "
+		       "on this system"));
+#endif
+}
+
+/* Copy the configured limits to the admission table. */
+void
+admission_configure (void)
+{
+  if (!table)
+    return;
+  table_lock ();
+  table->max_clients = max_clients;
+  table->max_per_ip = max_clients_per_ip;
+  table->rate_count = connection_rate_count;
+  table->rate_interval = connection_rate_interval;
+  table_unlock ();
+}
+
+/* Store the address part of `sa' in `key' and its length in `len' */
+static int
+sockaddr_key (struct sockaddr *sa, unsigned char *key, size_t *len)
+{
+  switch (sa->sa_family)
+    {
+    case AF_INET:
+      *len = 4;
+      memcpy (key, &((struct sockaddr_in *) sa)->sin_addr, *len);
+      return 0;
+#ifdef AF_INET6
+    case AF_INET6:
+      *len = 16;
+      memcpy (key, &((struct sockaddr_in6 *) sa)->sin6_addr, *len);
+      return 0;
+#endif
+    }
+  return -1;
+}
+
+static unsigned
+key_hash (const unsigned char *key, size_t len)
+{
+  unsigned h = 2166136261u;
+
+  while (len--)
+    h = (h ^ *key++) * 16777619u;
+  return h;
+}
+
+/* Refill the token bucket of `ent' */
+static void
+entry_refill (struct admission_entry *ent, unsigned long long now)
+{
+  if (table->rate_count)
+    {
+      ent->tokens += (double) (now - ent->stamp) * table->rate_count
+	             / (table->rate_interval * 1000.0);
+      if (ent->tokens > table->rate_count)
+	ent->tokens = table->rate_count;
+    }
+  ent->stamp = now;
+}
+
+/* Return true if `ent' holds no state worth keeping */
+static int
+entry_is_free (struct admission_entry *ent, unsigned long long now)
+{
+  if (ent->family == 0)
+    return 1;
+  if (ent->active)
+    return 0;
+  entry_refill (ent, now);
+  return table->rate_count == 0 || ent->tokens >= table->rate_count;
+}
+
+/* Find the entry for the given address, creating it if needed.
+   Returns NULL if the table is full. */
+static struct admission_entry *
+entry_lookup (int family, const unsigned char *key, size_t len,
+	      unsigned long long now)
+{
+  unsigned i, n;
+  struct admission_entry *ent, *avail = NULL;
+
+  i = key_hash (key, len) % ADMISSION_TABLE_SIZE;
+  for (n = 0; n < ADMISSION_PROBE_MAX; n++)
+    {
+      ent = &table->entry[(i + n) % ADMISSION_TABLE_SIZE];
+      if (ent->family == family && memcmp (ent->addr, key, len) == 0)
+	{
+	  entry_refill (ent, now);
+	  return ent;
+	}
+      if (ent->family == 0)
+	{
+	  if (!avail)
+	    avail = ent;
+	  break;
+	}
+      if (!avail && entry_is_free (ent, now))
+	avail = ent;
+    }
+
+  if (avail)
+    {
+      avail->family = family;
+      memcpy (avail->addr, key, len);
+      avail->active = 0;
+      avail->tokens = table->rate_count;
+      avail->stamp = now;
+    }
+  return avail;
+}
+
+/* The connection admitted in this process */
+static struct
+{
+  int active;                  /* Set if a connection has been admitted */
+  int family;                  /* Address family, 0 if the connection is
+				  not accounted for per address */
+  unsigned char addr[16];      /* Source address */
+  size_t len;                  /* Length of the address */
+} current;
+
+/* Check whether a connection from `sa' may be admitted.  On success,
+   the connection is accounted for and ADMIT_OK is returned.  Otherwise,
+   the return value indicates the limit that has been hit.
+
+   A process may hold only one admitted connection at a time.  It is
+   released by admission_release, which is also called upon exit. */
+int
+admission_check (struct sockaddr *sa)
+{
+  static int registered;
+  struct admission_entry *ent;
+  int rc = ADMIT_OK;
+
+  if (!table)
+    return ADMIT_OK;
+
+  if (!registered)
+    {
+      atexit (admission_release);
+      registered = 1;
+    }
+  
+  current.family = 0;
+  table_lock ();
+  if (table->max_clients && table->active >= table->max_clients)
+    rc = ADMIT_TOO_MANY;
+  else if ((table->max_per_ip || table->rate_count)
+	   && sockaddr_key (sa, current.addr, &current.len) == 0
+	   && (ent = entry_lookup (sa->sa_family, current.addr, current.len,
+				   now_ms ())))
+    {
+      if (table->max_per_ip && ent->active >= table->max_per_ip)
+	rc = ADMIT_TOO_MANY_PER_IP;
+      else if (table->rate_count && ent->tokens < 1.0)
+	rc = ADMIT_RATE;
+      else
+	{
+	  if (table->rate_count)
+	    ent->tokens -= 1.0;
+	  ent->active++;
+	  current.family = sa->sa_family;
+	}
+    }
+  if (rc == ADMIT_OK)
+    {
+      table->active++;
+      current.active = 1;
+    }
+  table_unlock ();
+  return rc;
+}
+
+/* Decrement the session count of the address `key'.  Must be called
+   with the table locked. */
+static void
+entry_release (int family, const unsigned char *key, size_t len)
+{
+  unsigned i, n;
+
+  if (table->active)
+    table->active--;
+  if (!family)
+    return;
+  i = key_hash (key, len) % ADMISSION_TABLE_SIZE;
+  for (n = 0; n < ADMISSION_PROBE_MAX; n++)
+    {
+      struct admission_entry *ent =
+	&table->entry[(i + n) % ADMISSION_TABLE_SIZE];
+      if (ent->family == family && memcmp (ent->addr, key, len) == 0)
+	{
+	  if (ent->active)
+	    ent->active--;
+	  break;
+	}
+      if (ent->family == 0)
+	break;
+    }
+}
+
+/* Release the connection admitted by admission_check. */
+void
+admission_release (void)
+{
+  if (!table || !current.active)
+    return;
+
+  table_lock ();
+  entry_release (current.family, current.addr, current.len);
+  current.active = 0;
+  table_unlock ();
+}
+
+/* Release a connection from `sa' admitted by another process.  This is
+   used by the master to clean up after a worker that terminated
+   abnormally. */
+void
+admission_release_addr (struct sockaddr *sa)
+{
+  unsigned char key[16];
+  size_t len;
+  int family;
+
+  if (!table)
+    return;
+  table_lock ();
+  family = (table->max_per_ip || table->rate_count)
+           && sockaddr_key (sa, key, &len) == 0 ? sa->sa_family : 0;
+  entry_release (family, key, len);
+  table_unlock ();
+}
+
+/* Return a textual description of the admission result `rc' */
+const char *
+admission_strerror (int rc)
+{
+  switch (rc)
+    {
+    case ADMIT_OK:
+      return _("admitted");
+    case ADMIT_TOO_MANY:
+      return _("too many clients");
+    case ADMIT_TOO_MANY_PER_IP:
+      return _("too many connections from this address");
+    case ADMIT_RATE:
+      return _("connection rate exceeded");
+    }
+  return _("unknown reason");
+}
+
+/* EOF */
@@ -0,0 +1,113 @@
+/*
+   atom.c
+
+   This file is part of GNU Anubis.
+   Copyright (C) 2020 The Anubis Team.
+
+   GNU Anubis is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   GNU Anubis is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU Anubis.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "headers.h"
+#include "extern.h"
+
+/* Header name atoms.
+
+   Each header name the configuration refers to is interned when the
+   configuration is parsed, and is identified from then on by a small
+   integer, its atom.  Names are compared case-insensitively, so that
+   "Subject" and "SUBJECT" get the same atom.  Header names found in
+   messages are only looked up: a name that has no atom cannot be
+   referred to by any rule, so it needs none.  Thus the table only
+   grows with the configuration, not with the mail that passes
+   through. */
+
+static char **atom_name;	/* Names, indexed by atom */
+static size_t atom_max;		/* Allocated size of atom_name */
+static size_t atom_count;	/* Number of atoms */
+static int *atom_hash;		/* Hash table of atoms, -1 meaning empty */
+static size_t atom_hash_size;	/* Its size, a power of 2 */
+
+static unsigned
+atom_hash_name (const char *name)
+{
+  unsigned h = 2166136261u;
+
+  for (; *name; name++)
+    h = (h ^ tolower (*(u_char *) name)) * 16777619u;
+  return h;
+}
+
+/* Return the hash table slot for `name': either the one holding its
+   atom, or the empty one where it should go. */
+static size_t
+atom_slot (const char *name)
+{
+  size_t i = atom_hash_name (name) & (atom_hash_size - 1);
+
+  while (atom_hash[i] != -1 && strcasecmp (atom_name[atom_hash[i]], name))
+    i = (i + 1) & (atom_hash_size - 1);
+  return i;
+}
+
+static void
+atom_rehash (void)
+{
+  size_t i;
+
+  free (atom_hash);
+  atom_hash_size = atom_hash_size ? atom_hash_size * 2 : 64;
+  atom_hash = xmalloc (atom_hash_size * sizeof (atom_hash[0]));
+  for (i = 0; i < atom_hash_size; i++)
+    atom_hash[i] = -1;
+  for (i = 0; i < atom_count; i++)
+    atom_hash[atom_slot (atom_name[i])] = i;
+}
+
+/* Return the atom of the header name `name', creating it if needed */
+int
+header_atom (const char *name)
+{
+  size_t i;
+
+  if ((atom_count + 1) * 2 > atom_hash_size)
+    atom_rehash ();
+  i = atom_slot (name);
+  if (atom_hash[i] == -1)
+    {
+      if (atom_count == atom_max)
+	atom_name = x2nrealloc (atom_name, &atom_max, sizeof (atom_name[0]));
+      atom_name[atom_count] = xstrdup (name);
+      atom_hash[i] = atom_count++;
+    }
+  return atom_hash[i];
+}
+
+/* Return the atom of `name', or -1 if it has none */
+int
+header_atom_lookup (const char *name)
+{
+  if (!atom_count)
+    return -1;
+  return atom_hash[atom_slot (name)];
+}
+
+/* Return the number of atoms.  Atoms range from 0 to this number
+   minus one. */
+size_t
+header_atom_count (void)
+{
+  return atom_count;
+}
+
+/* EOF */
@@ -540,7 +540,7 @@ anubis_get_db_record (const char *username, ANUBIS_USER * usr)
 
 
 int
-anubis_authenticate_mode (struct sockaddr_in *addr)
+anubis_authenticate_mode (struct sockaddr *addr)
 {
   ANUBIS_USER usr;
 
@@ -573,15 +573,14 @@ anubis_authenticate_mode (struct sockaddr_in *addr)
     {
       xdb_loop ();
     }
-  else
+  else if (session_prologue () == 0)
     {
-      session_prologue ();
       smtp_session ();
       alarm (0);
     }
   
   net_close_stream (&remote_client);
-  net_close_stream (&remote_server);
+  upstream_close (&remote_server);
   
   info (NORMAL, _("Connection closed successfully."));
 
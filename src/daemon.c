@@ -35,33 +35,39 @@ int log_facility = LOG_MAIL;
   DAEMONIZE
 *************/
 
+/* Become a daemon.  If `detach' is false, the process is already
+   detached from the terminal (it has been started by a binary upgrade
+   of a running daemon), so only the bookkeeping is done. */
 void
-daemonize (void)
+daemonize (int detach)
 {
   signal (SIGHUP, SIG_IGN);
+  if (detach)
+    {
 #ifdef HAVE_DAEMON
-  if (daemon (0, 0) == -1)
-    anubis_error (EXIT_FAILURE, errno, _("daemon() failed"));
+      if (daemon (0, 0) == -1)
+	anubis_error (EXIT_FAILURE, errno, _("daemon() failed"));
 #else
-  chdir ("/");
-  umask (0);
-  switch (fork ())
-    {
-    case -1:			/* fork() failed */
-      anubis_error (EXIT_FAILURE, errno, _("Cannot fork."));
-      break;
-    case 0:			/* child process */
-      break;
-    default:			/* parent process */
-      quit (0);
-    }
-  if (setsid () == -1)
-    anubis_error (EXIT_FAILURE, errno, _("setsid() failed"));
+      chdir ("/");
+      umask (0);
+      switch (fork ())
+	{
+	case -1:		/* fork() failed */
+	  anubis_error (EXIT_FAILURE, errno, _("Cannot fork."));
+	  break;
+	case 0:			/* child process */
+	  break;
+	default:		/* parent process */
+	  quit (0);
+	}
+      if (setsid () == -1)
+	anubis_error (EXIT_FAILURE, errno, _("setsid() failed"));
 
-  close (0);
-  close (1);
-  close (2);
+      close (0);
+      close (1);
+      close (2);
 #endif /* HAVE_DAEMON */
+    }
 
   topt &= ~T_FOREGROUND;
   topt |= T_DAEMON;
@@ -98,21 +104,6 @@ format_exit_status (char *buffer, size_t buflen, int status)
   return buffer;
 }
 
-static void
-report_process_status (size_t count, pid_t pid, int status)
-{
-  char buffer[LINEBUFFER];
-
-  count--;
-  info (VERBOSE,
-	ngettext
-	("Child [%lu] finished. %s. %d client left.",
-	 "Child [%lu] finished. %s. %d clients left.",
-	 count),
-	(unsigned long) pid,
-	format_exit_status (buffer, sizeof buffer, status), count);
-}
-
 static void
 subprocess_report_status (size_t count, pid_t pid, int status)
 {
@@ -175,7 +166,7 @@ set_unprivileged_user (void)
 }
 
 int
-anubis_child_main (struct sockaddr_in *addr)
+anubis_child_main (struct sockaddr *addr)
 {
   int rc;
 
@@ -204,104 +195,60 @@ anubis_child_main (struct sockaddr_in *addr)
   return rc;
 }
 
-/**************
-  DAEMON loop
-***************/
-
-void
-loop (int sd_bind)
+/* Serve a single incoming connection on socket `fd'. This is run
+   in a worker process. */
+int
+anubis_session (int fd, struct sockaddr *addr)
 {
-  struct sockaddr_in addr;
-  pid_t childpid = 0;
-  socklen_t addrlen;
+  char buf[LINEBUFFER];
+  struct sockaddr_storage local;
+  socklen_t len = sizeof (local);
 #ifdef USE_LIBWRAP
   struct request_info req;
 #endif /* USE_LIBWRAP */
 
-  addrlen = sizeof (addr);
-
-  proclist_init ();
-
-  info (VERBOSE, _("GNU Anubis is running..."));
-
-  for (;;)
-    {
-      int fd;
-      size_t count;
-      
-      fd = accept (sd_bind, (struct sockaddr *) &addr, &addrlen);
-      count = proclist_cleanup (report_process_status);
-      
-      if (fd < 0)
-	{
-	  if (errno == EINTR)
-	    continue;
-	  else
-	    {
-	      anubis_error (0, errno, _("accept() failed"));
-	      continue;
-	    }
-	}
+  /* Create the TCP stream */
+  net_create_stream (&remote_client, fd);
+  remote_server = NULL;
 
-      /* Create the TCP stream */
-      net_create_stream (&remote_client, fd);
-      remote_server = NULL;
+  if (getsockname (fd, (struct sockaddr *) &local, &len) == 0)
+    session.local_port = sockaddr_port ((struct sockaddr *) &local);
+  else
+    session.local_port = session.anubis_port;
       
-      /*
-         Check the TCP wrappers settings.
-       */
+  /*
+     Check the TCP wrappers settings.
+  */
 
 #ifdef USE_LIBWRAP
-      request_init (&req, RQ_DAEMON, "anubis", RQ_FILE, fd, 0);
-      fromhost (&req);
-      if (hosts_access (&req) == 0)
-	{
-	  info (NORMAL,
-		_("TCP wrappers: connection from %s:%u rejected."),
-		inet_ntoa (addr.sin_addr), ntohs (addr.sin_port));
-	  service_unavailable (&remote_client);
-	  continue;
-	}
+  request_init (&req, RQ_DAEMON, "anubis", RQ_FILE, fd, 0);
+  fromhost (&req);
+  if (hosts_access (&req) == 0)
+    {
+      info (NORMAL,
+	    _("TCP wrappers: connection from %s rejected."),
+	    format_sockaddr (buf, sizeof buf, addr));
+      service_unavailable (&remote_client);
+      return 0;
+    }
 #endif /* USE_LIBWRAP */
 
-      /*
-         Read the system configuration file (SUPERVISOR).
-       */
+  info (NORMAL, _("Connection from %s"),
+	format_sockaddr (buf, sizeof buf, addr));
+  return anubis_child_main (addr);
+}
 
-      if (!(topt & T_NORC))
-	{
-	  open_rcfile (CF_SUPERVISOR);
-	  process_rcfile (CF_SUPERVISOR);
-	}
+/**************
+  DAEMON loop
+***************/
 
-      if (count >= MAXCLIENTS)
-	{
-	  info (NORMAL,
-		_("Too many clients. Connection from %s:%u rejected."),
-		inet_ntoa (addr.sin_addr), ntohs (addr.sin_port));
-	  service_unavailable (&remote_client);
-	}
-      else
-	{
-	  info (NORMAL, _("Connection from %s:%u"),
-		inet_ntoa (addr.sin_addr), ntohs (addr.sin_port));
-
-	  childpid = fork ();
-	  if (childpid == -1)
-	    anubis_error (0, errno, _("daemon: cannot fork"));
-	  else if (childpid == 0)
-	    {			/* a child process */
-	      /* FIXME */
-	      signal (SIGCHLD, SIG_IGN);
-	      quit (anubis_child_main (&addr));
-	    }
-	  else /* master process */
-	    proclist_register (childpid);
-	  
-	  net_close_stream (&remote_client);
-	}
-    }
-  return;
+void
+loop (void)
+{
+  proclist_init ();
+
+  info (VERBOSE, _("GNU Anubis is running..."));
+  prefork_loop ();
 }
 
 /********************************************
@@ -37,6 +37,7 @@ struct options_struct
   char *glogfile;
 #endif
   char *altrc;
+  int status;          /* Print the daemon status and exit */
 };
 
 struct session_struct
@@ -50,6 +51,7 @@ struct session_struct
   char *execpath;
   char **execargs;
   unsigned int anubis_port;
+  unsigned int local_port;   /* Local port of the client connection */
   unsigned int mta_port;
 #ifdef USE_SOCKS_PROXY
   char *socks;
@@ -108,6 +110,36 @@ extern int log_facility;
 
 extern char *from_address;
 
+extern unsigned min_spare_workers;
+extern unsigned max_spare_workers;
+extern unsigned max_workers;
+extern unsigned max_worker_sessions;
+extern unsigned drain_timeout;
+
+extern char *scoreboard_file;
+
+extern unsigned stream_buffer_size;
+extern unsigned body_memory_limit;
+extern char *body_spool_directory;
+extern unsigned mda_max_deliveries;
+extern unsigned connect_timeout;
+
+extern unsigned resolver_cache_ttl;
+extern unsigned resolver_negative_ttl;
+
+extern unsigned upstream_max_reuse;
+extern unsigned upstream_idle_timeout;
+extern unsigned upstream_max_connections;
+
+extern ANUBIS_LIST bind_list;
+extern unsigned listen_backlog;
+extern unsigned reuseport_groups;
+
+extern unsigned max_clients;
+extern unsigned max_clients_per_ip;
+extern unsigned connection_rate_count;
+extern unsigned connection_rate_interval;
+
 extern char *anubis_sasl_service;
 extern char *anubis_sasl_realm;
 extern char *anubis_sasl_hostname;
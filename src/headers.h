@@ -38,11 +38,13 @@
 # if defined(HAVE_LIBGPGME) && defined(HAVE_GPGME_H) && !defined(NOGPG)
 #  define HAVE_GPG
 # endif	/* HAVE_LIBGPGME and HAVE_GPGME_H and not NOGPG */
-# if defined(HAVE_LIBPCRE)
+# if defined(HAVE_PCRE2)
+#  define HAVE_PCRE
+# elif defined(HAVE_LIBPCRE)
 #  if defined(HAVE_PCRE_H) || defined(HAVE_PCRE_PCRE_H)
 #   define HAVE_PCRE
 #  endif /* HAVE_PCRE_H or HAVE_PCRE_PCRE_H */
-# endif	/* HAVE_LIBPCRE */
+# endif	/* HAVE_PCRE2 or HAVE_LIBPCRE */
 # if defined(HAVE_LIBPAM) && defined(HAVE_LIBPAM_MISC)
 #  if defined(HAVE_SECURITY_PAM_APPL_H) && defined(HAVE_SECURITY_PAM_MISC_H)
 #   define HAVE_PAM
@@ -71,6 +73,7 @@
 #include <signal.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <time.h>
 #include <pwd.h>
@@ -86,8 +89,10 @@
 #include <sys/wait.h>
 #include <sys/param.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <syslog.h>
 
 #if defined(HAVE_GETRLIMIT) && defined(HAVE_SETRLIMIT)
@@ -162,6 +167,8 @@
 #define MAXCLIENTS 50
 #define LINEBUFFER 512
 #define DATABUFFER 4096
+#define STREAM_BUFFER_SIZE 65536
+#define BODY_MEMORY_LIMIT (8*1024*1024)
 #define DEFAULT_GLOBAL_RCFILE "/etc/anubisrc"
 #define DEFAULT_LOCAL_RCFILE ".anubisrc"
 #define DEFAULT_SSL_PEM "anubis.pem"
@@ -220,9 +227,9 @@ ANUBIS_MODE;
 #define T_SSL_FINISHED      0x00000200
 #define T_SSL_ONEWAY        0x00000400
 #define T_SSL_CKCLIENT      0x00000800
-#define T_NAMES             0x00001000
+/* Not used (ex T_NAMES) 0x00001000 */
 #define T_LOCAL_MTA         0x00002000
-/* Not used (ex T_ALLOW_LOCAL_MTA)   0x00004000 */
+#define T_PIPELINING        0x00004000
 #define T_TRANSLATION_MAP   0x00008000
 #define T_DROP_UNKNOWN_USER 0x00010000
 #define T_USER_NOTPRIVIL    0x00020000
@@ -294,6 +301,41 @@ typedef struct message_struct *MESSAGE;
 #define MSGIDLEN 14
 #define MSGIDBOUND (MSGIDLEN + 1)
 
+/* atom.c */
+int header_atom (const char *name);
+int header_atom_lookup (const char *name);
+size_t header_atom_count (void);
+
+/* acm.c */
+typedef struct acm *ACM;
+
+#define ACM_FOUND 0x1		/* The string occurs in the text */
+#define ACM_WHOLE 0x2		/* The string is the whole text */
+
+ACM acm_create (void);
+int acm_add (ACM acm, const char *str, size_t len);
+void acm_compile (ACM acm);
+int acm_scan (ACM acm, const char *text, size_t len, u_char *hits);
+size_t acm_count (ACM acm);
+void acm_free (ACM *pacm);
+
+/* textbuf.c */
+struct textbuf
+{
+  char *buf;			/* The text, null-terminated */
+  size_t size;			/* Size of the buffer */
+  size_t level;			/* Length of the text */
+  int fd;			/* Temporary file holding it, or -1 */
+  int error;			/* The text could not be stored in full */
+};
+
+#define TEXTBUF_INITIALIZER { NULL, 0, 0, -1, 0 }
+
+void textbuf_init (struct textbuf *tb);
+void textbuf_append (struct textbuf *tb, const char *text, size_t len);
+void textbuf_adopt (struct textbuf *tb, char *text);
+void textbuf_free (struct textbuf *tb);
+
 /* stream.c */
 
 typedef struct net_stream *NET_STREAM;
@@ -319,7 +361,14 @@ int stream_write (NET_STREAM str, const char *buf, size_t size,
 		  size_t *nbytes);
 int stream_readline (NET_STREAM str, char *buf, size_t size, size_t *nbytes);
 int stream_getline (NET_STREAM sd, char **vptr, size_t *maxlen, size_t *nread);
+int stream_getline_ref (NET_STREAM str, const char **pline, size_t *plen);
+int stream_flush (NET_STREAM str);
+int stream_fd (NET_STREAM str);
+size_t stream_buffered (NET_STREAM str, const char **pbuf);
+void stream_consume (NET_STREAM str, size_t size);
 int stream_destroy (NET_STREAM *);
+void stream_create_memory (NET_STREAM *str, struct textbuf *tb);
+size_t stream_memory_contents (NET_STREAM str, const char **pbuf);
 
 /* main.c */
 void anubis (char *);
@@ -352,28 +401,32 @@ void filelog (char *, char *);
 
 /* net.c */
 NET_STREAM make_remote_connection (char *, unsigned int);
-int bind_and_listen (char *, unsigned int);
 void swrite (int, NET_STREAM, const char *);
 void swrite_n (int, NET_STREAM, const char *, size_t);
 void send_eol (int method, NET_STREAM sd);
 int recvline (int method, NET_STREAM sd, char **vptr, size_t * maxlen);
+size_t recvline_ref (int method, NET_STREAM sd, const char **pline);
+size_t recvdata (int method, NET_STREAM sd, char *buf, size_t size);
 void get_response_smtp (int, NET_STREAM, char **, size_t *);
 void close_socket (int sd);
 
 void net_create_stream (NET_STREAM * str, int fd);
+void socket_nodelay (int fd);
 void net_close_stream (NET_STREAM * sd);
 
 void smtp_reply_get (int method, NET_STREAM sd, ANUBIS_SMTP_REPLY reply);
 /* daemon.c */
-void daemonize (void);
-void loop (int);
+void daemonize (int detach);
+void loop (void);
 void stdinout (void);
 void service_unavailable (NET_STREAM *);
 void set_unprivileged_user (void);
 void create_stdio_stream (NET_STREAM *s);
+char *format_exit_status (char *buffer, size_t buflen, int status);
+int anubis_session (int fd, struct sockaddr *addr);
 
 /* auth.c */
-int auth_ident (struct sockaddr_in *, char **);
+int auth_ident (struct sockaddr *, char **);
 
 /* map.c */
 void parse_transmap (int *, char *, char *, char **);
@@ -388,6 +441,7 @@ void transfer_header (ANUBIS_LIST);
 void transfer_body (MESSAGE);
 void collect_headers (MESSAGE  msg, char *init_line);
 void collect_body (MESSAGE  msg);
+void smtp_session_cleanup (void);
 
 /* proclist.c */
 void proclist_register (pid_t pid);
@@ -395,6 +449,82 @@ size_t proclist_cleanup (void (*fun) (size_t, pid_t, int));
 void proclist_init (void);
 size_t proclist_count (void);
 
+/* prefork.c */
+void prefork_loop (void);
+void upgrade_save_argv (int argc, char **argv);
+
+/* scoreboard.c */
+#define SB_FREE     0   /* Slot is not used */
+#define SB_IDLE     1   /* Waiting for a connection */
+#define SB_BUSY     2   /* Serving a session */
+#define SB_STOPPING 3   /* Asked to exit */
+
+#define SB_PHASE_IDLE    0
+#define SB_PHASE_CONNECT 1
+#define SB_PHASE_HELO    2
+#define SB_PHASE_MAIL    3
+#define SB_PHASE_RCPT    4
+#define SB_PHASE_DATA    5
+#define SB_PHASE_QUIT    6
+
+void scoreboard_init (unsigned nslots, unsigned ngroups);
+unsigned scoreboard_slots (void);
+unsigned scoreboard_count (int state, int group);
+unsigned scoreboard_workers (void);
+int scoreboard_alloc (int group);
+void scoreboard_set_pid (int n, pid_t pid);
+int scoreboard_find (pid_t pid);
+pid_t scoreboard_slot_pid (int n);
+pid_t scoreboard_find_state (int state, int group);
+int scoreboard_stop (int n);
+int scoreboard_free (int n, struct sockaddr_storage *addr);
+void scoreboard_reloaded (unsigned long count, unsigned long usec);
+void scoreboard_attach (int n);
+void scoreboard_begin_session (struct sockaddr *addr, socklen_t addrlen);
+void scoreboard_admitted (int admitted);
+void scoreboard_end_session (void);
+int scoreboard_upstream_open (unsigned max);
+void scoreboard_upstream_close (void);
+unsigned scoreboard_upstream_count (void);
+void scoreboard_spill (size_t size);
+void scoreboard_phase (int phase);
+void scoreboard_smtp_command (const char *cmd);
+void scoreboard_user (const char *user);
+void scoreboard_bytes (size_t in, size_t out);
+void scoreboard_log (void);
+int scoreboard_status (void);
+
+/* listen.c */
+void bind_list_add (const char *spec);
+void bind_list_clear (void);
+char *format_sockaddr (char *buffer, size_t buflen, struct sockaddr *sa);
+char *format_sockaddr_host (char *buffer, size_t buflen, struct sockaddr *sa);
+int sockaddr_is_local (struct sockaddr *sa);
+unsigned sockaddr_port (struct sockaddr *sa);
+void open_listeners (void);
+void adopt_listener (int fd);
+unsigned listener_groups (void);
+int listener_fdset (int group, fd_set *fds, int maxfd);
+int listener_accept (int group, fd_set *fds, struct sockaddr *addr,
+		     socklen_t *addrlen);
+void listeners_nonblock (void);
+void listeners_close (void);
+void listeners_export (void);
+int listeners_import (void);
+
+/* admission.c */
+#define ADMIT_OK              0
+#define ADMIT_TOO_MANY        1
+#define ADMIT_TOO_MANY_PER_IP 2
+#define ADMIT_RATE            3
+
+void admission_init (void);
+void admission_configure (void);
+int admission_check (struct sockaddr *);
+void admission_release (void);
+void admission_release_addr (struct sockaddr *);
+const char *admission_strerror (int);
+
 /* message.c */
 MESSAGE message_new (void);
 const char *message_id (MESSAGE msg);
@@ -402,15 +532,20 @@ const char *message_id (MESSAGE msg);
 ANUBIS_LIST message_get_header (MESSAGE);
 ANUBIS_LIST message_get_commands (MESSAGE);
 const char *message_get_body (MESSAGE msg);
+int message_body_error (MESSAGE msg);
 const char *message_get_boundary (MESSAGE msg);
 ANUBIS_LIST message_get_mime_header (MESSAGE msg);
 
 void message_replace_header (MESSAGE msg, ANUBIS_LIST list);
 void message_replace_body (MESSAGE msg, char *body);
+void message_take_body (MESSAGE msg, struct textbuf *tb);
 void message_replace_boundary (MESSAGE msg, char *boundary);
 
 void message_add_body (MESSAGE, char *, char *);
 void message_add_header (MESSAGE, char *, char *);
+void message_append_header (MESSAGE msg, ASSOC *asc);
+int message_find_header (MESSAGE msg, int atom, ASSOC ***pv, size_t *pn);
+unsigned message_header_generation (MESSAGE msg);
 void message_add_command (MESSAGE, ASSOC *);
 void message_append_mime_header (MESSAGE, const char *);
 
@@ -425,6 +560,13 @@ void message_external_proc (MESSAGE, char **);
 void message_reset (MESSAGE);
 void message_free (MESSAGE);
 MESSAGE message_dup (MESSAGE msg);
+void message_defer_body (MESSAGE msg);
+int message_body_deferred (MESSAGE msg);
+void message_body_begin (MESSAGE msg,
+			 void (*output) (const char *, size_t, void *),
+			 void *data);
+void message_body_write (MESSAGE msg, const char *text, size_t len);
+void message_body_end (MESSAGE msg);
 
 /* exec.c */
 char **gen_execargs (const char *);
@@ -451,7 +593,6 @@ void parse_mtaport (char *, char **, unsigned int *);
 void parse_mtahost (char *, char **, unsigned int *);
 void remline (char *, char *);
 void remcrlf (char *);
-char *substitute (char *, char **);
 char *make_uppercase (char *);
 char *make_lowercase (char *);
 char *get_localname (void);
@@ -464,12 +605,42 @@ void message_append_text_file (MESSAGE, char *, char *);
 void message_append_signature_file (MESSAGE);
 
 /* regex.c */
-int anubis_regex_match (RC_REGEX *, const char *, int *, char ***);
+struct regex_span
+{
+  size_t so;			/* Start offset, or REGEX_UNSET */
+  size_t eo;			/* End offset */
+};
+
+#define REGEX_UNSET ((size_t) -1)
+
+struct regex_match
+{
+  const char *subject;		/* String the spans refer to */
+  size_t count;			/* Number of back-references */
+  struct regex_span *span;	/* Match (0) and back-references (1 to
+				   count) */
+  size_t max;			/* Allocated size of span */
+  char *save;			/* Saved back-references */
+  size_t savesize;		/* Size of save */
+  char *out;			/* Result of the last substitution */
+  size_t outsize;		/* Size of out */
+};
+
+#define REGEX_MATCH_INITIALIZER { NULL, 0, NULL, 0, NULL, 0, NULL, 0 }
+
+int anubis_regex_match (RC_REGEX *, const char *, struct regex_match *);
+void anubis_regex_match_save (struct regex_match *m);
+void anubis_regex_match_free (struct regex_match *m);
+char *anubis_regex_expand (struct regex_match *m, const char *templ);
 RC_REGEX *anubis_regex_compile (char *, int);
 void anubis_regex_free (RC_REGEX **);
 char *anubis_regex_source (RC_REGEX *);
+int anubis_regex_flags (RC_REGEX *);
+void anubis_regex_nomatch (RC_REGEX *re, struct regex_match *m);
+size_t anubis_regex_literal (RC_REGEX *re, const char **start);
 int anubis_regex_refcnt (RC_REGEX *);
-char *anubis_regex_replace (RC_REGEX *, char *, char *);
+char *anubis_regex_replace (RC_REGEX *re, const char *line, const char *repl,
+			    struct regex_match *m);
 void anubis_regex_print (RC_REGEX *);
 
 /* rcfile.c */
@@ -479,7 +650,19 @@ void open_rcfile (int);
 void process_rcfile (int);
 void rcfile_process_section (int, char *, void *, MESSAGE);
 void rcfile_call_section (int, char *, char *, void *, MESSAGE);
+enum body_use
+  {
+    body_unused,		/* The body is not looked at */
+    body_streamed,		/* It is modified line by line */
+    body_needed			/* The whole body is needed */
+  };
+int rcfile_section_body_use (char *name);
+int rcfile_section_needs_body (char *name);
 char *user_rcfile_name (void);
+char *system_rcfile_name (void);
+int reload_rcfile (void);
+unsigned long rcfile_reload_stat (unsigned long *);
+int rcfile_client_linked (void);
 
 typedef struct eval_env *EVAL_ENV;
 struct rc_loc const *eval_env_locus (EVAL_ENV);
@@ -613,12 +796,41 @@ void mysql_db_init (void);
 void pgsql_db_init (void);
 
 /* transmode.c */
-int anubis_transparent_mode (struct sockaddr_in *addr);
-int anubis_proxy_mode (struct sockaddr_in *addr);
-void session_prologue ();
+int anubis_transparent_mode (struct sockaddr *addr);
+int anubis_proxy_mode (struct sockaddr *addr);
+int session_prologue ();
+
+/* resolver.c */
+void resolver_init (void);
+void resolver_configure (void);
+int resolve_host (const char *name, unsigned port, int family,
+		  struct addrinfo **res);
+void resolve_free (struct addrinfo *res);
+const char *resolve_strerror (int rc);
+void resolver_refresh (void);
+int resolver_reaped (pid_t pid);
+void resolver_log (void);
+
+/* upstream.c */
+NET_STREAM upstream_open (char *host, unsigned port);
+int upstream_reused (void);
+void upstream_set_tls (NET_STREAM str);
+int upstream_tls (void);
+void upstream_set_greeting (const char *text);
+const char *upstream_greeting (void);
+const char *upstream_ehlo (const char **domain);
+void upstream_set_chunking (int chunking);
+int upstream_chunking (void);
+void upstream_taint (void);
+int upstream_park (const char *domain, ANUBIS_SMTP_REPLY ehlo);
+void upstream_close (NET_STREAM *sd);
+int upstream_idle_left (void);
+int upstream_fdset (fd_set *fds, int maxfd);
+void upstream_check (fd_set *fds);
+void upstream_discard (void);
 
 /* authmode.c */
-int anubis_authenticate_mode (struct sockaddr_in *addr);
+int anubis_authenticate_mode (struct sockaddr *addr);
 void anubis_set_password_db (char *arg);
 void asmtp_reply (int code, char *fmt, ...);
 void asmtp_capa_add_prefix (char *prefix, char *name);
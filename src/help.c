@@ -25,9 +25,11 @@ static char *config_opts[] = {
 #ifdef HAVE_REGEX
   "REGEX",
 #endif				/* HAVE_REGEX */
-#ifdef HAVE_PCRE
+#ifdef HAVE_PCRE2
+  "PCRE2",
+#elif defined(HAVE_PCRE)
   "PCRE",
-#endif				/* HAVE_PCRE */
+#endif				/* HAVE_PCRE2 or HAVE_PCRE */
 #ifdef WITH_GSASL
   "GSASL",
 #endif				/* WITH_GSASL */
@@ -84,10 +84,12 @@ crypt_extract_username (char *reply, char **pusername)
 }
 
 int
-auth_ident (struct sockaddr_in *addr, char **user)
+auth_ident (struct sockaddr *addr, char **user)
 {
   struct servent *sp;
-  struct sockaddr_in ident;
+  struct sockaddr_storage ident;
+  socklen_t len;
+  unsigned port;
   char *buf = NULL;
   char inetd_buf[LINEBUFFER];
   size_t size = 0;
@@ -96,19 +98,37 @@ auth_ident (struct sockaddr_in *addr, char **user)
   NET_STREAM str;
   size_t nbytes;
 
-  if ((sd = socket (AF_INET, SOCK_STREAM, 0)) < 0)
+  sp = getservbyname ("auth", "tcp");
+  port = sp ? sp->s_port : htons (113); /* default IDENT port number */
+  
+  switch (addr->sa_family)
+    {
+    case AF_INET:
+      len = sizeof (struct sockaddr_in);
+      memcpy (&ident, addr, len);
+      ((struct sockaddr_in *) &ident)->sin_port = port;
+      break;
+
+#ifdef AF_INET6
+    case AF_INET6:
+      len = sizeof (struct sockaddr_in6);
+      memcpy (&ident, addr, len);
+      ((struct sockaddr_in6 *) &ident)->sin6_port = port;
+      break;
+#endif
+      
+    default:
+      /* No IDENT for UNIX domain clients */
+      return 0;
+    }
+  
+  if ((sd = socket (addr->sa_family, SOCK_STREAM, 0)) < 0)
     {
       anubis_error (0, errno, _("IDENT: socket() failed"));
       return 0;
     }
-  memcpy (&ident, addr, sizeof (ident));
-  sp = getservbyname ("auth", "tcp");
-  if (sp)
-    ident.sin_port = sp->s_port;
-  else
-    ident.sin_port = htons (113);	/* default IDENT port number */
 
-  if (connect (sd, (struct sockaddr *) &ident, sizeof (ident)) < 0)
+  if (connect (sd, (struct sockaddr *) &ident, len) < 0)
     {
       anubis_error (0, errno, _("IDENT: connect() failed"));
       close_socket (sd);
@@ -116,11 +136,12 @@ auth_ident (struct sockaddr_in *addr, char **user)
     }
   net_create_stream (&str, sd);
 
-  info (VERBOSE, _("IDENT: connected to %s:%u"),
-	inet_ntoa (ident.sin_addr), ntohs (ident.sin_port));
+  info (VERBOSE, _("IDENT: connected to %s"),
+	format_sockaddr (inetd_buf, sizeof inetd_buf,
+			 (struct sockaddr *) &ident));
 
   snprintf (inetd_buf, sizeof inetd_buf,
-	    "%u , %u" CRLF, ntohs (addr->sin_port), session.anubis_port);
+	    "%u , %u" CRLF, sockaddr_port (addr), session.local_port);
 
   if ((rc = stream_write (str, inetd_buf, strlen (inetd_buf), &nbytes)))
     {
@@ -169,7 +190,7 @@ auth_ident (struct sockaddr_in *addr, char **user)
 	}
       else
 	{			/* UID deciphered */
-	  if (ntohl (ident.sin_addr.s_addr) == INADDR_LOOPBACK)
+	  if (sockaddr_is_local (addr))
 	    {
 	      struct passwd *pwd;
 	      int uid = atoi (*user);
@@ -0,0 +1,536 @@
+/*
+   listen.c
+
+   This file is part of GNU Anubis.
+   Copyright (C) 2001-2020 The Anubis Team.
+
+   GNU Anubis is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   GNU Anubis is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU Anubis.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "headers.h"
+#include "extern.h"
+#include <sys/un.h>
+
+/* Listening sockets.
+
+   The daemon may listen on any number of addresses, given by the
+   `bind' statement or the --bind option.  Each address is one of:
+
+     [HOST:]PORT        an IPv4 address or host name and a port;
+     [ADDRESS]:PORT     an IPv6 address or host name and a port;
+     unix:PATH, /PATH   a UNIX domain socket.
+
+   If `reuseport-groups' is set to N > 1, N sockets are opened for
+   each TCP address, all of them bound with the SO_REUSEPORT option.
+   The kernel then distributes the incoming connections among these
+   sockets.  Each worker is assigned to a group and waits only for the
+   sockets of that group, so that workers of different groups do not
+   contend on a single accept queue.  UNIX domain sockets are shared by
+   all groups. */
+
+ANUBIS_LIST bind_list;
+unsigned listen_backlog = SOMAXCONN;
+unsigned reuseport_groups;
+
+#ifndef UNIX_PATH_MAX
+# define UNIX_PATH_MAX sizeof (((struct sockaddr_un *) 0)->sun_path)
+#endif
+
+struct listener
+{
+  int fd;
+  int group;                  /* Worker group, or -1 if shared */
+};
+
+static struct listener *listener_tab;
+static size_t listener_count;
+static size_t listener_max;
+static unsigned group_count = 1;
+
+/* Add an address to the list of addresses to listen on.  The first
+   TCP address given in the traditional form also sets session.anubis
+   and session.anubis_port, which are used to detect loops. */
+void
+bind_list_add (const char *spec)
+{
+  if (!bind_list)
+    bind_list = list_create ();
+  if (list_count (bind_list) == 0
+      && spec[0] != '[' && spec[0] != '/' && strncmp (spec, "unix:", 5))
+    {
+      parse_mtahost ((char *) spec, &session.anubis, &session.anubis_port);
+      if (session.anubis && session.anubis[0] == 0)
+	{
+	  free (session.anubis);
+	  session.anubis = NULL;
+	}
+    }
+  list_append (bind_list, xstrdup (spec));
+}
+
+/* Clear the list of addresses. */
+void
+bind_list_clear (void)
+{
+  destroy_string_list (&bind_list);
+}
+
+static void
+listener_add (int fd, int group)
+{
+  if (listener_count == listener_max)
+    listener_tab = x2nrealloc (listener_tab, &listener_max,
+			       sizeof (listener_tab[0]));
+  listener_tab[listener_count].fd = fd;
+  listener_tab[listener_count].group = group;
+  listener_count++;
+}
+
+/* Format the socket address `sa' for use in diagnostic messages. */
+char *
+format_sockaddr (char *buffer, size_t buflen, struct sockaddr *sa)
+{
+  char host[NI_MAXHOST];
+  char serv[NI_MAXSERV];
+
+  switch (sa->sa_family)
+    {
+    case AF_UNIX:
+      {
+	struct sockaddr_un *s_un = (struct sockaddr_un *) sa;
+	if (s_un->sun_path[0])
+	  snprintf (buffer, buflen, "unix:%.*s",
+		    (int) UNIX_PATH_MAX, s_un->sun_path);
+	else
+	  snprintf (buffer, buflen, "unix socket");
+      }
+      break;
+
+    case AF_INET:
+#ifdef AF_INET6
+    case AF_INET6:
+#endif
+      if (getnameinfo (sa,
+		       sa->sa_family == AF_INET ? sizeof (struct sockaddr_in)
+		                         : sizeof (struct sockaddr_in6),
+		       host, sizeof host, serv, sizeof serv,
+		       NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+	{
+	  snprintf (buffer, buflen,
+		    sa->sa_family == AF_INET ? "%s:%s" : "[%s]:%s",
+		    host, serv);
+	  break;
+	}
+      /* fall through */
+    default:
+      snprintf (buffer, buflen, _("address family %d"), sa->sa_family);
+    }
+  return buffer;
+}
+
+/* Store the numeric host address of `sa' in `buffer'.  UNIX domain
+   peers are reported as the loopback address, so that they match
+   127.0.0.1 in the TRANSLATION section (documented with `bind'). */
+char *
+format_sockaddr_host (char *buffer, size_t buflen, struct sockaddr *sa)
+{
+  switch (sa->sa_family)
+    {
+    case AF_INET:
+#ifdef AF_INET6
+    case AF_INET6:
+#endif
+      if (getnameinfo (sa,
+		       sa->sa_family == AF_INET ? sizeof (struct sockaddr_in)
+		                         : sizeof (struct sockaddr_in6),
+		       buffer, buflen, NULL, 0, NI_NUMERICHOST) == 0)
+	break;
+      /* fall through */
+    default:
+      snprintf (buffer, buflen, "127.0.0.1");
+    }
+  return buffer;
+}
+
+/* Return true if the connection from `sa' originates on this host. */
+int
+sockaddr_is_local (struct sockaddr *sa)
+{
+  switch (sa->sa_family)
+    {
+    case AF_UNIX:
+      return 1;
+
+    case AF_INET:
+      return ntohl (((struct sockaddr_in *) sa)->sin_addr.s_addr)
+	       == INADDR_LOOPBACK;
+
+#ifdef AF_INET6
+    case AF_INET6:
+      return IN6_IS_ADDR_LOOPBACK (&((struct sockaddr_in6 *) sa)->sin6_addr);
+#endif
+    }
+  return 0;
+}
+
+/* Return the port number of the TCP socket address `sa', or 0 */
+unsigned
+sockaddr_port (struct sockaddr *sa)
+{
+  switch (sa->sa_family)
+    {
+    case AF_INET:
+      return ntohs (((struct sockaddr_in *) sa)->sin_port);
+#ifdef AF_INET6
+    case AF_INET6:
+      return ntohs (((struct sockaddr_in6 *) sa)->sin6_port);
+#endif
+    }
+  return 0;
+}
+
+static void
+listen_unix (const char *path)
+{
+  struct sockaddr_un s_un;
+  struct stat st;
+  int fd;
+
+  if (strlen (path) >= sizeof s_un.sun_path)
+    anubis_error (EXIT_FAILURE, 0, _("%s: UNIX socket name too long"), path);
+
+  memset (&s_un, 0, sizeof s_un);
+  s_un.sun_family = AF_UNIX;
+  strcpy (s_un.sun_path, path);
+
+  /* Remove a stale socket left by a previous instance */
+  if (stat (path, &st) == 0)
+    {
+      if (!S_ISSOCK (st.st_mode))
+	anubis_error (EXIT_FAILURE, 0, _("%s: not a socket"), path);
+      unlink (path);
+    }
+
+  if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) == -1)
+    anubis_error (EXIT_FAILURE, errno, _("Cannot create stream socket"));
+  if (bind (fd, (struct sockaddr *) &s_un, sizeof s_un))
+    anubis_error (EXIT_FAILURE, errno, _("bind() failed for %s"), path);
+  if (listen (fd, listen_backlog))
+    anubis_error (EXIT_FAILURE, errno, _("listen() failed"));
+  info (VERBOSE, _("GNU Anubis bound to unix:%s"), path);
+  listener_add (fd, -1);
+}
+
+/* Create a TCP socket bound to `ai'.  If `reuseport' is set, the
+   SO_REUSEPORT option is set on it. */
+static int
+listen_inet (struct addrinfo *ai, int reuseport)
+{
+  int fd;
+  int true = 1;
+
+  if ((fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1)
+    anubis_error (EXIT_FAILURE, errno, _("Cannot create stream socket"));
+
+  setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &true, sizeof (true));
+#ifdef SO_REUSEPORT
+  if (reuseport
+      && setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &true, sizeof (true)))
+    anubis_error (EXIT_FAILURE, errno, _("cannot set SO_REUSEPORT"));
+#endif
+#if defined(AF_INET6) && defined(IPV6_V6ONLY)
+  /* Let IPv4 and IPv6 wildcard addresses be bound independently */
+  if (ai->ai_family == AF_INET6)
+    setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &true, sizeof (true));
+#endif
+
+  if (bind (fd, ai->ai_addr, ai->ai_addrlen))
+    {
+      char buf[LINEBUFFER];
+      anubis_error (EXIT_FAILURE, errno, _("bind() failed for %s"),
+		    format_sockaddr (buf, sizeof buf, ai->ai_addr));
+    }
+  if (listen (fd, listen_backlog))
+    anubis_error (EXIT_FAILURE, errno, _("listen() failed"));
+  return fd;
+}
+
+/* Open listening sockets for the address `spec'.  A host name is bound
+   on each address it resolves to.  An empty host means the IPv4
+   wildcard address. */
+static void
+listen_spec (const char *spec)
+{
+  char *host = NULL;
+  unsigned port = session.anubis_port;
+  char portbuf[16];
+  struct addrinfo hints, *res, *ai;
+  char buf[LINEBUFFER];
+  int family = AF_UNSPEC;
+  int rc;
+
+  if (strncmp (spec, "unix:", 5) == 0)
+    {
+      listen_unix (spec + 5);
+      return;
+    }
+  if (spec[0] == '/')
+    {
+      listen_unix (spec);
+      return;
+    }
+
+  if (spec[0] == '[')
+    {
+      const char *p = strchr (spec, ']');
+
+#ifdef AF_INET6
+      family = AF_INET6;
+#endif
+      if (!p || (p[1] && p[1] != ':'))
+	anubis_error (EXIT_FAILURE, 0, _("%s: invalid address"), spec);
+      if (p[1])
+	{
+	  char *dummy = NULL;
+	  parse_mtahost ((char *) p + 1, &dummy, &port);
+	  free (dummy);
+	}
+      assign_string_n (&host, spec + 1, p - spec - 1);
+    }
+  else
+    {
+      struct in_addr addr;
+
+      parse_mtahost ((char *) spec, &host, &port);
+      if (!host || !host[0] || inet_pton (AF_INET, host, &addr) == 1)
+	family = AF_INET;
+    }
+
+  memset (&hints, 0, sizeof hints);
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  snprintf (portbuf, sizeof portbuf, "%u", port);
+  rc = getaddrinfo (host && host[0] ? host : NULL, portbuf, &hints, &res);
+  if (rc)
+    anubis_error (EXIT_FAILURE, 0, _("%s: cannot resolve: %s"),
+		  spec, gai_strerror (rc));
+  free (host);
+
+  for (ai = res; ai; ai = ai->ai_next)
+    {
+      if (group_count > 1)
+	{
+	  unsigned i;
+
+	  for (i = 0; i < group_count; i++)
+	    listener_add (listen_inet (ai, 1), i);
+	}
+      else
+	listener_add (listen_inet (ai, 0), -1);
+      info (VERBOSE, _("GNU Anubis bound to %s"),
+	    format_sockaddr (buf, sizeof buf, ai->ai_addr));
+    }
+  freeaddrinfo (res);
+}
+
+/* Open all configured listening sockets.  If no address has been
+   configured, listen on the default port. */
+void
+open_listeners (void)
+{
+  group_count = 1;
+#ifdef SO_REUSEPORT
+  if (reuseport_groups > 1)
+    group_count = reuseport_groups;
+#else
+  if (reuseport_groups > 1)
+    anubis_warning (0, _("SO_REUSEPORT is not supported on this system"));
+#endif
+
+  if (bind_list && list_count (bind_list))
+    {
+      ITERATOR itr = iterator_create (bind_list);
+      char *spec;
+
+      for (spec = iterator_first (itr); spec; spec = iterator_next (itr))
+	listen_spec (spec);
+      iterator_destroy (&itr);
+    }
+  else
+    {
+      char buf[16];
+      snprintf (buf, sizeof buf, "%u", session.anubis_port);
+      listen_spec (buf);
+    }
+}
+
+/* Use the already open socket `fd' as the only listener. */
+void
+adopt_listener (int fd)
+{
+  if (listen (fd, listen_backlog))
+    anubis_error (EXIT_FAILURE, errno, _("listen(%d) failed"), fd);
+  group_count = 1;
+  listener_add (fd, -1);
+}
+
+/* Close all listening sockets. */
+void
+listeners_close (void)
+{
+  size_t i;
+
+  for (i = 0; i < listener_count; i++)
+    close (listener_tab[i].fd);
+  listener_count = 0;
+}
+
+#define LISTEN_FDS_ENV "ANUBIS_LISTEN_FDS"
+
+/* Store the descriptors and groups of the listening sockets in the
+   environment, so that they are inherited by a new master process
+   (see prefork.c).  The format is FD:GROUP[,FD:GROUP...] */
+void
+listeners_export (void)
+{
+  char *buf = xmalloc (listener_count * 24 + 1);
+  char *p = buf;
+  size_t i;
+
+  *p = 0;
+  for (i = 0; i < listener_count; i++)
+    {
+      fcntl (listener_tab[i].fd, F_SETFD, 0);
+      p += sprintf (p, "%s%d:%d", i ? "," : "",
+		    listener_tab[i].fd, listener_tab[i].group);
+    }
+  setenv (LISTEN_FDS_ENV, buf, 1);
+  free (buf);
+}
+
+/* Take over the listening sockets passed by the previous master.
+   Return true if there were any. */
+int
+listeners_import (void)
+{
+  char *env = getenv (LISTEN_FDS_ENV);
+  char *p;
+
+  if (!env)
+    return 0;
+
+  for (p = env; *p; )
+    {
+      char *q;
+      long fd, group;
+
+      fd = strtol (p, &q, 10);
+      if (*q != ':')
+	break;
+      group = strtol (q + 1, &q, 10);
+      if ((*q && *q != ',') || fd < 0 || group < -1
+	  || fcntl (fd, F_GETFD) == -1)
+	break;
+      listener_add (fd, group);
+      if ((unsigned) (group + 1) > group_count)
+	group_count = group + 1;
+      p = *q ? q + 1 : q;
+    }
+  if (*p)
+    anubis_error (EXIT_FAILURE, 0, _("invalid value of %s: %s"),
+		  LISTEN_FDS_ENV, env);
+  unsetenv (LISTEN_FDS_ENV);
+  info (VERBOSE,
+	ngettext ("Inherited %lu listening socket.",
+		  "Inherited %lu listening sockets.",
+		  listener_count),
+	(unsigned long) listener_count);
+  return listener_count > 0;
+}
+
+/* Return the number of worker groups. */
+unsigned
+listener_groups (void)
+{
+  return group_count;
+}
+
+/* Add the sockets to be watched by workers of the given group to
+   `fds'.  If `group' is -1, add all sockets.  Return the largest
+   descriptor added, or `maxfd' if there were none. */
+int
+listener_fdset (int group, fd_set *fds, int maxfd)
+{
+  size_t i;
+
+  for (i = 0; i < listener_count; i++)
+    if (group == -1 || listener_tab[i].group == -1
+	|| listener_tab[i].group == group)
+      {
+	FD_SET (listener_tab[i].fd, fds);
+	if (listener_tab[i].fd > maxfd)
+	  maxfd = listener_tab[i].fd;
+      }
+  return maxfd;
+}
+
+/* Accept a connection on any of the listening sockets of `group' that
+   are set in `fds'.  The sockets are non-blocking, so a connection
+   that has already been taken by another process is skipped.  Return
+   the new socket, or -1 if no connection was accepted. */
+int
+listener_accept (int group, fd_set *fds, struct sockaddr *addr,
+		 socklen_t *addrlen)
+{
+  size_t i;
+  socklen_t len = *addrlen;
+
+  for (i = 0; i < listener_count; i++)
+    {
+      int fd;
+
+      if (!(group == -1 || listener_tab[i].group == -1
+	    || listener_tab[i].group == group)
+	  || !FD_ISSET (listener_tab[i].fd, fds))
+	continue;
+
+      *addrlen = len;
+      fd = accept (listener_tab[i].fd, addr, addrlen);
+      if (fd >= 0)
+	{
+	  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK);
+	  if (addr->sa_family != AF_UNIX)
+	    socket_nodelay (fd);
+	  return fd;
+	}
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+	  && errno != ECONNABORTED)
+	anubis_error (0, errno, _("accept() failed"));
+    }
+  return -1;
+}
+
+/* Put all listening sockets into non-blocking mode. */
+void
+listeners_nonblock (void)
+{
+  size_t i;
+
+  for (i = 0; i < listener_count; i++)
+    fcntl (listener_tab[i].fd, F_SETFL,
+	   fcntl (listener_tab[i].fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* EOF */
@@ -85,6 +85,7 @@ main (int argc, char *argv[])
    */
 
   SETVBUF (stderr, NULL, _IOLBF, 0);
+  upgrade_save_argv (argc, argv);
   get_options (argc, argv);
   anubis_getlogin (&session.supervisor);
   assign_string (&incoming_mail_rule, "INCOMING");
@@ -125,6 +126,8 @@ main (int argc, char *argv[])
       open_rcfile (CF_SUPERVISOR);
       process_rcfile (CF_INIT);
     }
+  if (options.status)
+    exit (scoreboard_status ());
 
   /* DEBUG */
 
@@ -162,26 +165,31 @@ main (int argc, char *argv[])
 
   if (anubis_mode == anubis_mda)  /* Mail Delivery Agent */
     mda ();
+  else if (listeners_import ())   /* binary upgrade */
+    {
+      if (topt & T_FOREGROUND_INIT)
+	topt |= T_FOREGROUND;
+      else
+	daemonize (0);
+      loop ();
+    }
   else if (topt & T_PASSFD)
     {
-      int sd = 3;
-      if (listen (sd, 5))
-	anubis_error (EXIT_FAILURE, errno, _("listen(3) failed"));
+      adopt_listener (3);
       kill (getppid (), SIGUSR1);
-      loop (sd);
+      loop ();
     }
   else if (topt & T_STDINOUT)     /* stdin/stdout */
     stdinout ();
   else
     {				  /* daemon */
-      int sd_bind;
-      sd_bind = bind_and_listen (session.anubis, session.anubis_port);
+      open_listeners ();
       
       if (topt & T_FOREGROUND_INIT)
 	topt |= T_FOREGROUND;
       else
-	daemonize ();
-      loop (sd_bind);
+	daemonize (1);
+      loop ();
     }
   return 0;
 }
@@ -91,9 +91,10 @@ translate_parser (EVAL_ENV env, int key, ANUBIS_LIST arglist, void *inv_data)
   char a2[65];
   char user[65];
   char address[65];
-  unsigned long inaddr;
+  struct addrinfo *res;
   struct sockaddr_in addr;
   size_t argc;
+  int rc;
 
   if (!xlat_env || xlat_env->stop)
     return;
@@ -137,35 +138,16 @@ translate_parser (EVAL_ENV env, int key, ANUBIS_LIST arglist, void *inv_data)
       else
 	safe_strcpy (address, xlat_env->translate);
 
-      inaddr = inet_addr (address);
-      if (inaddr != INADDR_NONE)
-	memcpy (&addr.sin_addr, &inaddr, sizeof (inaddr));
-      else
+      rc = resolve_host (address, 0, AF_INET, &res);
+      if (rc)
 	{
-	  struct hostent *hp = 0;
-	  hp = gethostbyname (address);
-	  if (hp == 0)
-	    {
-	      cu = 0;
-	      hostname_error (address);
-	      break;		/* failed */
-	    }
-	  else
-	    {
-	      if (hp->h_length != 4 && hp->h_length != 8)
-		{
-		  eval_error (0, env,
-			      _("Illegal address length received for host %s"),
-			      address);
-		  cu = 0;
-		  break;	/* failed */
-		}
-	      else
-		{
-		  memcpy (&addr.sin_addr.s_addr, hp->h_addr, hp->h_length);
-		}
-	    }
+	  cu = 0;
+	  anubis_error (EXIT_FAILURE, 0, _("Cannot resolve %s: %s"),
+			address, resolve_strerror (rc));
+	  break;		/* failed */
 	}
+      memcpy (&addr, res->ai_addr, sizeof (addr));
+      resolve_free (res);
 
       safe_strcpy (a2, inet_ntoa (addr.sin_addr));
       if (cu)
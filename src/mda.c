@@ -25,6 +25,8 @@
 #include <obstack.h>
 
 char *from_address; /* Sender address */
+unsigned mda_max_deliveries = 4; /* Maximum number of local deliveries
+				    run at a time */
 
 /* Expand a meta-variable. Available meta-variables are:
    
@@ -123,11 +125,30 @@ static char *smtp_client_state_descr[] =
     /* smtp_client_state_stop */ N_("session end")
   };
 
+/* Remote delivery.
+
+   The message is delivered to all recipients in a single transaction:
+   MAIL FROM, one RCPT TO per recipient, and DATA.  The RULE section
+   is applied once, since nothing in it depends on the recipient.  A
+   recipient rejected by the server is reported, and the message is
+   sent to the rest.  The exit status is EX_TEMPFAIL if any recipient
+   failed temporarily, EX_UNAVAILABLE if any was rejected permanently,
+   and EX_OK otherwise.
+
+   If the server supports pipelining (RFC 2920), MAIL FROM, the RCPT
+   commands and DATA are sent without waiting for the replies, in
+   groups of at most PIPELINE_MAX commands, so that the replies never
+   fill the socket buffers.  The replies are then read in order. */
+
+#define PIPELINE_MAX 100
+
 struct smtp_client_context
 {
   MESSAGE msg;
   enum smtp_client_state state;
-  int rcpt;
+  int pipelining;		/* The server supports PIPELINING */
+  int data_sent;		/* DATA has been sent along with RCPT */
+  int accepted;			/* Number of recipients accepted */
   int status;
   ANUBIS_SMTP_REPLY reply;
 };
@@ -204,7 +225,9 @@ smtp_client_helo (struct smtp_client_context *ctx)
   swrite (CLIENT, remote_server, CRLF);
   smtp_reply_get (CLIENT, remote_server, ctx->reply);
 
-  if (!smtp_reply_code_eq (ctx->reply, "250"))
+  if (smtp_reply_code_eq (ctx->reply, "250"))
+    ctx->pipelining = smtp_reply_has_capa (ctx->reply, "PIPELINING", NULL);
+  else
     {
       /* Try HELO */
       swrite (CLIENT, remote_server, "HELO");
@@ -231,12 +254,102 @@ smtp_client_helo (struct smtp_client_context *ctx)
   ctx->state = smtp_client_state_mail;
 }  
 
-void
-smtp_client_mail (struct smtp_client_context *ctx)
+static void
+send_mail (void)
 {
   swrite (CLIENT, remote_server, "MAIL FROM:<");
   swrite (CLIENT, remote_server, from_address);
   swrite (CLIENT, remote_server, ">"CRLF);
+}
+
+static void
+send_rcpt (const char *addr)
+{
+  swrite (CLIENT, remote_server, "RCPT TO:<");
+  swrite (CLIENT, remote_server, addr); /* FIXME: normalize */
+  swrite (CLIENT, remote_server, ">"CRLF);
+}
+
+/* Account for the reply to RCPT TO:<`addr'> */
+static void
+rcpt_reply (struct smtp_client_context *ctx, const char *addr)
+{
+  size_t i;
+  const char *p;
+
+  if (smtp_reply_code_eq (ctx->reply, "25"))
+    {
+      ctx->accepted++;
+      return;
+    }
+  anubis_error (0, 0, _("recipient %s rejected"), addr);
+  anubis_error (0, 0, _("server reply follows:"));
+  for (i = 0; (p = smtp_reply_line (ctx->reply, i)); i++)
+    anubis_error (0, 0, "%s", p);
+  if (smtp_reply_code_eq (ctx->reply, "4"))
+    ctx->status = EX_TEMPFAIL;
+  else if (ctx->status != EX_TEMPFAIL)
+    ctx->status = EX_UNAVAILABLE;
+}
+
+/* Send MAIL FROM, the RCPT commands and DATA without waiting for the
+   replies, and process the replies to MAIL and RCPT.  The reply to
+   DATA is left for smtp_client_data. */
+static void
+smtp_client_pipeline (struct smtp_client_context *ctx)
+{
+  int i = 0, start, mail_ok = 1;
+
+  send_mail ();
+  do
+    {
+      start = i;
+      for (; i < x_argc && i - start < PIPELINE_MAX; i++)
+	send_rcpt (x_argv[i]);
+      if (i == x_argc)
+	{
+	  swrite (CLIENT, remote_server, "DATA"CRLF);
+	  ctx->data_sent = 1;
+	}
+      if (start == 0)
+	{
+	  smtp_reply_get (CLIENT, remote_server, ctx->reply);
+	  mail_ok = smtp_reply_code_eq (ctx->reply, "250");
+	}
+      if (mail_ok)
+	{
+	  for (; start < i; start++)
+	    {
+	      smtp_reply_get (CLIENT, remote_server, ctx->reply);
+	      rcpt_reply (ctx, x_argv[start]);
+	    }
+	}
+      else
+	{
+	  /* Read the replies to the rest of the commands sent so far,
+	     keeping the reply to MAIL FROM */
+	  ANUBIS_SMTP_REPLY reply = smtp_reply_new ();
+
+	  for (; start < i + ctx->data_sent; start++)
+	    smtp_reply_get (CLIENT, remote_server, reply);
+	  smtp_reply_free (reply);
+	  smtp_client_failure (ctx);
+	  return;
+	}
+    }
+  while (i < x_argc);
+  ctx->state = smtp_client_state_data;
+}
+
+void
+smtp_client_mail (struct smtp_client_context *ctx)
+{
+  if (ctx->pipelining)
+    {
+      smtp_client_pipeline (ctx);
+      return;
+    }
+  send_mail ();
   smtp_reply_get (CLIENT, remote_server, ctx->reply);
   if (smtp_reply_code_eq (ctx->reply, "250"))
     ctx->state = smtp_client_state_rcpt;
@@ -250,15 +363,13 @@ smtp_client_mail (struct smtp_client_context *ctx)
 void
 smtp_client_rcpt (struct smtp_client_context *ctx)
 {
-  char *addr = x_argv[ctx->rcpt]; /* FIXME: normalize */
-  swrite (CLIENT, remote_server, "RCPT TO:<");
-  swrite (CLIENT, remote_server, addr);
-  swrite (CLIENT, remote_server, ">"CRLF);
-  smtp_reply_get (CLIENT, remote_server, ctx->reply);
-  if (!smtp_reply_code_eq (ctx->reply, "250"))
+  int i;
+
+  for (i = 0; i < x_argc; i++)
     {
-      smtp_client_failure (ctx);
-      return;
+      send_rcpt (x_argv[i]);
+      smtp_reply_get (CLIENT, remote_server, ctx->reply);
+      rcpt_reply (ctx, x_argv[i]);
     }
   ctx->state = smtp_client_state_data;
 }
@@ -268,8 +379,29 @@ smtp_client_data (struct smtp_client_context *ctx)
 {
   MESSAGE tmp;
   
-  swrite (CLIENT, remote_server, "DATA"CRLF);
+  if (!ctx->data_sent)
+    {
+      if (ctx->accepted == 0)
+	{
+	  /* All recipients have been rejected */
+	  ctx->state = smtp_client_state_quit;
+	  return;
+	}
+      swrite (CLIENT, remote_server, "DATA"CRLF);
+    }
   smtp_reply_get (CLIENT, remote_server, ctx->reply);
+  if (ctx->accepted == 0)
+    {
+      if (smtp_reply_code_eq (ctx->reply, "354"))
+	{
+	  /* The server should have refused DATA.  Send an empty
+	     message to end the transaction. */
+	  swrite (CLIENT, remote_server, "." CRLF);
+	  smtp_reply_get (CLIENT, remote_server, ctx->reply);
+	}
+      ctx->state = smtp_client_state_quit;
+      return;
+    }
   if (!smtp_reply_code_eq (ctx->reply, "354"))
     {
       smtp_client_failure (ctx);
@@ -299,19 +431,12 @@ smtp_client_data (struct smtp_client_context *ctx)
 void
 smtp_client_quit (struct smtp_client_context *ctx)
 {
-  if (++ctx->rcpt < x_argc)
-    {
-      ctx->state = smtp_client_state_mail;
-    }
+  swrite (CLIENT, remote_server, "QUIT"CRLF);
+  smtp_reply_get (CLIENT, remote_server, ctx->reply);
+  if (smtp_reply_code_eq (ctx->reply, "2"))
+    ctx->state = smtp_client_state_stop;
   else
-    {
-      swrite (CLIENT, remote_server, "QUIT"CRLF);
-      smtp_reply_get (CLIENT, remote_server, ctx->reply);
-      if (smtp_reply_code_eq (ctx->reply, "2"))
-	ctx->state = smtp_client_state_stop;
-      else
-	smtp_client_failure (ctx);
-    }
+    smtp_client_failure (ctx);
 }
 
 static int
@@ -319,10 +444,14 @@ deliver_remote (MESSAGE msg)
 {
   struct smtp_client_context ctx;
   remote_server = make_remote_connection (session.mta, session.mta_port);
+  if (!remote_server)
+    return EX_TEMPFAIL;
 
   ctx.msg = msg;
   ctx.state = smtp_client_state_init;
-  ctx.rcpt = 0;
+  ctx.pipelining = 0;
+  ctx.data_sent = 0;
+  ctx.accepted = 0;
   ctx.status = 0;
   ctx.reply = smtp_reply_new ();
 
@@ -439,11 +568,11 @@ deliver_local_child (const char *recipient, MESSAGE msg)
     }
 }  
 
-/* Deliver message to the recipient */
-static void
+/* Start delivering the message to the recipient.  Return the PID
+   of the child process, or -1 if it cannot be created. */
+static pid_t
 deliver_local (const char *recipient, MESSAGE msg)
 {
-  int status;
   pid_t pid;
 
   info (VERBOSE, _("Delivering to %s"), recipient);
@@ -451,7 +580,10 @@ deliver_local (const char *recipient, MESSAGE msg)
   pid = fork ();
 
   if (pid == (pid_t)-1)
-    anubis_error (EX_TEMPFAIL, errno, _("Cannot fork"));
+    {
+      anubis_error (0, errno, _("Cannot fork"));
+      return pid;
+    }
 
   if (pid == 0)
     {
@@ -460,35 +592,97 @@ deliver_local (const char *recipient, MESSAGE msg)
       assign_string (&session.clientname, recipient);
       deliver_local_child (recipient, msg);
     }
-  else
+
+  /* Master */
+  info (VERBOSE, _("Started MDA child %lu"), (unsigned long)pid);
+  return pid;
+}
+
+/* Return the exit code of the MDA child `pid', given its wait
+   `status'. */
+static int
+deliver_local_status (pid_t pid, int status)
+{
+  if (WIFEXITED (status))
     {
-      /* Master */
+      status = WEXITSTATUS (status);
+      info (VERBOSE, _("MDA child %lu exited with code %d"),
+	    (unsigned long)pid, status);
+      return status;
+    }
+  else if (WIFSIGNALED (status))
+    anubis_error (0, 0, _("MDA child %lu terminated on signal %d"),
+		  (unsigned long) pid, WTERMSIG (status));
+  else
+    anubis_error (0, 0, _("MDA child %lu terminated"), (unsigned long) pid);
+  return EX_SOFTWARE;
+}
 
-      info (VERBOSE, _("Started MDA child %lu"), (unsigned long)pid);
+/* Deliver the message to all recipients, running at most
+   `mda_max_deliveries' (unless 0) deliveries at a time.  Once a
+   delivery has failed, no more are started.  Return the exit code of
+   the first recipient, in command line order, whose delivery failed,
+   or EX_OK.  Thus, the result is the same as if the recipients were
+   delivered to one after another. */
+static int
+deliver_local_all (MESSAGE msg)
+{
+  pid_t *pids = xcalloc (x_argc, sizeof (pids[0]));
+  int *codes = xcalloc (x_argc, sizeof (codes[0]));
+  unsigned running = 0;
+  int next = 0, failed = 0;
+  int i, rc = EX_OK;
 
-      waitpid (pid, &status, 0);
-      if (WIFEXITED (status))
-	{
-	  status = WEXITSTATUS (status);
-	  info (VERBOSE, _("MDA child %lu exited with code %d"),
-		(unsigned long)pid, status);
-	  if (status)
-	    exit (status);
-	}
-      else if (WIFSIGNALED (status))
+  while (running || (!failed && next < x_argc))
+    {
+      pid_t pid;
+      int status;
+
+      if (!failed && next < x_argc
+	  && (mda_max_deliveries == 0 || running < mda_max_deliveries))
 	{
-	  anubis_error (EX_SOFTWARE, 0,
-			_("MDA child %lu terminated on signal %d"),
-			(unsigned long) pid,
-			WTERMSIG (status));
+	  pid = deliver_local (x_argv[next], msg);
+	  if (pid == (pid_t)-1)
+	    {
+	      codes[next] = EX_TEMPFAIL;
+	      failed = 1;
+	    }
+	  else
+	    {
+	      pids[next] = pid;
+	      running++;
+	    }
+	  next++;
+	  continue;
 	}
-      else
+
+      pid = waitpid ((pid_t)-1, &status, 0);
+      if (pid == (pid_t)-1)
 	{
-	  anubis_error (EX_SOFTWARE, 0,
-			_("MDA child %lu terminated"),
-			(unsigned long) pid);
+	  if (errno == EINTR)
+	    continue;
+	  anubis_error (0, errno, "waitpid");
+	  break;
 	}
+      for (i = 0; i < next && pids[i] != pid; i++)
+	;
+      if (i == next)
+	continue;
+      pids[i] = 0;
+      running--;
+      if ((codes[i] = deliver_local_status (pid, status)) != EX_OK)
+	failed = 1;
     }
+
+  for (i = 0; i < next; i++)
+    if (codes[i] != EX_OK)
+      {
+	rc = codes[i];
+	break;
+      }
+  free (pids);
+  free (codes);
+  return rc;
 }
 
 /* Extract sender e-mail from the UNIX 'From ' line and save it in
@@ -560,7 +754,6 @@ ensure_sender_address (MESSAGE msg)
 void
 mda ()
 {
-  char **p;
   MESSAGE msg;
   char *buf = NULL;
   size_t size = 0;
@@ -589,16 +782,15 @@ mda ()
   free (buf);
   ensure_sender_address (msg);
   collect_body (msg);
+  if (message_body_error (msg))
+    anubis_error (EX_TEMPFAIL, 0, _("message body too large to store"));
 
   signal (SIGCHLD, SIG_DFL);
   if (!x_argc)
     anubis_error (EX_USAGE, 0, _("no recipient names given"));
 
   if (topt & T_LOCAL_MTA)
-    {
-      for (p = x_argv; *p; p++)
-	deliver_local (*p, msg);
-    }
+    rc = deliver_local_all (msg);
   else
     rc = deliver_remote (msg);
   
@@ -21,22 +21,206 @@
 #include "headers.h"
 #include "extern.h"
 
-#define obstack_chunk_alloc malloc
-#define obstack_chunk_free free
-#include <obstack.h>
-
 struct message_struct
 {
   char id[MSGIDBOUND];          /* Message ID */
   ANUBIS_LIST commands;	        /* Associative list of SMTP commands */
   ANUBIS_LIST header;		/* Associative list of RFC822 headers */
+  struct header_index *index;	/* Index of `header', or NULL */
+  unsigned header_gen;		/* Generation of `header' */
   ANUBIS_LIST mime_hdr;	        /* List of lines before the first boundary
 				   marker */
-  char *body;			/* Message body */
+  struct textbuf body;		/* Message body */
   char *boundary;		/* Additional data */
+  int deferred;			/* Body operations are deferred */
+  struct body_stage *stages;	/* Deferred body operations */
+  void (*output) (const char *, size_t, void *); /* Where the processed
+						    body goes */
+  void *output_data;
 };
 
-
+/* Deferred body processing.
+
+   If the RULE section only appends text to the body, replaces it, or
+   modifies it line by line (see rcfile_section_body_use), it may be
+   run before the body is read, after message_defer_body has been
+   called.  The body operations are then recorded as a chain of stages
+   instead of being carried out.  The body is afterwards passed through
+   the stages piece by piece as it arrives (message_body_write), and
+   the output of the last stage is handed to the function given to
+   message_body_begin.  Only a partial line is held by each stage, so
+   the memory used does not depend on the size of the body.  At the
+   end of the body (message_body_end), each stage in turn emits the
+   text it appends or substitutes. */
+
+enum stage_type
+  {
+    stage_modify,		/* Replace regex matches in each line */
+    stage_append,		/* Append text */
+    stage_replace		/* Replace the body with text */
+  };
+
+struct body_stage
+{
+  struct body_stage *next;
+  enum stage_type type;
+  RC_REGEX *regex;		/* Regex to match (stage_modify) */
+  char *text;			/* Replacement or appended text */
+  char *line;			/* Line being collected (stage_modify) */
+  size_t size;			/* Size of `line' */
+  size_t len;			/* Length of the line collected so far */
+  struct regex_match match;	/* Matches in the line (stage_modify) */
+};
+
+static void
+add_stage (MESSAGE msg, enum stage_type type, RC_REGEX *regex, char *text)
+{
+  struct body_stage *st = xzalloc (sizeof (*st)), **p;
+
+  st->type = type;
+  st->regex = regex;
+  st->text = text;
+  for (p = &msg->stages; *p; p = &(*p)->next)
+    ;
+  *p = st;
+}
+
+static void
+free_stages (MESSAGE msg)
+{
+  while (msg->stages)
+    {
+      struct body_stage *next = msg->stages->next;
+      free (msg->stages->text);
+      free (msg->stages->line);
+      anubis_regex_match_free (&msg->stages->match);
+      free (msg->stages);
+      msg->stages = next;
+    }
+}
+
+/* Header index.
+
+   Conditions on headers look up the occurrences of a header name in
+   an index of the header list, rather than comparing the name of each
+   header with it.  The index maps each header name atom (see atom.c)
+   to the headers with that name, in the order they appear in the
+   message.  It is built on first use, kept up to date as headers are
+   appended, and discarded when headers are removed, renamed or
+   replaced.  For this reason, the list returned by message_get_header
+   must not be modified directly. */
+
+struct header_occ
+{
+  ASSOC **v;			/* Headers with that name */
+  size_t count;			/* Number of elements in v */
+  size_t max;			/* Allocated size of v */
+};
+
+struct header_index
+{
+  size_t natoms;		/* Number of atoms when it was built */
+  struct header_occ *occ;	/* Occurrences, indexed by atom */
+  int nokey;			/* There are headers with no name */
+};
+
+/* Each change to the headers of any message gives them a new
+   generation number, so that what has been computed from the headers
+   can be cached along with their generation (see rc-gram.y). */
+static unsigned header_generation;
+
+static void
+header_changed (MESSAGE msg)
+{
+  msg->header_gen = ++header_generation;
+}
+
+/* Return the generation of the headers of `msg' */
+unsigned
+message_header_generation (MESSAGE msg)
+{
+  return msg->header_gen;
+}
+
+static void
+header_index_free (MESSAGE msg)
+{
+  struct header_index *ind = msg->index;
+  size_t i;
+
+  if (!ind)
+    return;
+  for (i = 0; i < ind->natoms; i++)
+    free (ind->occ[i].v);
+  free (ind->occ);
+  free (ind);
+  msg->index = NULL;
+}
+
+static void
+header_index_add (struct header_index *ind, ASSOC *asc)
+{
+  int atom;
+  struct header_occ *occ;
+
+  if (!asc->key)
+    {
+      ind->nokey = 1;
+      return;
+    }
+  atom = header_atom_lookup (asc->key);
+  if (atom < 0 || (size_t) atom >= ind->natoms)
+    return;
+  occ = &ind->occ[atom];
+  if (occ->count == occ->max)
+    occ->v = x2nrealloc (occ->v, &occ->max, sizeof (occ->v[0]));
+  occ->v[occ->count++] = asc;
+}
+
+/* Return the header index of `msg', building it if necessary */
+static struct header_index *
+header_index_get (MESSAGE msg)
+{
+  struct header_index *ind = msg->index;
+  ITERATOR itr;
+  ASSOC *asc;
+
+  /* Rebuild the index if atoms have been added since it was built,
+     e.g. by parsing the user configuration file */
+  if (ind && ind->natoms == header_atom_count ())
+    return ind;
+  header_index_free (msg);
+  ind = xzalloc (sizeof (*ind));
+  ind->natoms = header_atom_count ();
+  ind->occ = xcalloc (ind->natoms + 1, sizeof (ind->occ[0]));
+  itr = iterator_create (msg->header);
+  for (asc = iterator_first (itr); asc; asc = iterator_next (itr))
+    header_index_add (ind, asc);
+  iterator_destroy (&itr);
+  msg->index = ind;
+  return ind;
+}
+
+/* Look up the headers of `msg' whose name is `atom'.  On success,
+   store in `*pv' and `*pn' the array of headers and its size, and
+   return 0.  Return -1 if the index cannot be used: `atom' is negative
+   or the message has headers with no name, which match any name. */
+int
+message_find_header (MESSAGE msg, int atom, ASSOC ***pv, size_t *pn)
+{
+  struct header_index *ind;
+
+  if (atom < 0)
+    return -1;
+  ind = header_index_get (msg);
+  if (ind->nokey || (size_t) atom >= ind->natoms)
+    return -1;
+  *pv = ind->occ[atom].v;
+  *pn = ind->occ[atom].count;
+  return 0;
+}
+
+
 #define IDSEQLEN      60
 #define IDTIMLEN      62
 
@@ -72,8 +256,10 @@ MESSAGE
 message_new ()
 {
   MESSAGE msg = xzalloc (sizeof (*msg));
+  textbuf_init (&msg->body);
   msg->header = list_create ();
   msg->commands = list_create ();
+  header_changed (msg);
   create_msgid (msg->id);
   return msg;
 }
@@ -83,15 +269,19 @@ message_reset (MESSAGE msg)
 {
   destroy_assoc_list (&msg->commands);
   destroy_assoc_list (&msg->header);
+  header_index_free (msg);
   destroy_string_list (&msg->mime_hdr);
 
-  free (msg->body);
+  textbuf_free (&msg->body);
   free (msg->boundary);
+  free_stages (msg);
 
   memset (msg, 0, sizeof (*msg));
+  textbuf_init (&msg->body);
   create_msgid (msg->id);
   msg->header = list_create ();
   msg->commands = list_create ();
+  header_changed (msg);
 }  
 
 /* FIXME: Implement copy-on-write */
@@ -100,10 +290,12 @@ message_free (MESSAGE msg)
 {
   destroy_assoc_list (&msg->commands);
   destroy_assoc_list (&msg->header);
+  header_index_free (msg);
   destroy_string_list (&msg->mime_hdr);
 
-  free (msg->body);
+  textbuf_free (&msg->body);
   free (msg->boundary);
+  free_stages (msg);
   free (msg);
 }
 
@@ -115,67 +307,82 @@ message_dup (MESSAGE msg)
   newmsg->header = assoc_list_dup (msg->header);
   msg->mime_hdr = string_list_dup (msg->mime_hdr);
   
-  newmsg->body = msg->body ? xstrdup (msg->body): NULL;
+  if (msg->body.buf)
+    textbuf_append (&newmsg->body, msg->body.buf, msg->body.level);
   newmsg->boundary = msg->boundary ? xstrdup (msg->boundary) : NULL;
   return newmsg;
 }
 
 
+/* Return a copy of `value' in which each `&' is replaced with
+   `old_value' and `\&' with a literal `&', and free `old_value'.
+   Other characters following a backslash are kept along with it. */
 static char *
 expand_ampersand (char *value, char *old_value)
 {
-  char *p;
+  size_t old_length = strlen (old_value), len = 0;
+  char *v, *p, *q;
 
-  p = strchr (value, '&');
-  if (!p)
+  /* Compute the length first, so that the result is built in place */
+  for (v = value; *v; v++)
     {
-      free (old_value);
-      p = strdup (value);
+      if (*v == '&')
+	len += old_length;
+      else if (*v == '\\' && v[1])
+	{
+	  len += v[1] == '&' ? 1 : 2;
+	  v++;
+	}
+      else
+	len++;
     }
-  else
-    {
-      struct obstack stk;
-      int old_length = strlen (old_value);
 
-      obstack_init (&stk);
-      for (; *value; value++)
+  p = q = xmalloc (len + 1);
+  for (v = value; *v; v++)
+    {
+      if (*v == '&')
 	{
-	  switch (*value)
-	    {
-	    case '\\':
-	      value++;
-	      if (*value != '&')
-		obstack_1grow (&stk, '\\');
-	      obstack_1grow (&stk, *value);
-	      break;
-	    case '&':
-	      obstack_grow (&stk, old_value, old_length);
-	      break;
-	    default:
-	      obstack_1grow (&stk, *value);
-	    }
+	  memcpy (q, old_value, old_length);
+	  q += old_length;
 	}
-      obstack_1grow (&stk, 0);
-      p = strdup (obstack_finish (&stk));
-      obstack_free (&stk, NULL);
+      else if (*v == '\\' && v[1])
+	{
+	  if (v[1] != '&')
+	    *q++ = '\\';
+	  *q++ = *++v;
+	}
+      else
+	*q++ = *v;
     }
+  *q = 0;
+  free (old_value);
   return p;
 }
 
-
+
 ANUBIS_LIST 
 message_get_header (MESSAGE msg)
 {
   return msg->header;
 }
 
+/* Append the header `asc' to `msg' */
+void
+message_append_header (MESSAGE msg, ASSOC *asc)
+{
+  list_append (msg->header, asc);
+  if (msg->index)
+    header_index_add (msg->index, asc);
+  header_changed (msg);
+}
+
 void
 message_add_header (MESSAGE msg, char *hdr, char *value)
 {
   ASSOC *asc = xmalloc (sizeof (*asc));
   asc->key = strdup (hdr);
   asc->value = strdup (value);
-  list_append (msg->header, asc);
+  message_append_header (msg, asc);
 }
 
 void
@@ -183,31 +390,37 @@ message_remove_headers (MESSAGE msg, RC_REGEX *regex)
 {
   ASSOC *asc;
   ITERATOR itr;
+  ANUBIS_LIST keep = list_create ();
 
+  /* Copy the headers to keep to a new list, rather than removing the
+     others one by one, each of which would scan the list */
   itr = iterator_create (msg->header);
   for (asc = iterator_first (itr); asc; asc = iterator_next (itr))
     {
-      char **rv;
-      int rc;
-
-      if (anubis_regex_match (regex, asc->key, &rc, &rv))
-	{
-	  list_remove (msg->header, asc, NULL);
-	  assoc_free (asc);
-	}
-      if (rc)
-	argcv_free (-1, rv);
+      if (asc->key && anubis_regex_match (regex, asc->key, NULL))
+	assoc_free (asc);
+      else
+	list_append (keep, asc);
     }
   iterator_destroy (&itr);
+  list_destroy (&msg->header, NULL, NULL);
+  msg->header = keep;
+  header_index_free (msg);
+  header_changed (msg);
 }
 
 void
 message_replace_header (MESSAGE msg, ANUBIS_LIST list)
 {
   destroy_assoc_list (&msg->header);
+  header_index_free (msg);
   msg->header = list;
+  header_changed (msg);
 }
 
+/* Matches of header names and commands, reused by all modifications */
+static struct regex_match key_match;
+
 void
 message_modify_headers (MESSAGE msg, RC_REGEX *regex, char *key2,
 			char *value)
@@ -218,26 +431,22 @@ message_modify_headers (MESSAGE msg, RC_REGEX *regex, char *key2,
   itr = iterator_create (msg->header);
   for (asc = iterator_first (itr); asc; asc = iterator_next (itr))
     {
-      char **rv;
-      int rc;
-
-      if (asc->key && anubis_regex_match (regex, asc->key, &rc, &rv))
+      if (asc->key && anubis_regex_match (regex, asc->key, &key_match))
 	{
 	  if (key2)
 	    {
+	      char *key = xstrdup (anubis_regex_expand (&key_match, key2));
 	      free (asc->key);
-	      if (rc)
-		asc->key = substitute (key2, rv);
-	      else
-		asc->key = strdup (key2);
+	      asc->key = key;
+	      header_index_free (msg);
+	      header_changed (msg);
 	    }
 	  if (value)
 	    {
 	      asc->value = expand_ampersand (value, asc->value);
+	      header_changed (msg);
 	    }
 	}
-      if (rc)
-	argcv_free (-1, rv);
     }
   iterator_destroy (&itr);
 }
@@ -246,28 +455,22 @@ void
 message_modify_command (MESSAGE msg, RC_REGEX *regex, char *key,
 			char *value)
 {
-  char **rv;
-  int rc;
   ASSOC *asc = list_tail_item (msg->commands);
 
   if (!asc)
     return;
 
-  if (asc->key && anubis_regex_match (regex, asc->key, &rc, &rv))
+  if (asc->key && anubis_regex_match (regex, asc->key, &key_match))
     {
       if (key)
 	{
+	  char *newkey = xstrdup (anubis_regex_expand (&key_match, key));
 	  free (asc->key);
-	  if (rc)
-	    asc->key = substitute (key, rv);
-	  else
-	    asc->key = strdup (key);
+	  asc->key = newkey;
 	}
       if (value)
 	asc->value = expand_ampersand (value, asc->value);
     }
-  if (rc)
-    argcv_free (-1, rv);
 }
 
 
@@ -280,18 +483,23 @@ message_id (MESSAGE msg)
 const char *
 message_get_body (MESSAGE msg)
 {
-  return msg->body;
+  return msg->body.buf;
+}
+
+/* Return true if the body of `msg' could not be stored in full */
+int
+message_body_error (MESSAGE msg)
+{
+  return msg->body.error;
 }
 
 void
 message_add_body (MESSAGE msg, char *key, char *value)
 {
-  if (!key)
-    {
-      msg->body = xrealloc (msg->body,
-			    strlen (msg->body) + strlen (value) + 1);
-      strcat (msg->body, value);
-    }
+  if (!key && msg->deferred)
+    add_stage (msg, stage_append, NULL, xstrdup (value));
+  else if (!key)
+    textbuf_append (&msg->body, value, strlen (value));
   else
     {
      /*FIXME*/
@@ -301,8 +509,25 @@ message_add_body (MESSAGE msg, char *key, char *value)
 void
 message_replace_body (MESSAGE msg, char *body)
 {
-  free (msg->body);
-  msg->body = body;
+  if (msg->deferred)
+    {
+      add_stage (msg, stage_replace, NULL, body);
+      return;
+    }
+  if (body)
+    textbuf_adopt (&msg->body, body);
+  else
+    textbuf_free (&msg->body);
+}
+
+/* Replace the body of `msg' with the text collected in `tb', which is
+   left empty */
+void
+message_take_body (MESSAGE msg, struct textbuf *tb)
+{
+  textbuf_free (&msg->body);
+  msg->body = *tb;
+  textbuf_init (tb);
 }
 
 void
@@ -310,77 +535,73 @@ message_modify_body (MESSAGE msg, RC_REGEX *regex, char *value)
 {
   if (!value)
     value = "";
-  if (!regex)
+  if (msg->deferred)
+    {
+      if (regex)
+	add_stage (msg, stage_modify, regex, xstrdup (value));
+      else
+	{
+	  size_t len = strlen (value);
+	  char *text = xmalloc (len + 2);
+
+	  strcpy (text, value);
+	  if (len > 0 && value[len - 1] != '\n')
+	    strcat (text, "\n");
+	  add_stage (msg, stage_replace, NULL, text);
+	}
+    }
+  else if (!regex)
     {
       int len = strlen (value);
 
-      xfree (msg->body);
+      textbuf_free (&msg->body);
+      textbuf_append (&msg->body, value, len);
       if (len > 0 && value[len - 1] != '\n')
-	{
-	  msg->body = xmalloc (len + 2);
-	  strcpy (msg->body, value);
-	  msg->body[len] = '\n';
-	  msg->body[len + 1] = 0;
-	}
-      else
-	msg->body = strdup (value);
+	textbuf_append (&msg->body, "\n", 1);
     }
   else
     {
       char *start, *end;
-      int stack_level = 0;
-      struct obstack stack;
+      struct textbuf newbody = TEXTBUF_INITIALIZER;
+      struct regex_match match = REGEX_MATCH_INITIALIZER;
+      int modified = 0;
 
-      start = msg->body;
+      start = msg->body.buf;
       while (start && *start)
 	{
-	  int len;
 	  char *newp;
 
 	  end = strchr (start, '\n');
 	  if (end)
 	    *end = 0;
 
-	  newp = anubis_regex_replace (regex, start, value);
+	  newp = anubis_regex_replace (regex, start, value, &match);
 
 	  if (newp)
 	    {
-	      if (!stack_level)
+	      if (!modified)
 		{
-		  obstack_init (&stack);
-		  stack_level = start - msg->body;
-		  if (stack_level > 0)
-		    {
-		      obstack_grow (&stack, msg->body, stack_level);
-		    }
-		  stack_level++;
+		  /* Copy the unmodified lines */
+		  textbuf_append (&newbody, msg->body.buf,
+				  start - msg->body.buf);
+		  modified = 1;
 		}
-	      len = strlen (newp);
-	      obstack_grow (&stack, newp, len);
-	      obstack_1grow (&stack, '\n');
-	      xfree (newp);
-	      stack_level += len + 1;
+	      textbuf_append (&newbody, newp, strlen (newp));
+	      textbuf_append (&newbody, "\n", 1);
 	    }
-	  else if (stack_level)
+	  else if (modified)
 	    {
-	      len = strlen (start);
-	      obstack_grow (&stack, start, len);
-	      obstack_1grow (&stack, '\n');
-	      stack_level += len + 1;
+	      textbuf_append (&newbody, start, strlen (start));
+	      textbuf_append (&newbody, "\n", 1);
 	    }
 	  if (end)
 	    *end++ = '\n';
 	  start = end;
 	}
 
-      if (stack_level)
-	{
-	  char *p = obstack_finish (&stack);
-	  msg->body = xrealloc (msg->body, stack_level + 1);
-	  memcpy (msg->body, p, stack_level - 1);
-	  msg->body[stack_level - 1] = 0;
-	  obstack_free (&stack, NULL);
-	}
+      anubis_regex_match_free (&match);
+      if (modified)
+	message_take_body (msg, &newbody);
     }
 }
 
@@ -389,12 +610,13 @@ message_proc_body (MESSAGE msg, int (*proc) (char **, char *, void *),
 		   void *param)
 {
   char *buf;
-  int rc = proc (&buf, msg->body, param);
+  int rc = proc (&buf, msg->body.buf, param);
   if (rc < 0)
     return;
-  if (rc > 0)
-    xfree (msg->body);
-  msg->body = buf;
+  if (rc == 0)
+    /* `proc' has reallocated the body, which must not be on disk */
+    textbuf_init (&msg->body);
+  message_replace_body (msg, buf);
 }
 
 void
@@ -402,14 +624,128 @@ message_external_proc (MESSAGE msg, char **argv)
 {
   int rc = 0;
   char *extbuf = 0;
-  extbuf = exec_argv (&rc, NULL, argv, msg->body, 0, 0);
+  extbuf = exec_argv (&rc, NULL, argv, msg->body.buf, 0, 0);
   if (rc != -1 && extbuf)
+    message_replace_body (msg, extbuf);
+}
+
+/* Defer the operations on the body of `msg' until it is transferred */
+void
+message_defer_body (MESSAGE msg)
+{
+  msg->deferred = 1;
+}
+
+/* Return true if the operations on the body of `msg' are deferred */
+int
+message_body_deferred (MESSAGE msg)
+{
+  return msg->deferred;
+}
+
+static void stage_write (MESSAGE msg, struct body_stage *st,
+			 const char *text, size_t len);
+
+/* Pass the line collected by the modifying stage `st' to the next
+   stage */
+static void
+stage_flush_line (MESSAGE msg, struct body_stage *st)
+{
+  char *newp;
+
+  if (st->len + 1 > st->size)
     {
-      xfree (msg->body);
-      msg->body = extbuf;
+      st->size = st->len + 1;
+      st->line = xrealloc (st->line, st->size);
     }
+  st->line[st->len] = 0;
+  newp = anubis_regex_replace (st->regex, st->line, st->text, &st->match);
+  if (newp)
+    stage_write (msg, st->next, newp, strlen (newp));
+  else
+    stage_write (msg, st->next, st->line, st->len);
+  stage_write (msg, st->next, "\n", 1);
+  st->len = 0;
 }
-
+
+static void
+stage_write (MESSAGE msg, struct body_stage *st, const char *text, size_t len)
+{
+  if (len == 0)
+    return;
+  if (!st)
+    {
+      msg->output (text, len, msg->output_data);
+      return;
+    }
+  switch (st->type)
+    {
+    case stage_append:
+      stage_write (msg, st->next, text, len);
+      break;
+
+    case stage_replace:
+      /* The original text is dropped */
+      break;
+
+    case stage_modify:
+      while (len > 0)
+	{
+	  const char *p = memchr (text, '\n', len);
+	  size_t n = p ? p - text : len;
+
+	  if (st->len + n > st->size)
+	    {
+	      st->size = st->len + n;
+	      st->line = xrealloc (st->line, st->size);
+	    }
+	  memcpy (st->line + st->len, text, n);
+	  st->len += n;
+	  if (!p)
+	    break;
+	  stage_flush_line (msg, st);
+	  text += n + 1;
+	  len -= n + 1;
+	}
+      break;
+    }
+}
+
+/* Begin transferring the body of `msg'.  The body, as modified by the
+   deferred operations, will be passed to `output' along with `data'. */
+void
+message_body_begin (MESSAGE msg, void (*output) (const char *, size_t, void *),
+		    void *data)
+{
+  msg->output = output;
+  msg->output_data = data;
+}
+
+/* Pass `len' bytes of the body text to the deferred operations */
+void
+message_body_write (MESSAGE msg, const char *text, size_t len)
+{
+  stage_write (msg, msg->stages, text, len);
+}
+
+/* Finish transferring the body */
+void
+message_body_end (MESSAGE msg)
+{
+  struct body_stage *st;
+
+  for (st = msg->stages; st; st = st->next)
+    {
+      if (st->type == stage_modify)
+	{
+	  if (st->len)
+	    stage_flush_line (msg, st);
+	}
+      else
+	stage_write (msg, st->next, st->text, strlen (st->text));
+    }
+}
+
 ANUBIS_LIST 
 message_get_commands (MESSAGE msg)
 {
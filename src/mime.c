@@ -79,9 +79,16 @@ void
 message_append_text_file (MESSAGE msg, char *filename, char *prefix)
 {
   struct append_closure clos;
+  /* Read the text into a string of its own, rather than reallocating
+     the body, which may be deferred or kept on disk */
+  char *text = xstrdup ("");
+
   clos.filename = filename;
   clos.prefix = prefix;
-  message_proc_body (msg, _append_proc, &clos);
+
+  if (_append_proc (&text, text, &clos) == 0)
+    message_add_body (msg, NULL, text);
+  free (text);
 }
 
 void
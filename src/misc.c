@@ -270,81 +270,6 @@ remcrlf (char *s)
     s[len - 1] = '\0';
 }
 
-/***********************************
- Substitutions (RE back-references)
-************************************/
-
-static char *
-insert (char *inbuf, char *sign, char *fill_in)
-{
-  int len1 = 0;
-  int len2 = 0;
-  int psign_len = 0;
-  char *psign = NULL;
-  char *outbuf = NULL;
-
-  if (!inbuf || !sign || !fill_in)
-    return NULL;
-
-  psign = strstr (inbuf, sign);
-  if (!psign)
-    return NULL;
-
-  psign_len = strlen (psign);
-  len1 = strlen (inbuf);
-  len1 -= psign_len;
-  len2 = len1 + 1;
-  len2 += strlen (fill_in);
-  len2 += (psign_len - 2);
-
-  outbuf = (char *) xmalloc (len2);
-  memset (outbuf, 0, len2);
-  psign += 2;
-
-  strncpy (outbuf, inbuf, len1);
-  strcat (outbuf, fill_in);
-  strcat (outbuf, psign);
-
-  if (strstr (outbuf, sign))
-    {
-      char *outbuf2 = insert (outbuf, sign, fill_in);
-      free (outbuf);
-      outbuf = outbuf2;
-    }
-
-  return outbuf;
-}
-
-char *
-substitute (char *inbuf, char **subbuf)
-{
-  char **tmp = subbuf;
-  char *tmpout = NULL;
-  char *tmpbuf = NULL;
-  char sign[5];
-  int i = 0;
-
-  if (!inbuf || !subbuf)
-    return NULL;
-
-  tmpbuf = xstrdup (inbuf);
-  tmp++;
-  while (*tmp)
-    {
-      snprintf (sign, 4, "\\%d", i + 1);
-      tmpout = insert (tmpbuf, sign, *tmp);
-      if (tmpout)
-	{
-	  tmpbuf = (char *) xrealloc ((char *) tmpbuf, strlen (tmpout) + 1);
-	  strcpy (tmpbuf, tmpout);
-	  free (tmpout);
-	}
-      tmp++;
-      i++;
-    }
-  return tmpbuf;
-}
-
 /***************************
  Change the case of letters
 ****************************/
@@ -110,128 +110,262 @@ make_remote_connection (char *host, unsigned int port)
   return str;
 }
 
-static int
-connect_directly_to (char *host, unsigned int port)
+/* Connecting to the MTA.
+
+   All addresses the MTA host name resolves to are tried, following
+   the "Happy Eyeballs" algorithm (RFC 8305): the addresses are sorted
+   so that the address families alternate, and connection attempts are
+   started one after another at intervals of CONNECT_ATTEMPT_DELAY
+   milliseconds, or immediately when the previous attempt fails, without
+   waiting for the earlier ones to complete.  The first attempt that
+   succeeds wins.  Each attempt is abandoned after `connect-timeout'
+   seconds. */
+
+unsigned connect_timeout = 30;
+
+#define CONNECT_ATTEMPT_DELAY 250
+
+struct connect_attempt
 {
-  int sd = 0;
-  unsigned long inaddr;
-  struct sockaddr_in addr;
+  int fd;			/* Socket */
+  struct addrinfo *ai;		/* Address being connected to */
+  unsigned long start;		/* Start time, in ms since the beginning */
+};
 
-  /*
-     Find out the IP address.
-   */
+/* Return the number of milliseconds elapsed since `start' */
+static unsigned long
+elapsed_ms (struct timeval *start)
+{
+  struct timeval now;
 
-  memset (&addr, 0, sizeof (addr));
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons (port);
-  info (VERBOSE, _("Getting remote host information..."));
+  gettimeofday (&now, NULL);
+  return (now.tv_sec - start->tv_sec) * 1000
+         + (now.tv_usec - start->tv_usec) / 1000;
+}
 
-  inaddr = inet_addr (host);
-  if (inaddr != INADDR_NONE)
-    memcpy (&addr.sin_addr, &inaddr, sizeof (inaddr));
-  else
+/* Return the addresses from the list `res' in the order in which they
+   should be tried.  The number of addresses is stored in `*pcount'. */
+static struct addrinfo **
+sort_addresses (struct addrinfo *res, size_t *pcount)
+{
+  struct addrinfo *ai, *first = NULL, *other = NULL;
+  struct addrinfo **tab;
+  size_t n = 0;
+  int family = res->ai_family;
+
+  for (ai = res; ai; ai = ai->ai_next)
+    n++;
+  tab = xcalloc (n, sizeof (tab[0]));
+
+  /* Alternate between the family of the first address and the rest */
+  n = 0;
+  first = res;
+  other = res;
+  for (;;)
     {
-      struct hostent *hp = 0;
-      hp = gethostbyname (host);
-      if (hp == 0)
+      while (first && first->ai_family != family)
+	first = first->ai_next;
+      while (other && other->ai_family == family)
+	other = other->ai_next;
+      if (!first && !other)
+	break;
+      if (first)
 	{
-	  hostname_error (host);
-	  return -1;
+	  tab[n++] = first;
+	  first = first->ai_next;
 	}
-      else
+      if (other)
 	{
-	  if (hp->h_length != 4 && hp->h_length != 8)
-	    {
-	      anubis_error (EXIT_FAILURE, 0,
-			    _("Illegal address length received for host %s"),
-			    host);
-	      return -1;
-	    }
-	  else
-	    {
-	      memcpy ((char *) &addr.sin_addr.s_addr, hp->h_addr,
-		      hp->h_length);
-	    }
+	  tab[n++] = other;
+	  other = other->ai_next;
 	}
     }
+  *pcount = n;
+  return tab;
+}
+
+/* Start a non-blocking connection to `ai'.  Return the socket or -1. */
+static int
+start_connect (struct addrinfo *ai)
+{
+  int fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+  if (fd == -1)
+    return -1;
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  if (connect (fd, ai->ai_addr, ai->ai_addrlen) == 0
+      || errno == EINPROGRESS)
+    return fd;
+  close (fd);
+  return -1;
+}
+
+static void
+attempt_failed (struct connect_attempt *att, int ec, const char *msg)
+{
+  char buf[INET6_ADDRSTRLEN + 16];
+
+  format_sockaddr (buf, sizeof buf, att->ai->ai_addr);
+  if (msg)
+    info (VERBOSE, _("Cannot connect to %s: %s"), buf, msg);
+  else
+    info (VERBOSE, _("Cannot connect to %s: %s"), buf, strerror (ec));
+}
+
+static int
+connect_directly_to (char *host, unsigned int port)
+{
+  struct addrinfo *res;
+  struct addrinfo **addrs;
+  struct connect_attempt *att;
+  size_t naddrs, nextaddr = 0, natt = 0, i;
+  unsigned long last_start = 0, timeout = connect_timeout * 1000UL;
+  struct timeval start;
+  int rc, fd = -1, ec = ETIMEDOUT;
 
   /*
-     Create socket, and connect.
+     Find out the IP addresses.
    */
 
-  if ((sd = socket (AF_INET, SOCK_STREAM, 0)) == -1)
-    {
-      anubis_error (EXIT_FAILURE, errno, _("Cannot create stream socket."));
-      return -1;
-    }
-  if (connect (sd, (struct sockaddr *) &addr, sizeof (addr)) == -1)
+  info (VERBOSE, _("Getting remote host information..."));
+  rc = resolve_host (host, port, AF_UNSPEC, &res);
+  if (rc)
     {
-      anubis_error (EXIT_FAILURE, errno, _("Couldn't connect to %s:%u. %s."),
-		    host, port, strerror (errno));
+      anubis_error (0, 0, _("Cannot resolve %s: %s"), host,
+		    resolve_strerror (rc));
       return -1;
     }
-  else
-    info (NORMAL, _("Connected to %s:%u"), host, port);
-
-  return sd;
-}
+  addrs = sort_addresses (res, &naddrs);
+  att = xcalloc (naddrs, sizeof (att[0]));
 
-/*****************
- Bind and listen.
-******************/
+  /*
+     Connect.
+   */
 
-int
-bind_and_listen (char *host, unsigned int port)
-{
-  int sd = 0;
-  unsigned long inaddr;
-  struct sockaddr_in addr;
-  int true = 1;
+  gettimeofday (&start, NULL);
+  while (fd == -1 && (natt > 0 || nextaddr < naddrs))
+    {
+      unsigned long now = elapsed_ms (&start);
+      unsigned long wait = ULONG_MAX;
+      struct timeval tv;
+      fd_set wfds;
+      int maxfd = -1;
+
+      /* Start the next attempt if it is time to */
+      if (nextaddr < naddrs
+	  && (natt == 0 || now - last_start >= CONNECT_ATTEMPT_DELAY))
+	{
+	  struct connect_attempt *a = &att[natt];
 
-  memset (&addr, 0, sizeof (addr));
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons (port);
+	  a->ai = addrs[nextaddr++];
+	  a->fd = start_connect (a->ai);
+	  if (a->fd == -1)
+	    {
+	      ec = errno;
+	      attempt_failed (a, ec, NULL);
+	    }
+	  else
+	    {
+	      a->start = last_start = now;
+	      natt++;
+	    }
+	  continue;
+	}
 
-  if ((sd = socket (AF_INET, SOCK_STREAM, 0)) == -1)
-    anubis_error (EXIT_FAILURE, errno, _("Cannot create stream socket"));
+      /* Wait for any of the pending attempts to complete */
+      FD_ZERO (&wfds);
+      for (i = 0; i < natt; i++)
+	{
+	  FD_SET (att[i].fd, &wfds);
+	  if (att[i].fd > maxfd)
+	    maxfd = att[i].fd;
+	  if (timeout)
+	    {
+	      unsigned long t = att[i].start + timeout;
+	      t = t > now ? t - now : 0;
+	      if (t < wait)
+		wait = t;
+	    }
+	}
+      if (nextaddr < naddrs)
+	{
+	  unsigned long t = last_start + CONNECT_ATTEMPT_DELAY - now;
+	  if (t < wait)
+	    wait = t;
+	}
+      if (wait != ULONG_MAX)
+	{
+	  tv.tv_sec = wait / 1000;
+	  tv.tv_usec = (wait % 1000) * 1000;
+	}
+      rc = select (maxfd + 1, NULL, &wfds, NULL,
+		   wait == ULONG_MAX ? NULL : &tv);
+      if (rc == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  ec = errno;
+	  anubis_error (0, errno, "select");
+	  break;
+	}
 
-  if (topt & T_NAMES)
-    {
-      inaddr = inet_addr (host);
-      if (inaddr != INADDR_NONE)
-	memcpy (&addr.sin_addr, &inaddr, sizeof (inaddr));
-      else
+      now = elapsed_ms (&start);
+      for (i = 0; i < natt; )
 	{
-	  struct hostent *hp = 0;
-	  hp = gethostbyname (host);
-	  if (hp == 0)
-	    hostname_error (host);
-	  else
+	  struct connect_attempt *a = &att[i];
+	  int err = 0;
+
+	  if (FD_ISSET (a->fd, &wfds))
 	    {
-	      if (hp->h_length != 4 && hp->h_length != 8)
-		anubis_error (EXIT_FAILURE, 0,
-			      _("Illegal address length received for host %s"),
-			      host);
-	      else
+	      socklen_t len = sizeof (err);
+	      if (getsockopt (a->fd, SOL_SOCKET, SO_ERROR, &err, &len))
+		err = errno;
+	      if (err == 0)
 		{
-		  memcpy ((char *) &addr.sin_addr.s_addr, hp->h_addr,
-			  hp->h_length);
+		  fd = a->fd;
+		  break;
 		}
+	      ec = err;
+	      attempt_failed (a, err, NULL);
+	    }
+	  else if (timeout && now - a->start >= timeout)
+	    {
+	      ec = ETIMEDOUT;
+	      attempt_failed (a, 0, _("connection timed out"));
+	    }
+	  else
+	    {
+	      i++;
+	      continue;
 	    }
+	  close (a->fd);
+	  *a = att[--natt];
 	}
     }
-  else
-    addr.sin_addr.s_addr = htonl (INADDR_ANY);
 
-  setsockopt (sd, SOL_SOCKET, SO_REUSEADDR, &true, sizeof (true));
+  /* Abandon the remaining attempts */
+  for (i = 0; i < natt; i++)
+    if (att[i].fd != fd)
+      close (att[i].fd);
 
-  if (bind (sd, (struct sockaddr *) &addr, sizeof (addr)))
-    anubis_error (EXIT_FAILURE, errno, _("bind() failed"));
-  info (VERBOSE, _("GNU Anubis bound to %s:%u"), inet_ntoa (addr.sin_addr),
-	ntohs (addr.sin_port));
-  if (listen (sd, 5))
-    anubis_error (EXIT_FAILURE, errno, _("listen() failed"));
-  return sd;
+  if (fd == -1)
+    anubis_error (0, ec, _("Couldn't connect to %s:%u"), host, port);
+  else
+    {
+      char buf[INET6_ADDRSTRLEN + 16];
+
+      fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK);
+      for (i = 0; i < natt && att[i].fd != fd; i++)
+	;
+      format_sockaddr (buf, sizeof buf, att[i].ai->ai_addr);
+      info (NORMAL, _("Connected to %s:%u (%s) in %lu ms"), host, port, buf,
+	    elapsed_ms (&start));
+      socket_nodelay (fd);
+    }
+  free (att);
+  free (addrs);
+  resolve_free (res);
+  return fd;
 }
 
 /**************
@@ -290,6 +424,37 @@ recvline (int method, NET_STREAM sd, char **vptr, size_t *maxlen)
   return nread;
 }
 
+/* Like recvline, but return a pointer to the line in the stream buffer
+   instead of copying it.  The line is not null-terminated and remains
+   valid until the next read from `sd'. */
+size_t
+recvline_ref (int method, NET_STREAM sd, const char **pline)
+{
+  size_t nread = 0;
+  int rc = stream_getline_ref (sd, pline, &nread);
+
+  if (rc)
+    socket_error (stream_strerror (sd, rc));
+  DPRINTF (method, 0, nread, *pline);
+  return nread;
+}
+
+/* Read at most `size' bytes from `sd' into `buf' and return their
+   amount.  Bail out if there are no more data. */
+size_t
+recvdata (int method, NET_STREAM sd, char *buf, size_t size)
+{
+  size_t nread = 0;
+  int rc = stream_read (sd, buf, size, &nread);
+
+  if (rc)
+    socket_error (stream_strerror (sd, rc));
+  if (nread == 0)
+    socket_error (_("unexpected end of input"));
+  DPRINTF (method, 0, nread, buf);
+  return nread;
+}
+
 /*****************
   Get a response
 ******************/
@@ -337,6 +502,17 @@ net_close_stream (NET_STREAM *sd)
 }
 
 
+/* Disable the Nagle algorithm on the TCP socket `fd'.  Output is
+   coalesced by the stream buffers and sent when a response is awaited,
+   so delaying it further would only add latency. */
+void
+socket_nodelay (int fd)
+{
+  int true = 1;
+
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &true, sizeof (true));
+}
+
 void
 net_create_stream (NET_STREAM * str, int fd)
 {
@@ -0,0 +1,894 @@
+/*
+   prefork.c
+
+   This file is part of GNU Anubis.
+   Copyright (C) 2001-2020 The Anubis Team.
+
+   GNU Anubis is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   GNU Anubis is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU Anubis.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "headers.h"
+#include "extern.h"
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+
+/* This module implements the pool of pre-forked worker processes.
+
+   Instead of forking a new child for each incoming connection, the
+   master process keeps a number of spare workers waiting in accept()
+   on the listening sockets (see listen.c).  A worker serves one session
+   at a time and records its state (idle or busy) in its scoreboard
+   slot (see scoreboard.c).  Each change of state is also signalled to
+   the master over a pipe, so that the master can react immediately.
+
+   When SO_REUSEPORT groups are in use, each worker waits only on the
+   sockets of its group.  The master keeps at least one idle worker in
+   each group as long as `max-workers' permits, and spawns new workers
+   in the groups that have the fewest idle ones.
+
+   The master grows the pool when the number of idle workers falls
+   below `min-spare-workers' and shrinks it when that number exceeds
+   `max-spare-workers', never running more than `max-workers' processes
+   at a time.  If all workers are busy and no more can be started, the
+   master accepts the pending connections itself and rejects them with
+   a 421 reply, as the classic daemon loop did.
+
+   Right after accepting a connection, the worker consults the
+   admission table (see admission.c) and rejects the connection with a
+   421 reply if any of the configured limits is exceeded.
+
+   A worker exits after serving `max-sessions-per-worker' sessions.  It
+   also exits right after a session that has left some per-user state
+   behind, i.e. has changed the process credentials or merged a user
+   configuration file into the parse tree, because such a process cannot
+   safely serve another client.  A daemon running as root switches to
+   the user of each session, or to the unprivileged user, so there
+   every worker serves a single session: the fork is only moved off the
+   accept path, and `max-sessions-per-worker' has no effect.  A warning
+   says so at startup.
+
+   The system configuration file is read by the master only.  It is
+   re-read when the master receives SIGHUP or, on systems that support
+   inotify, when the file is modified.  After a successful reload all
+   workers are asked to exit upon finishing their current session, and
+   the pool is refilled with workers that inherit the new parse tree.
+   Thus, serving a connection never involves reading the configuration.
+
+   On SIGQUIT the master shuts down gracefully: it closes the listening
+   sockets, asks all workers to exit after their current session and
+   waits for them for at most `drain-timeout' seconds.  The workers
+   still running after that are sent SIGTERM, upon which they reply 421
+   to their clients and exit.
+
+   On SIGUSR2 the master upgrades the binary: it starts a new master
+   from the same executable file and command line, passing it the
+   listening sockets in the environment.  Once the new master has
+   started its workers, it sends SIGQUIT to the old one, which then
+   drains its workers as described above.  If the new master fails to
+   start, the old one continues to serve. */
+
+unsigned min_spare_workers = 2;
+unsigned max_spare_workers = 10;
+unsigned max_workers = MAXCLIENTS;
+unsigned max_worker_sessions = 100;
+unsigned drain_timeout = 300;
+
+/* The notification pipe.  Workers write a byte to it whenever their
+   state changes. */
+static int report_pipe[2] = { -1, -1 };
+
+/* Set in the worker when the master asks it to exit */
+static volatile sig_atomic_t worker_stop;
+
+/* Set in the master when the configuration must be reloaded */
+static volatile sig_atomic_t reload_pending;
+
+/* Set in the master when a worker has terminated */
+static volatile sig_atomic_t child_pending;
+
+/* Set in the master when the scoreboard must be dumped to the log */
+static volatile sig_atomic_t dump_pending;
+
+/* Set in the master when a binary upgrade is requested */
+static volatile sig_atomic_t upgrade_pending;
+
+/* Set in the master when a graceful shutdown is requested */
+static volatile sig_atomic_t shutdown_pending;
+
+/* PID of the new master started by a binary upgrade */
+static pid_t upgrade_pid;
+
+/* Command line to start the new master with */
+static char **upgrade_argv;
+
+/* The socket of the client being served by this worker */
+static int client_fd = -1;
+
+/* Descriptor of the inotify instance watching the directory of the
+   configuration file, and the base name of the file. */
+static int inotify_fd = -1;
+#ifdef HAVE_INOTIFY_INIT
+static char *rcfile_base;
+#endif
+
+static void
+report_process_status (size_t count, pid_t pid, int status)
+{
+  char buffer[LINEBUFFER];
+
+  info (VERBOSE,
+	ngettext
+	("Child [%lu] finished. %s. %d client left.",
+	 "Child [%lu] finished. %s. %d clients left.",
+	 count),
+	(unsigned long) pid,
+	format_exit_status (buffer, sizeof buffer, status), count);
+}
+
+
+/* Reject the connection `fd' from `addr' with a 421 reply. */
+static void
+reject_client (int fd, struct sockaddr *addr, const char *reason)
+{
+  NET_STREAM str;
+  char buf[LINEBUFFER];
+
+  info (NORMAL, _("Connection from %s rejected: %s."),
+	format_sockaddr (buf, sizeof buf, addr), reason);
+  net_create_stream (&str, fd);
+  service_unavailable (&str);
+}
+
+
+/* Worker side */
+
+static RETSIGTYPE
+sig_worker_stop (int code)
+{
+  worker_stop = 1;
+}
+
+/* The master has given up waiting for this worker to finish. */
+static RETSIGTYPE
+sig_worker_term (int code)
+{
+  static char msg[] =
+    "421 4.3.2 Service shutting down, closing transmission channel" CRLF;
+
+  /* A TLS session cannot be written to from here */
+  if (client_fd != -1 && !(topt & T_SSL_FINISHED))
+    write (client_fd, msg, sizeof msg - 1);
+  _exit (EX_TEMPFAIL);
+}
+
+/* Install the SIGHUP handler.  While the worker is idle, the signal
+   must interrupt select(), whereas during the session it must not
+   disturb the I/O. */
+static void
+worker_set_sighup (int restart)
+{
+  struct sigaction act;
+
+  act.sa_handler = sig_worker_stop;
+  sigemptyset (&act.sa_mask);
+  act.sa_flags = restart ? SA_RESTART : 0;
+  sigaction (SIGHUP, &act, NULL);
+}
+
+static void
+worker_notify (void)
+{
+  char c = 0;
+
+  if (write (report_pipe[1], &c, 1) != 1 && errno != EAGAIN)
+    anubis_error (0, errno, _("cannot notify master"));
+}
+
+/* Wait for an incoming connection on the listening sockets of
+   `group'.  Return the connected socket, or -1 if the worker was asked
+   to stop. */
+static int
+worker_accept (int group, struct sockaddr *addr, socklen_t *addrlen)
+{
+  while (!worker_stop)
+    {
+      fd_set rfds;
+      int maxfd, fd, rc, idle;
+      struct timeval tv, *tvp = NULL;
+
+      FD_ZERO (&rfds);
+      maxfd = listener_fdset (group, &rfds, -1);
+      /* Watch the pooled connection to the MTA, if any */
+      maxfd = upstream_fdset (&rfds, maxfd);
+      if ((idle = upstream_idle_left ()) >= 0)
+	{
+	  tv.tv_sec = idle;
+	  tv.tv_usec = 0;
+	  tvp = &tv;
+	}
+      rc = select (maxfd + 1, &rfds, NULL, NULL, tvp);
+      if (rc < 0)
+	{
+	  if (errno != EINTR)
+	    anubis_error (EXIT_FAILURE, errno, _("select() failed"));
+	  continue;
+	}
+      upstream_check (rc ? &rfds : NULL);
+      if (rc == 0)
+	continue;
+
+      /* The listening sockets are non-blocking, so that losing the race
+	 for a connection to another worker just brings us back to
+	 select(). */
+      fd = listener_accept (group, &rfds, addr, addrlen);
+      if (fd >= 0)
+	return fd;
+    }
+  return -1;
+}
+
+static void
+worker_main (int slot, int group)
+{
+  unsigned long saved_topt = topt;
+  uid_t uid = getuid (), euid = geteuid ();
+  gid_t gid = getgid (), egid = getegid ();
+  unsigned nsessions = 0;
+  int rc = 0;
+
+  close (report_pipe[0]);
+  if (inotify_fd != -1)
+    close (inotify_fd);
+
+  worker_set_sighup (0);
+  signal (SIGCHLD, SIG_IGN);
+  signal (SIGUSR1, SIG_DFL);
+  signal (SIGUSR2, SIG_DFL);
+  signal (SIGQUIT, sig_exit);
+  signal (SIGTERM, sig_worker_term);
+  scoreboard_attach (slot);
+
+  while (max_worker_sessions == 0 || nsessions < max_worker_sessions)
+    {
+      struct sockaddr_storage addr;
+      socklen_t addrlen = sizeof (addr);
+      int fd = worker_accept (group, (struct sockaddr *) &addr, &addrlen);
+
+      if (fd == -1)
+	break;
+      if ((rc = admission_check ((struct sockaddr *) &addr)) != ADMIT_OK)
+	{
+	  reject_client (fd, (struct sockaddr *) &addr,
+			 admission_strerror (rc));
+	  rc = 0;
+	  continue;
+	}
+      scoreboard_begin_session ((struct sockaddr *) &addr, addrlen);
+      scoreboard_admitted (1);
+      worker_notify ();
+      worker_set_sighup (1);
+      client_fd = fd;
+      rc = anubis_session (fd, (struct sockaddr *) &addr);
+      client_fd = -1;
+      worker_set_sighup (0);
+      scoreboard_admitted (0);
+      admission_release ();
+      nsessions++;
+
+      if (getuid () != uid || geteuid () != euid
+	  || getgid () != gid || getegid () != egid
+	  || rcfile_client_linked ())
+	{
+	  info (DEBUG, _("worker has changed its state, exiting"));
+	  break;
+	}
+
+      /* Prepare for the next session */
+      topt = saved_topt;
+      remote_server = NULL;
+      smtp_session_cleanup ();
+      signal (SIGCHLD, SIG_IGN);
+      scoreboard_end_session ();
+      worker_notify ();
+    }
+  upstream_discard ();
+  quit (rc);
+}
+
+
+/* Master side */
+
+/* Return the group having the fewest (`most' is 0) or the most (`most'
+   is 1) idle workers. */
+static int
+select_group (int most)
+{
+  unsigned i, n = listener_groups ();
+  int group = 0;
+  unsigned count = scoreboard_count (SB_IDLE, 0);
+
+  for (i = 1; i < n; i++)
+    {
+      unsigned c = scoreboard_count (SB_IDLE, i);
+      if (most ? c > count : c < count)
+	{
+	  group = i;
+	  count = c;
+	}
+    }
+  return group;
+}
+
+static void
+spawn_worker (int group)
+{
+  int slot = scoreboard_alloc (group);
+  pid_t pid;
+
+  if (slot == -1)
+    return;
+  pid = fork ();
+  if (pid == -1)
+    {
+      anubis_error (0, errno, _("daemon: cannot fork"));
+      scoreboard_free (slot, NULL);
+    }
+  else if (pid == 0)
+    worker_main (slot, group);
+  else
+    scoreboard_set_pid (slot, pid);
+}
+
+/* Drain the notification pipe */
+static void
+read_reports (void)
+{
+  char buf[512];
+
+  while (read (report_pipe[0], buf, sizeof buf) > 0)
+    ;
+}
+
+/* Tell the worker `pid' to exit as soon as it finishes its current
+   session. */
+static void
+stop_process (pid_t pid)
+{
+  int slot = scoreboard_find (pid);
+
+  if (slot != -1)
+    scoreboard_stop (slot);
+  kill (pid, SIGHUP);
+}
+
+/* Ask all workers to exit as soon as they finish their current
+   session. */
+static void
+stop_all_workers (void)
+{
+  pid_t pid;
+
+  while ((pid = scoreboard_find_state (SB_IDLE, -1))
+	 || (pid = scoreboard_find_state (SB_BUSY, -1)))
+    stop_process (pid);
+}
+
+/* Stop one idle worker from `group'. */
+static void
+stop_worker (int group)
+{
+  pid_t pid = scoreboard_find_state (SB_IDLE, group);
+
+  if (pid)
+    stop_process (pid);
+}
+
+/* Reap terminated workers and free their scoreboard slots. */
+static void
+reap_workers (void)
+{
+  pid_t pid;
+  int status;
+
+  child_pending = 0;
+  while ((pid = waitpid (-1, &status, WNOHANG)) > 0)
+    {
+      int slot = scoreboard_find (pid);
+      struct sockaddr_storage addr;
+
+      if (resolver_reaped (pid))
+	continue;
+      if (pid == upgrade_pid)
+	{
+	  char buffer[LINEBUFFER];
+	  anubis_error (0, 0, _("binary upgrade failed: new master %s"),
+			format_exit_status (buffer, sizeof buffer, status));
+	  upgrade_pid = 0;
+	  continue;
+	}
+      if (slot == -1)
+	continue;
+      /* A worker that crashed in the middle of a session could not
+	 release its admission. */
+      if (scoreboard_free (slot, &addr))
+	admission_release_addr ((struct sockaddr *) &addr);
+      report_process_status (scoreboard_workers (), pid, status);
+    }
+}
+
+/* Adjust the number of workers to the current load. */
+static void
+maintain_pool (void)
+{
+  unsigned i, n = listener_groups ();
+  unsigned total = scoreboard_workers ();
+  unsigned idle;
+
+  /* Make sure that each group has a worker waiting for connections */
+  for (i = 0; i < n && total < max_workers; i++)
+    if (scoreboard_count (SB_IDLE, i) == 0)
+      {
+	spawn_worker (i);
+	total++;
+      }
+
+  idle = scoreboard_count (SB_IDLE, -1);
+  if (idle < min_spare_workers)
+    {
+      for (; idle < min_spare_workers && total < max_workers; idle++, total++)
+	spawn_worker (select_group (0));
+    }
+  else if (idle > max_spare_workers)
+    {
+      int group = select_group (1);
+
+      if (scoreboard_count (SB_IDLE, group) > 1)
+	stop_worker (group);
+    }
+}
+
+/* Bring the pool limits into agreement with each other. */
+static void
+check_pool_limits (void)
+{
+  if (max_workers < listener_groups ())
+    {
+      anubis_warning (0, _("max-workers raised to %u to serve all "
+			   "reuseport groups"), listener_groups ());
+      max_workers = listener_groups ();
+    }
+  if (scoreboard_slots () && max_workers > scoreboard_slots ())
+    {
+      anubis_warning (0, _("max-workers cannot be raised above %u "
+			   "without a restart"), scoreboard_slots ());
+      max_workers = scoreboard_slots ();
+    }
+  if (min_spare_workers > max_workers)
+    min_spare_workers = max_workers;
+  if (max_spare_workers < min_spare_workers)
+    max_spare_workers = min_spare_workers;
+}
+
+/* Warn about the settings that cannot take effect because each worker
+   serves a single session (see the comment at the top of this file). */
+static void
+check_worker_reuse (void)
+{
+  if (!check_superuser ())
+    return;
+  if (max_worker_sessions != 1)
+    anubis_warning (0, _("running as root: each worker serves a single "
+			 "session, max-sessions-per-worker has no effect"));
+  if (upstream_max_reuse > 1)
+    anubis_warning (0, _("running as root: connections to the MTA are "
+			 "closed with their worker, upstream-max-reuse has "
+			 "no effect"));
+}
+
+/* Configuration reloading */
+
+static RETSIGTYPE
+sig_reload (int code)
+{
+  reload_pending = 1;
+}
+
+static RETSIGTYPE
+sig_child (int code)
+{
+  child_pending = 1;
+}
+
+static RETSIGTYPE
+sig_dump (int code)
+{
+  dump_pending = 1;
+}
+
+static RETSIGTYPE
+sig_upgrade (int code)
+{
+  upgrade_pending = 1;
+}
+
+static RETSIGTYPE
+sig_shutdown (int code)
+{
+  shutdown_pending = 1;
+}
+
+static void
+watch_rcfile (void)
+{
+#ifdef HAVE_INOTIFY_INIT
+  char *name = system_rcfile_name ();
+  char *p = strrchr (name, '/');
+  const char *dir;
+
+  if (p)
+    {
+      *p++ = 0;
+      dir = name[0] ? name : "/";
+    }
+  else
+    {
+      dir = ".";
+      p = name;
+    }
+
+  inotify_fd = inotify_init ();
+  if (inotify_fd == -1)
+    anubis_error (0, errno, _("inotify_init() failed"));
+  else if (inotify_add_watch (inotify_fd, dir,
+			      IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+    {
+      anubis_error (0, errno, _("cannot watch directory %s"), dir);
+      close (inotify_fd);
+      inotify_fd = -1;
+    }
+  else
+    {
+      fcntl (inotify_fd, F_SETFD, FD_CLOEXEC);
+      fcntl (inotify_fd, F_SETFL, O_NONBLOCK);
+      rcfile_base = xstrdup (p);
+    }
+  free (name);
+#endif /* HAVE_INOTIFY_INIT */
+}
+
+/* Read pending inotify events.  Return true if any of them concerns
+   the configuration file. */
+static int
+rcfile_changed (void)
+{
+  int changed = 0;
+#ifdef HAVE_INOTIFY_INIT
+  char buf[4096]
+    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  ssize_t n;
+
+  while ((n = read (inotify_fd, buf, sizeof buf)) > 0)
+    {
+      char *p;
+      struct inotify_event *ev;
+
+      for (p = buf; p < buf + n; p += sizeof (*ev) + ev->len)
+	{
+	  ev = (struct inotify_event *) p;
+	  if (ev->len && strcmp (ev->name, rcfile_base) == 0)
+	    changed = 1;
+	}
+    }
+#endif /* HAVE_INOTIFY_INIT */
+  return changed;
+}
+
+static void
+reload_config (void)
+{
+  unsigned long usec, count;
+
+  info (NORMAL, _("Reloading configuration..."));
+  if (reload_rcfile () == 0)
+    {
+      process_rcfile (CF_SUPERVISOR);
+      admission_configure ();
+      resolver_configure ();
+      check_pool_limits ();
+      check_worker_reuse ();
+      count = rcfile_reload_stat (&usec);
+      scoreboard_reloaded (count, usec);
+      stop_all_workers ();
+    }
+}
+
+
+/* Graceful shutdown and binary upgrade */
+
+#define UPGRADE_PID_ENV "ANUBIS_UPGRADE_FROM"
+
+/* Save the command line for a later binary upgrade.  Must be called
+   before the options are parsed and the working directory changes. */
+void
+upgrade_save_argv (int argc, char **argv)
+{
+  int i;
+
+  upgrade_argv = xcalloc (argc + 1, sizeof (upgrade_argv[0]));
+  for (i = 0; i < argc; i++)
+    upgrade_argv[i] = xstrdup (argv[i]);
+  upgrade_argv[i] = NULL;
+
+  /* Make the program name absolute, unless it is looked up in PATH */
+  if (argv[0][0] != '/' && strchr (argv[0], '/'))
+    {
+      char *cwd = getcwd (NULL, 0);
+
+      if (cwd)
+	{
+	  free (upgrade_argv[0]);
+	  upgrade_argv[0] = xmalloc (strlen (cwd) + strlen (argv[0]) + 2);
+	  sprintf (upgrade_argv[0], "%s/%s", cwd, argv[0]);
+	  free (cwd);
+	}
+    }
+}
+
+/* Start a new master process from the executable file. */
+static void
+start_upgrade (void)
+{
+  pid_t pid;
+
+  if (upgrade_pid)
+    {
+      anubis_warning (0, _("binary upgrade is already in progress"));
+      return;
+    }
+  if (!upgrade_argv)
+    {
+      anubis_warning (0, _("binary upgrade is not available"));
+      return;
+    }
+
+  info (NORMAL, _("Starting binary upgrade..."));
+  pid = fork ();
+  if (pid == -1)
+    anubis_error (0, errno, _("daemon: cannot fork"));
+  else if (pid == 0)
+    {
+      char buf[32];
+
+      listeners_export ();
+      snprintf (buf, sizeof buf, "%lu", (unsigned long) getppid ());
+      setenv (UPGRADE_PID_ENV, buf, 1);
+      execvp (upgrade_argv[0], upgrade_argv);
+      anubis_error (0, errno, _("cannot execute %s"), upgrade_argv[0]);
+      _exit (127);
+    }
+  else
+    upgrade_pid = pid;
+}
+
+/* If this master has been started by a binary upgrade, tell the old
+   master to shut down. */
+static void
+finish_upgrade (void)
+{
+  char *env = getenv (UPGRADE_PID_ENV);
+
+  if (env)
+    {
+      pid_t pid = strtoul (env, NULL, 10);
+
+      unsetenv (UPGRADE_PID_ENV);
+      if (pid > 1 && pid == getppid ())
+	{
+	  info (NORMAL, _("Binary upgrade finished, stopping old master %lu"),
+		(unsigned long) pid);
+	  kill (pid, SIGQUIT);
+	}
+    }
+}
+
+/* Send `sig' to all workers. */
+static void
+signal_all_workers (int sig)
+{
+  pid_t pid;
+  int slot;
+
+  for (slot = 0; slot < scoreboard_slots (); slot++)
+    if ((pid = scoreboard_slot_pid (slot)))
+      kill (pid, sig);
+}
+
+/* Stop accepting connections, wait for the workers to finish their
+   sessions and exit. */
+static void
+shutdown_master (void)
+{
+  time_t deadline = 0;
+  int stage = 0;
+
+  info (NORMAL, _("Shutting down gracefully..."));
+  listeners_close ();
+  if (inotify_fd != -1)
+    close (inotify_fd);
+  stop_all_workers ();
+  if (drain_timeout)
+    deadline = time (NULL) + drain_timeout;
+
+  while (scoreboard_workers () > 0)
+    {
+      struct timeval tv;
+
+      if (deadline && time (NULL) >= deadline)
+	{
+	  if (stage == 0)
+	    {
+	      info (NORMAL,
+		    ngettext ("Drain timeout expired, terminating %u worker",
+			      "Drain timeout expired, terminating %u workers",
+			      scoreboard_workers ()),
+		    scoreboard_workers ());
+	      signal_all_workers (SIGTERM);
+	      deadline = time (NULL) + 5;
+	      stage = 1;
+	    }
+	  else
+	    {
+	      signal_all_workers (SIGKILL);
+	      deadline = 0;
+	    }
+	}
+
+      tv.tv_sec = 1;
+      tv.tv_usec = 0;
+      select (0, NULL, NULL, NULL, &tv);
+      if (dump_pending)
+	{
+	  dump_pending = 0;
+	  scoreboard_log ();
+	  resolver_log ();
+	}
+      reap_workers ();
+    }
+  info (NORMAL, _("All workers finished, exiting"));
+  quit (0);
+}
+
+/* All workers are busy: accept a pending connection and reject it. */
+static void
+reject_connection (fd_set *fds)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof (addr);
+  int fd;
+
+  fd = listener_accept (-1, fds, (struct sockaddr *) &addr, &addrlen);
+  if (fd >= 0)
+    reject_client (fd, (struct sockaddr *) &addr,
+		   admission_strerror (ADMIT_TOO_MANY));
+}
+
+void
+prefork_loop (void)
+{
+  struct sigaction act;
+
+  if (!(topt & T_NORC))
+    {
+      process_rcfile (CF_SUPERVISOR);
+      
+      act.sa_handler = sig_reload;
+      sigemptyset (&act.sa_mask);
+      act.sa_flags = 0;
+      sigaction (SIGHUP, &act, NULL);
+      watch_rcfile ();
+    }
+  
+  act.sa_handler = sig_child;
+  sigemptyset (&act.sa_mask);
+  act.sa_flags = 0;
+  sigaction (SIGCHLD, &act, NULL);
+  act.sa_handler = sig_dump;
+  sigaction (SIGUSR1, &act, NULL);
+  act.sa_handler = sig_upgrade;
+  sigaction (SIGUSR2, &act, NULL);
+  act.sa_handler = sig_shutdown;
+  sigaction (SIGQUIT, &act, NULL);
+
+  admission_init ();
+  resolver_init ();
+  check_pool_limits ();
+  check_worker_reuse ();
+  scoreboard_init (max_workers, listener_groups ());
+
+  if (pipe (report_pipe))
+    anubis_error (EXIT_FAILURE, errno, _("pipe() failed"));
+  fcntl (report_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl (report_pipe[1], F_SETFD, FD_CLOEXEC);
+  fcntl (report_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl (report_pipe[1], F_SETFL, O_NONBLOCK);
+  listeners_nonblock ();
+
+  for (;;)
+    {
+      fd_set rfds;
+      struct timeval tv;
+      int saturated;
+      int maxfd;
+
+      reap_workers ();
+      maintain_pool ();
+      finish_upgrade ();
+      resolver_refresh ();
+
+      saturated = scoreboard_count (SB_IDLE, -1) == 0
+	          && scoreboard_workers () >= max_workers;
+
+      FD_ZERO (&rfds);
+      FD_SET (report_pipe[0], &rfds);
+      maxfd = report_pipe[0];
+      if (inotify_fd != -1)
+	{
+	  FD_SET (inotify_fd, &rfds);
+	  if (inotify_fd > maxfd)
+	    maxfd = inotify_fd;
+	}
+      if (saturated)
+	maxfd = listener_fdset (-1, &rfds, maxfd);
+
+      tv.tv_sec = 1;
+      tv.tv_usec = 0;
+      if (select (maxfd + 1, &rfds, NULL, NULL, &tv) < 0)
+	{
+	  if (errno != EINTR)
+	    anubis_error (0, errno, _("select() failed"));
+	  FD_ZERO (&rfds);
+	}
+
+      if (dump_pending)
+	{
+	  dump_pending = 0;
+	  scoreboard_log ();
+	  resolver_log ();
+	}
+      if (shutdown_pending)
+	shutdown_master ();
+      if (upgrade_pending)
+	{
+	  upgrade_pending = 0;
+	  start_upgrade ();
+	}
+      if (inotify_fd != -1 && FD_ISSET (inotify_fd, &rfds)
+	  && rcfile_changed ())
+	reload_pending = 1;
+      if (reload_pending)
+	{
+	  reload_pending = 0;
+	  reload_config ();
+	  continue;
+	}
+      
+      if (FD_ISSET (report_pipe[0], &rfds))
+	read_reports ();
+      if (saturated && scoreboard_count (SB_IDLE, -1) == 0)
+	reject_connection (&rfds);
+    }
+}
+
+/* EOF */
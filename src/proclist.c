@@ -131,6 +131,7 @@ proclist_register (pid_t pid)
 void
 proclist_init ()
 {
+  list_destroy (&process_list, anubis_free_list_item, NULL);
   process_list = list_create ();
   signal (SIGCHLD, sig_child);
 }
@@ -142,3 +143,4 @@ proclist_count ()
   return list_count (process_list);
 }
 
+/* EOF */
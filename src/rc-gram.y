@@ -34,6 +34,8 @@ extern int yylex (void);
 int yyerror (const char *s);
 
 static RC_SECTION *rc_section_create (char *, RC_LOC *, RC_STMT *);
+static struct rc_prog *rc_prog_compile (RC_STMT *);
+static void rc_prog_free (struct rc_prog *);
 static void rc_section_destroy (RC_SECTION **);
 static void rc_section_print (RC_SECTION *);
 static void rc_asgn_destroy (RC_ASGN *);
@@ -460,6 +462,8 @@ expr     : s_msgpart opt_sep meq opt_modlist string
 	     RC_NODE *node = rc_node_create (rc_node_expr, &@1.beg);
 	     node->v.expr.part = $1.part;
 	     node->v.expr.key = $1.string;
+	     node->v.expr.atom = ($1.part == HEADER && $1.string)
+	                           ? header_atom ($1.string) : -1;
 	     node->v.expr.sep = $2;
 	     node->v.expr.re = anubis_regex_compile ($5, $4);
 	     free ($5);
@@ -522,6 +526,7 @@ rule_start: rule opt_modlist string
 	     $$ = rc_node_create (rc_node_expr, &@1.beg);
 	     $$->v.expr.part = HEADER;
 	     $$->v.expr.key = strdup (X_ANUBIS_RULE_HEADER);
+	     $$->v.expr.atom = header_atom (X_ANUBIS_RULE_HEADER);
 	     $$->v.expr.re = anubis_regex_compile ($3, $2);
 	     free ($3);
 	   }
@@ -833,12 +838,14 @@ rc_section_create (char *name, struct rc_loc *loc, RC_STMT *stmt)
   p->next = NULL;
   p->name = name;
   p->stmt = stmt;
+  p->prog = rc_prog_compile (stmt);
   return p;
 }
 
 void
 rc_section_destroy (RC_SECTION **s)
 {
+  rc_prog_free ((*s)->prog);
   rc_stmt_list_destroy ((*s)->stmt);
   rc_destroy_loc (&(*s)->loc);
   xfree ((*s)->name);
@@ -1359,6 +1366,8 @@ struct disabled_keyword
 
 
 static ANUBIS_LIST disabled_keyword_list;
+static unsigned disabled_keyword_gen; /* Incremented on each change of
+					 disabled_keyword_list */
 
 void
 rc_disable_keyword (int mask, const char *kw)
@@ -1368,6 +1377,7 @@ rc_disable_keyword (int mask, const char *kw)
   
   if (!disabled_keyword_list)
     disabled_keyword_list = list_create ();
+  disabled_keyword_gen++;
 
   itr = iterator_create (disabled_keyword_list);
   for (p = iterator_first (itr); p; p = iterator_next (itr))
@@ -1416,8 +1426,7 @@ struct eval_env
   struct rc_secdef_child *child;
   MESSAGE msg;
   void *data;
-  int refcnt;
-  char **refstr;
+  struct regex_match match;	/* Back-references of the last match */
   jmp_buf jmp;
   RC_LOC loc;
   int traceable;
@@ -1469,45 +1478,340 @@ eval_warning (struct eval_env *env, const char *fmt, ...)
   va_end(ap);
 }
 
-static void asgn_eval (struct eval_env *env, RC_ASGN *asgn);
-static int node_eval (struct eval_env *env, RC_NODE *node);
-static int bool_eval (struct eval_env *env, RC_BOOL *bool);
-static void cond_eval (struct eval_env *env, RC_COND *cond);
-static void rule_eval (struct eval_env *env, RC_RULE *rule);
-static void stmt_list_eval (struct eval_env *env, RC_STMT *stmt);
+/* Compiled sections.
+
+   When a section is parsed, its statements are compiled into a
+   program: an array of instructions run by a simple dispatch loop
+   (rc_prog_run).  A condition is compiled into code that leaves its
+   value in a flag.  Boolean operators, `if' and `rule' statements
+   become conditional jumps, whose targets are instruction indices.
+   STOP ends the loop.
+
+   Instructions that need a lookup by name cache its result.  An
+   assignment caches the keyword token and the keyword table it is
+   found in, along with the tables and method it was looked up for.
+   CALL caches the called section, along with the generation of the
+   parse tree (see rcfile_generation), since the tree changes when
+   the user configuration file is merged into it or the configuration
+   is reloaded.
+
+   Conditions of a section on the same header are gathered into a
+   group, which matches them all at once.  Each condition contributes
+   a literal string that any value it matches must contain (see
+   anubis_regex_literal), and the strings of the group are compiled
+   into a single Aho-Corasick automaton (see acm.c).  The values of the
+   header are scanned by the automaton once, when the first condition
+   of the group is evaluated, and the results are kept until the
+   headers of the message change.  A condition whose string does not
+   occur in any value fails without running its regex.  Otherwise, the
+   regex is run as usual, so that back-references are set the same way
+   as without the group.  Conditions with no literal string are not
+   grouped, and are evaluated on their own. */
+
+enum rc_opcode
+  {
+    op_asgn,			/* Assignment */
+    op_inst,			/* ADD, MODIFY or REMOVE */
+    op_call,			/* CALL */
+    op_stop,			/* STOP */
+    op_match,			/* Match a condition, setting the flag */
+    op_not,			/* Negate the flag */
+    op_jz,			/* Jump if the flag is not set */
+    op_jnz,			/* Jump if the flag is set */
+    op_jmp			/* Jump */
+  };
+
+struct rc_insn
+{
+  enum rc_opcode op;
+  RC_LOC *loc;			/* Location in the config file, or NULL */
+  union
+  {
+    struct
+    {
+      RC_ASGN *asgn;
+      int resolved;		/* The fields below are valid */
+      struct rc_secdef_child *children; /* Tables searched */
+      int method;		/* Method they were searched for */
+      unsigned gen;		/* disabled_keyword_gen at that time */
+      struct rc_secdef_child *child; /* Table the keyword is in, or
+					NULL */
+      int key;			/* Keyword token */
+      int disabled;		/* The keyword is disabled */
+    } asgn;			/* op_asgn */
+    struct
+    {
+      RC_INST *inst;
+      int resolved;		/* `sec' is valid */
+      unsigned gen;		/* Parse tree generation it was found in */
+      RC_SECTION *sec;		/* Called section, or NULL */
+    } call;			/* op_call */
+    RC_INST *inst;		/* op_inst */
+    struct
+    {
+      RC_EXPR *expr;
+      int group;		/* Index of its group in the program, or -1 */
+      int pat;			/* Index of its string in the group */
+    } match;			/* op_match */
+    size_t jump;		/* op_jz, op_jnz, op_jmp: target index */
+  } v;
+};
+
+/* Group of conditions on the same header */
+struct rc_group
+{
+  int atom;			/* Header name atom */
+  size_t count;			/* Number of conditions */
+  ACM acm;			/* Automaton of their strings, or NULL if
+				   the group has a single condition */
+  u_char *hits;			/* Scan results, indexed by string */
+  unsigned gen;			/* Header generation they are valid for,
+				   or 0 */
+};
+
+struct rc_prog
+{
+  struct rc_insn *code;
+  size_t count;			/* Number of instructions */
+  size_t max;			/* Allocated size of code */
+  struct rc_group *groups;	/* Groups of conditions */
+  size_t ngroups;		/* Number of groups */
+  size_t maxgroups;		/* Allocated size of groups */
+};
+
+/* Append an instruction to `prog' and return its index */
+static size_t
+prog_emit (struct rc_prog *prog, enum rc_opcode op, RC_LOC *loc)
+{
+  struct rc_insn *insn;
+
+  if (prog->count == prog->max)
+    prog->code = x2nrealloc (prog->code, &prog->max, sizeof (prog->code[0]));
+  insn = &prog->code[prog->count];
+  memset (insn, 0, sizeof (*insn));
+  insn->op = op;
+  insn->loc = loc;
+  return prog->count++;
+}
+
+static void
+prog_compile_node (struct rc_prog *prog, RC_NODE *node)
+{
+  size_t j;
+
+  switch (node->type)
+    {
+    case rc_node_expr:
+      j = prog_emit (prog, op_match, &node->loc);
+      prog->code[j].v.match.expr = &node->v.expr;
+      prog->code[j].v.match.group = -1;
+      break;
+
+    case rc_node_bool:
+      prog_compile_node (prog, node->v.bool.left);
+      switch (node->v.bool.op)
+	{
+	case bool_not:
+	  prog_emit (prog, op_not, NULL);
+	  break;
+
+	case bool_and:
+	case bool_or:
+	  /* Skip the right operand if the left one decides */
+	  j = prog_emit (prog, node->v.bool.op == bool_and ? op_jz : op_jnz,
+			 NULL);
+	  prog_compile_node (prog, node->v.bool.right);
+	  prog->code[j].v.jump = prog->count;
+	  break;
+	}
+      break;
+    }
+}
+
+static void
+prog_compile_stmt (struct rc_prog *prog, RC_STMT *stmt)
+{
+  size_t j, k;
+
+  for (; stmt; stmt = stmt->next)
+    {
+      switch (stmt->type)
+	{
+	case rc_stmt_asgn:
+	  j = prog_emit (prog, op_asgn, &stmt->loc);
+	  prog->code[j].v.asgn.asgn = &stmt->v.asgn;
+	  break;
+
+	case rc_stmt_inst:
+	  switch (stmt->v.inst.opcode)
+	    {
+	    case inst_stop:
+	      prog_emit (prog, op_stop, &stmt->loc);
+	      break;
+
+	    case inst_call:
+	      j = prog_emit (prog, op_call, &stmt->loc);
+	      prog->code[j].v.call.inst = &stmt->v.inst;
+	      break;
+
+	    default:
+	      j = prog_emit (prog, op_inst, &stmt->loc);
+	      prog->code[j].v.inst = &stmt->v.inst;
+	    }
+	  break;
+
+	case rc_stmt_cond:
+	  prog_compile_node (prog, stmt->v.cond.node);
+	  j = prog_emit (prog, op_jz, NULL);
+	  prog_compile_stmt (prog, stmt->v.cond.iftrue);
+	  if (stmt->v.cond.iffalse)
+	    {
+	      k = prog_emit (prog, op_jmp, NULL);
+	      prog->code[j].v.jump = prog->count;
+	      prog_compile_stmt (prog, stmt->v.cond.iffalse);
+	      prog->code[k].v.jump = prog->count;
+	    }
+	  else
+	    prog->code[j].v.jump = prog->count;
+	  break;
+
+	case rc_stmt_rule:
+	  prog_compile_node (prog, stmt->v.rule.node);
+	  j = prog_emit (prog, op_jz, NULL);
+	  prog_compile_stmt (prog, stmt->v.rule.stmt);
+	  prog->code[j].v.jump = prog->count;
+	  break;
+	}
+    }
+}
+
+/* If the condition `expr' may be matched as part of a group, return
+   the length of its literal string and store its start in `*start'.
+   Otherwise, return 0. */
+static size_t
+prog_group_literal (RC_EXPR *expr, const char **start)
+{
+  if (expr->part != HEADER || expr->atom < 0 || expr->sep || !expr->re)
+    return 0;
+  return anubis_regex_literal (expr->re, start);
+}
+
+/* Return the index of the group for `atom', creating it if needed */
+static int
+prog_group (struct rc_prog *prog, int atom)
+{
+  size_t i;
+
+  for (i = 0; i < prog->ngroups; i++)
+    if (prog->groups[i].atom == atom)
+      return i;
+  if (prog->ngroups == prog->maxgroups)
+    prog->groups = x2nrealloc (prog->groups, &prog->maxgroups,
+			       sizeof (prog->groups[0]));
+  memset (&prog->groups[i], 0, sizeof (prog->groups[i]));
+  prog->groups[i].atom = atom;
+  return prog->ngroups++;
+}
+
+/* Gather the conditions of `prog' into groups */
+static void
+prog_compile_groups (struct rc_prog *prog)
+{
+  size_t i;
+  const char *start;
+  size_t len;
+
+  for (i = 0; i < prog->count; i++)
+    if (prog->code[i].op == op_match
+	&& prog_group_literal (prog->code[i].v.match.expr, &start))
+      {
+	int g = prog_group (prog, prog->code[i].v.match.expr->atom);
+	prog->groups[g].count++;
+	prog->code[i].v.match.group = g;
+      }
+
+  /* A single condition gains nothing from the automaton */
+  for (i = 0; i < prog->count; i++)
+    {
+      struct rc_insn *insn = &prog->code[i];
+      struct rc_group *grp;
+
+      if (insn->op != op_match || insn->v.match.group == -1)
+	continue;
+      grp = &prog->groups[insn->v.match.group];
+      if (grp->count < 2)
+	{
+	  insn->v.match.group = -1;
+	  continue;
+	}
+      if (!grp->acm)
+	grp->acm = acm_create ();
+      len = prog_group_literal (insn->v.match.expr, &start);
+      insn->v.match.pat = acm_add (grp->acm, start, len);
+    }
+
+  for (i = 0; i < prog->ngroups; i++)
+    if (prog->groups[i].acm)
+      {
+	acm_compile (prog->groups[i].acm);
+	prog->groups[i].hits = xcalloc (prog->groups[i].count,
+					sizeof (prog->groups[i].hits[0]));
+      }
+}
+
+struct rc_prog *
+rc_prog_compile (RC_STMT *stmt)
+{
+  struct rc_prog *prog = xzalloc (sizeof (*prog));
+  prog_compile_stmt (prog, stmt);
+  prog_compile_groups (prog);
+  return prog;
+}
+
+void
+rc_prog_free (struct rc_prog *prog)
+{
+  if (prog)
+    {
+      size_t i;
+
+      for (i = 0; i < prog->ngroups; i++)
+	{
+	  acm_free (&prog->groups[i].acm);
+	  free (prog->groups[i].hits);
+	}
+      free (prog->groups);
+      free (prog->code);
+      free (prog);
+    }
+}
+
+static void asgn_eval (struct eval_env *env, struct rc_insn *insn);
+static void call_eval (struct eval_env *env, struct rc_insn *insn);
 static void inst_eval (struct eval_env *env, RC_INST *inst);
+static int expr_eval (struct eval_env *env, RC_EXPR *expr,
+		      struct rc_group *grp, int pat);
 
 #define VALID_STR(s) ((s)?(s):"NULL")
 
 void
 inst_eval (struct eval_env *env, RC_INST *inst)
 {
-  char *arg = NULL, *argp = NULL;
+  char *arg = NULL;
   
   if (!env->msg)
     return; /* FIXME: bail out? */
 	
   if (inst->arg)
     {
-      if (env->refstr)
-	arg = argp = substitute (inst->arg, env->refstr);
+      if (env->match.count)
+	arg = anubis_regex_expand (&env->match, inst->arg);
       else
 	arg = inst->arg;
     }
   
   switch (inst->opcode)
     {
-    case inst_stop:
-      tracefile (&env->loc, _("STOP"));
-      longjmp (env->jmp, 1);
-      break;
-    
-    case inst_call:
-      tracefile (&env->loc, _("Calling %s"), inst->arg);
-      rcfile_call_section (env->method, inst->arg, "RULE",
-			   env->data, env->msg);
-      break;
-    
     case inst_add:
       tracefile (&env->loc, _("ADD %s [%s] %s"),
 		 part_string (inst->part),
@@ -1549,21 +1853,36 @@ inst_eval (struct eval_env *env, RC_INST *inst)
     default:
       abort ();
     }
-  
-  if (argp)
-    free (argp);
 }
 	
 void
-asgn_eval (struct eval_env *env, RC_ASGN *asgn)
+asgn_eval (struct eval_env *env, struct rc_insn *insn)
 {
-  int key;
-  struct rc_secdef_child *p = rc_child_lookup (env->child, asgn->lhs,
-					       env->method, &key, NULL);
+  RC_ASGN *asgn = insn->v.asgn.asgn;
+  struct rc_secdef_child *p;
+
+  if (!insn->v.asgn.resolved
+      || insn->v.asgn.children != env->child
+      || insn->v.asgn.method != env->method
+      || insn->v.asgn.gen != disabled_keyword_gen)
+    {
+      insn->v.asgn.child = rc_child_lookup (env->child, asgn->lhs,
+					    env->method, &insn->v.asgn.key,
+					    NULL);
+      insn->v.asgn.disabled = insn->v.asgn.child
+	                      && rc_keyword_is_disabled (env->method,
+							 asgn->lhs);
+      insn->v.asgn.children = env->child;
+      insn->v.asgn.method = env->method;
+      insn->v.asgn.gen = disabled_keyword_gen;
+      insn->v.asgn.resolved = 1;
+    }
+
+  p = insn->v.asgn.child;
   if (!p)
     return;
 
-  if (rc_keyword_is_disabled (env->method, asgn->lhs))
+  if (insn->v.asgn.disabled)
     {
       eval_warning (env,
 		    _("ignoring statement overridden from the command line"));
@@ -1573,100 +1892,188 @@ asgn_eval (struct eval_env *env, RC_ASGN *asgn)
   if (env->traceable)
     tracefile (&env->loc, _("Executing %s"), asgn->lhs);
 
-  if (env->refstr)
+  if (env->match.count)
     {
       char *s;
       ANUBIS_LIST arg = list_create ();
       ITERATOR itr = iterator_create (asgn->rhs);
       for (s = iterator_first (itr); s; s = iterator_next (itr))
 	{
-	  char *str = substitute (s, env->refstr);
+	  char *str = xstrdup (anubis_regex_expand (&env->match, s));
 	  list_append (arg, str);
 	}
       iterator_destroy (&itr);
-      p->parser (env, key, arg, p->data);
+      p->parser (env, insn->v.asgn.key, arg, p->data);
       list_destroy (&arg, anubis_free_list_item, NULL);
     }
   else
-    p->parser (env, key, asgn->rhs, p->data);
+    p->parser (env, insn->v.asgn.key, asgn->rhs, p->data);
 }
 
+void
+call_eval (struct eval_env *env, struct rc_insn *insn)
+{
+  RC_INST *inst = insn->v.call.inst;
 
-int
-re_eval_list (struct eval_env *env, char *key, char *sep,
-	      RC_REGEX *re, ANUBIS_LIST list)
+  tracefile (&env->loc, _("Calling %s"), inst->arg);
+  if (!insn->v.call.resolved || insn->v.call.gen != rcfile_generation ())
+    {
+      insn->v.call.sec = rcfile_find_section (inst->arg);
+      insn->v.call.gen = rcfile_generation ();
+      insn->v.call.resolved = 1;
+    }
+  rcfile_run_section (env->method, insn->v.call.sec, inst->arg, "RULE",
+		      env->data, env->msg);
+}
+
+
+/* Match `re' against `text', keeping the back-references of a
+   successful match in `env'. */
+static int
+re_match (struct eval_env *env, RC_REGEX *re, const char *text)
+{
+  if (anubis_regex_match (re, text, &env->match))
+    {
+      anubis_regex_match_save (&env->match);
+      return 1;
+    }
+  anubis_regex_nomatch (re, &env->match);
+  return 0;
+}
+
+/* Match `re' against the values `v[0]' to `v[n-1]'.  If `sep' is
+   given, match it once against the values joined with `sep',
+   otherwise against each value in turn. */
+static int
+re_eval_values (struct eval_env *env, char *sep, RC_REGEX *re,
+		ASSOC **v, size_t n)
 {
-  ASSOC *p;
-  ITERATOR itr;
   int rc = 0;
+  size_t i;
 
-  itr = iterator_create (list);
-  if (sep)
+  if (n == 0)
+    return 0;
+  if (sep && n > 1)
     {
-      char *tmpbuf = NULL;
-      size_t tmpsize = 0;
       size_t seplen = strlen (sep);
-      char *first_val = NULL;
-      
-      for (p = iterator_first (itr); p; p = iterator_next (itr))
+      size_t size = 0;
+      char *buf, *p;
+
+      for (i = 0; i < n; i++)
+	size += strlen (v[i]->value) + seplen;
+      p = buf = xmalloc (size + 1);
+      for (i = 0; i < n; i++)
 	{
-	  if (!p->key || !strcasecmp (p->key, key))
+	  if (i > 0)
 	    {
-	      if (tmpsize == 0)
-		{
-		  if (!first_val)
-		    {
-		      first_val = p->value; /* Initialize copy on write */
-		      continue;
-		    }
-		  else
-		    {
-		      tmpbuf = xstrdup (first_val);
-		      tmpsize = strlen (tmpbuf);
-		      first_val = NULL;
-		    }
-		}
-	      tmpsize += seplen + strlen (p->value);
-	      tmpbuf = xrealloc (tmpbuf, tmpsize + 1);
-	      strcat (tmpbuf, sep);
-	      strcat (tmpbuf, p->value);
+	      memcpy (p, sep, seplen);
+	      p += seplen;
 	    }
+	  size = strlen (v[i]->value);
+	  memcpy (p, v[i]->value, size);
+	  p += size;
 	}
-      rc = anubis_regex_match (re, first_val ? first_val : tmpbuf,
-			       &env->refcnt, &env->refstr);
-      free (tmpbuf);
+      *p = 0;
+      rc = re_match (env, re, buf);
+      free (buf);
     }
+  else if (sep)
+    rc = re_match (env, re, v[0]->value);
   else
     {
-      for (p = iterator_first (itr); rc == 0 && p; p = iterator_next (itr))
-	{
-	  if (!p->key || !strcasecmp (p->key, key))
-	    rc = anubis_regex_match (re, p->value,
-				     &env->refcnt, &env->refstr);
-	}
+      for (i = 0; rc == 0 && i < n; i++)
+	rc = re_match (env, re, v[i]->value);
+    }
+  return rc;
+}
+
+int
+re_eval_list (struct eval_env *env, char *key, char *sep,
+	      RC_REGEX *re, ANUBIS_LIST list)
+{
+  ASSOC *p, **v;
+  ITERATOR itr;
+  size_t n = 0;
+  int rc;
+
+  v = xcalloc (list_count (list) + 1, sizeof (v[0]));
+  itr = iterator_create (list);
+  for (p = iterator_first (itr); p; p = iterator_next (itr))
+    {
+      if (!p->key || !strcasecmp (p->key, key))
+	v[n++] = p;
     }
   iterator_destroy (&itr);
+  rc = re_eval_values (env, sep, re, v, n);
+  free (v);
   return rc;
 }
 
+/* Return true if the string `pat' of the group `grp' occurs in the
+   values `v[0]' to `v[n-1]' of its header in `msg' as required by
+   `re', i.e. if `re' may match one of them. */
+static int
+group_may_match (struct rc_group *grp, int pat, RC_REGEX *re,
+		 MESSAGE msg, ASSOC **v, size_t n)
+{
+  unsigned gen = message_header_generation (msg);
+
+  if (grp->gen != gen)
+    {
+      size_t i;
+
+      memset (grp->hits, 0, grp->count);
+      for (i = 0; i < n; i++)
+	if (acm_scan (grp->acm, v[i]->value, strlen (v[i]->value),
+		      grp->hits))
+	  {
+	    /* Cannot tell: let the regexes decide */
+	    memset (grp->hits, ACM_FOUND | ACM_WHOLE, grp->count);
+	    break;
+	  }
+      grp->gen = gen;
+    }
+  return grp->hits[pat]
+         & (re_typeof (anubis_regex_flags (re)) == R_EXACT
+	    ? ACM_WHOLE : ACM_FOUND);
+}
+
+/* Evaluate a condition on the header `expr->key', looking up its
+   occurrences in the header index of the message.  `grp' is the group
+   of the condition, or NULL. */
+static int
+re_eval_header (struct eval_env *env, RC_EXPR *expr,
+		struct rc_group *grp, int pat)
+{
+  ASSOC **v;
+  size_t n;
+
+  if (message_find_header (env->msg, expr->atom, &v, &n))
+    return re_eval_list (env, expr->key, expr->sep, expr->re,
+			 message_get_header (env->msg));
+  if (grp && n > 0 && !group_may_match (grp, pat, expr->re, env->msg, v, n))
+    {
+      anubis_regex_nomatch (expr->re, &env->match);
+      return 0;
+    }
+  return re_eval_values (env, expr->sep, expr->re, v, n);
+}
+
 int
 re_eval_text (struct eval_env *env, RC_REGEX *re, const char *text)
 {
-  /* FIXME */
-  return anubis_regex_match (re, text, &env->refcnt, &env->refstr);
+  return re_match (env, re, text);
 }
 
+/* Evaluate the condition `expr'.  `grp' is its group, or NULL, and
+   `pat' the index of its string in the group. */
 int
-expr_eval (struct eval_env *env, RC_EXPR *expr)
+expr_eval (struct eval_env *env, RC_EXPR *expr, struct rc_group *grp, int pat)
 {
   int rc;
 
-  if (env->refstr && anubis_regex_refcnt (expr->re))
-    {
-      argcv_free (-1, env->refstr);
-      env->refcnt = 0;
-      env->refstr = NULL;
-    }
+  if (anubis_regex_refcnt (expr->re))
+    env->match.count = 0;
   
   switch (expr->part)
     {
@@ -1676,8 +2083,7 @@ expr_eval (struct eval_env *env, RC_EXPR *expr)
       break;
     
     case HEADER:
-      rc = re_eval_list (env, expr->key, expr->sep, expr->re,
-			 message_get_header (env->msg));
+      rc = re_eval_header (env, expr, grp, pat);
       break;
     
     case BODY:
@@ -1703,92 +2109,67 @@ expr_eval (struct eval_env *env, RC_EXPR *expr)
   return rc;
 }
 
-int
-node_eval (struct eval_env *env, RC_NODE *node)
+/* Run the program `prog' */
+static void
+rc_prog_run (struct eval_env *env, struct rc_prog *prog)
 {
-  int rc; /* It won't be used uninitialized despite what cc says.
-	     Note default: branch below */
-  
-  env->loc = node->loc;
-  switch (node->type)
+  struct rc_insn *code = prog->code;
+  size_t pc = 0;
+  int flag = 0;
+
+  while (pc < prog->count)
     {
-    case rc_node_bool:
-      rc = bool_eval (env, &node->v.bool);
-      break;
-    
-    case rc_node_expr:
-      rc = expr_eval (env, &node->v.expr);
-      break;
-    
-    default:
-      abort ();
-    }
-  
-  return rc;
-}
+      struct rc_insn *insn = &code[pc++];
 
-int
-bool_eval (struct eval_env *env, RC_BOOL *bool)
-{
-  int rc = node_eval (env, bool->left);
+      if (insn->loc)
+	env->loc = *insn->loc;
+      switch (insn->op)
+	{
+	case op_asgn:
+	  asgn_eval (env, insn);
+	  break;
 
-  switch (bool->op)
-    {
-    case bool_not:
-      return !rc;
-    
-    case bool_and:
-      if (!rc)
-	return 0;
-      break;
-    
-    case bool_or:
-      if (rc)
-	return 1;
-      break;
-    }
-  return node_eval (env, bool->right);
-}
+	case op_inst:
+	  inst_eval (env, insn->v.inst);
+	  break;
 
-void
-cond_eval (struct eval_env *env, RC_COND *cond)
-{
-  if (node_eval (env, cond->node))
-    stmt_list_eval (env, cond->iftrue);
-  else
-    stmt_list_eval (env, cond->iffalse);
-}
+	case op_call:
+	  if (env->msg)
+	    call_eval (env, insn);
+	  break;
 
-void
-rule_eval (struct eval_env *env, RC_RULE *rule)
-{
-  if (node_eval (env, rule->node))
-    stmt_list_eval (env, rule->stmt);
-}
+	case op_stop:
+	  if (env->msg)
+	    {
+	      tracefile (&env->loc, _("STOP"));
+	      return;
+	    }
+	  break;
 
-void
-stmt_list_eval (struct eval_env *env, RC_STMT *stmt)
-{
-  for (; stmt; stmt = stmt->next)
-    {
-      env->loc = stmt->loc;
-      
-      switch (stmt->type)
-	{
-	case rc_stmt_asgn:
-	  asgn_eval (env, &stmt->v.asgn);
+	case op_match:
+	  flag = expr_eval (env, insn->v.match.expr,
+			    insn->v.match.group == -1
+			      ? NULL : &prog->groups[insn->v.match.group],
+			    insn->v.match.pat);
 	  break;
-	
-	case rc_stmt_cond:
-	  cond_eval (env, &stmt->v.cond);
+
+	case op_not:
+	  flag = !flag;
 	  break;
-	
-	case rc_stmt_rule:
-	  rule_eval (env, &stmt->v.rule);
+
+	case op_jz:
+	  if (!flag)
+	    pc = insn->v.jump;
+	  break;
+
+	case op_jnz:
+	  if (flag)
+	    pc = insn->v.jump;
+	  break;
+
+	case op_jmp:
+	  pc = insn->v.jump;
 	  break;
-	
-	case rc_stmt_inst:
-	  inst_eval (env, &stmt->v.inst);
 	}
     }
 }
@@ -1800,8 +2181,7 @@ eval_section (int method, RC_SECTION *sec, struct rc_secdef *secdef,
   struct eval_env env;
   env.method = method;
   env.child = secdef->child;
-  env.refcnt = 0;
-  env.refstr = NULL;
+  memset (&env.match, 0, sizeof (env.match));
   env.msg = msg;
   env.data = data;
   env.loc = sec->loc;
@@ -1810,11 +2190,11 @@ eval_section (int method, RC_SECTION *sec, struct rc_secdef *secdef,
   if (env.traceable)
     tracefile (&sec->loc, _("Section %s"), sec->name);
   
+  /* eval_error jumps back here */
   if (setjmp (env.jmp) == 0)
-    stmt_list_eval (&env, sec->stmt);
+    rc_prog_run (&env, sec->prog);
   
-  if (env.refstr)
-    argcv_free (-1, env.refstr);
+  anubis_regex_match_free (&env.match);
 }	
 
 void
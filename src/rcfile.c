@@ -45,7 +45,11 @@
 #define MAX_SECTIONS 10
 
 static RC_SECTION *parse_tree;
+static unsigned parse_tree_gen; /* Incremented on each change of
+				   parse_tree */
 static time_t global_mtime;
+static int client_linked;  /* Set when a user file is merged into
+			      parse_tree */
 static struct rc_secdef anubis_rc_sections[MAX_SECTIONS];
 static int anubis_rc_numsections;
 
@@ -148,36 +152,44 @@ auth_tunnel (void) /* FIXME: Change to a proper name */
   process_rcfile (CF_CLIENT);
 }
 
+/* Return the name of the system configuration file (allocated) */
+char *
+system_rcfile_name (void)
+{
+  char homedir[MAXPATHLEN + 1];
+  char *rcfile;
+  
+  if (topt & T_ALTRC)
+    rcfile = strdup (options.altrc);
+  else if (check_superuser ())
+    rcfile = strdup (DEFAULT_GLOBAL_RCFILE);
+  else
+    {
+      get_homedir (session.supervisor, homedir, sizeof (homedir));
+      rcfile = xmalloc (strlen (homedir) +
+			strlen (DEFAULT_LOCAL_RCFILE) + 2);
+      sprintf (rcfile, "%s/%s", homedir, DEFAULT_LOCAL_RCFILE);
+    }
+  return rcfile;
+}
+
 void
 open_rcfile (int method)
 {
-  char homedir[MAXPATHLEN + 1];
   char *rcfile = 0;
   RC_SECTION *sec;
 
   switch (method) {
   case CF_INIT:
   case CF_SUPERVISOR:
-    if (topt & T_ALTRC)
-      {
-	rcfile = strdup (options.altrc);
-      }
-    else if (check_superuser ())
-      rcfile = strdup (DEFAULT_GLOBAL_RCFILE);
-    else
-      {
-	get_homedir (session.supervisor, homedir, sizeof (homedir));
-	rcfile = xmalloc (strlen (homedir) +
-			  strlen (DEFAULT_LOCAL_RCFILE) + 2);
-	sprintf (rcfile, "%s/%s", homedir, DEFAULT_LOCAL_RCFILE);
-      }
-    
+    rcfile = system_rcfile_name ();
     if (check_filename (rcfile, &global_mtime) == 0)
       {
 	free (rcfile);
 	return;
       }
     rc_section_list_destroy (&parse_tree);
+    parse_tree_gen++;
     file_id_destroy ();
     info (VERBOSE, _("Reading system configuration file %s..."), rcfile);
     break;
@@ -204,11 +216,79 @@ open_rcfile (int method)
     {
       sec = rc_parse (rcfile);
       if (sec)
-	rc_section_link (&parse_tree, sec);
+	{
+	  rc_section_link (&parse_tree, sec);
+	  parse_tree_gen++;
+	  if (method == CF_CLIENT)
+	    client_linked = 1;
+	}
     }
   free (rcfile);
 }
 
+/* Reload statistics */
+static unsigned long reload_count;     /* Number of successful reloads */
+static unsigned long reload_usec;      /* Duration of the last reload */
+
+/* Re-read the system configuration file.  The new parse tree is built
+   aside and replaces the current one only if the file has been read
+   successfully.  Returns 0 on success and -1 on failure, in which case
+   the current configuration stays in effect. */
+int
+reload_rcfile (void)
+{
+  RC_SECTION *old_tree = parse_tree;
+  ANUBIS_LIST old_file_ids = file_id_list;
+  time_t old_mtime = global_mtime;
+  struct timeval start, end;
+
+  gettimeofday (&start, NULL);
+  parse_tree = NULL;
+  file_id_list = NULL;
+  global_mtime = 0;
+  open_rcfile (CF_SUPERVISOR);
+  if (!parse_tree)
+    {
+      file_id_destroy ();
+      parse_tree = old_tree;
+      file_id_list = old_file_ids;
+      global_mtime = old_mtime;
+      anubis_error (0, 0,
+		    _("configuration file not reloaded; "
+		      "keeping the current configuration"));
+      return -1;
+    }
+  rc_section_list_destroy (&old_tree);
+  parse_tree_gen++;
+  list_destroy (&old_file_ids, anubis_free_list_item, NULL);
+  gettimeofday (&end, NULL);
+
+  reload_count++;
+  reload_usec = (end.tv_sec - start.tv_sec) * 1000000
+                + end.tv_usec - start.tv_usec;
+  info (NORMAL, _("Configuration reloaded (reload #%lu, %lu.%06lu s)."),
+	reload_count, reload_usec / 1000000, reload_usec % 1000000);
+  return 0;
+}
+
+/* Return the number of successful reloads and the duration of the
+   last one in microseconds */
+unsigned long
+rcfile_reload_stat (unsigned long *usec)
+{
+  if (usec)
+    *usec = reload_usec;
+  return reload_count;
+}
+
+/* Return true if a user configuration file has been merged into the
+   parse tree. */
+int
+rcfile_client_linked (void)
+{
+  return client_linked;
+}
+
 void
 process_rcfile (int method)
 {
@@ -260,6 +340,27 @@ process_rcfile (int method)
 #define KW_LOG_FACILITY             35
 #define KW_LOG_TAG                  36
 #define KW_ESMTP_AUTH_DELAYED       37
+#define KW_MIN_SPARE_WORKERS        38
+#define KW_MAX_SPARE_WORKERS        39
+#define KW_MAX_WORKERS              40
+#define KW_MAX_SESSIONS_PER_WORKER  41
+#define KW_MAX_CLIENTS              42
+#define KW_MAX_CLIENTS_PER_IP       43
+#define KW_CONNECTION_RATE_PER_IP   44
+#define KW_LISTEN_BACKLOG           45
+#define KW_REUSEPORT_GROUPS         46
+#define KW_SCOREBOARD_FILE          47
+#define KW_DRAIN_TIMEOUT            48
+#define KW_STREAM_BUFFER_SIZE       49
+#define KW_CONNECT_TIMEOUT          50
+#define KW_UPSTREAM_MAX_REUSE       51
+#define KW_UPSTREAM_IDLE_TIMEOUT    52
+#define KW_UPSTREAM_MAX_CONNECTIONS 53
+#define KW_RESOLVER_CACHE_TTL       54
+#define KW_RESOLVER_NEGATIVE_TTL    55
+#define KW_BODY_MEMORY_LIMIT        56
+#define KW_BODY_SPOOL_DIRECTORY     57
+#define KW_MDA_MAX_DELIVERIES       58
 
 char **
 list_to_argv (ANUBIS_LIST  list)
@@ -328,6 +429,19 @@ static volatile unsigned long _anubis_hang;
 /* List of users who are allowed to use HANG in their profiles */
 ANUBIS_LIST allow_hang_users; 
 
+static void
+parse_count (EVAL_ENV env, const char *arg, unsigned *res)
+{
+  unsigned long n;
+  char *endp;
+
+  n = strtoul (arg, &endp, 10);
+  if (*endp || (unsigned) n != n)
+    eval_error (0, env, _("invalid number: %s"), arg);
+  else
+    *res = n;
+}
+
 static int
 parse_esmtp_kv (int key, ANUBIS_LIST arglist)
 {
@@ -421,9 +535,27 @@ control_parser (EVAL_ENV env, int key, ANUBIS_LIST arglist, void *inv_data)
   switch (key)
     {
     case KW_BIND:
-      parse_mtahost (arg, &session.anubis, &session.anubis_port);
-      if (session.anubis && strlen (session.anubis) != 0)
-	topt |= T_NAMES;
+      {
+	char *p;
+	ITERATOR itr = iterator_create (arglist);
+
+	bind_list_clear ();
+	for (p = iterator_first (itr); p; p = iterator_next (itr))
+	  bind_list_add (p);
+	iterator_destroy (&itr);
+      }
+      break;
+
+    case KW_LISTEN_BACKLOG:
+      parse_count (env, arg, &listen_backlog);
+      break;
+
+    case KW_REUSEPORT_GROUPS:
+      parse_count (env, arg, &reuseport_groups);
+      break;
+
+    case KW_SCOREBOARD_FILE:
+      assign_string (&scoreboard_file, arg);
       break;
       
     case KW_RULE_PRIORITY:
@@ -591,6 +723,10 @@ control_parser (EVAL_ENV env, int key, ANUBIS_LIST arglist, void *inv_data)
       outgoing_mail_rule = strdup (arg);
       break;
 
+    case KW_MDA_MAX_DELIVERIES:
+      parse_count (env, arg, &mda_max_deliveries);
+      break;
+
     case KW_SMTP_COMMAND_RULE:
       smtp_command_rule = strdup (arg);
       break;
@@ -603,6 +739,89 @@ control_parser (EVAL_ENV env, int key, ANUBIS_LIST arglist, void *inv_data)
       log_tag = strdup (arg);
       break;
       
+    case KW_MIN_SPARE_WORKERS:
+      parse_count (env, arg, &min_spare_workers);
+      break;
+
+    case KW_MAX_SPARE_WORKERS:
+      parse_count (env, arg, &max_spare_workers);
+      break;
+
+    case KW_MAX_WORKERS:
+      parse_count (env, arg, &max_workers);
+      if (max_workers == 0)
+	{
+	  eval_error (0, env, _("max-workers must be positive"));
+	  max_workers = 1;
+	}
+      break;
+
+    case KW_MAX_SESSIONS_PER_WORKER:
+      parse_count (env, arg, &max_worker_sessions);
+      break;
+
+    case KW_DRAIN_TIMEOUT:
+      parse_count (env, arg, &drain_timeout);
+      break;
+
+    case KW_STREAM_BUFFER_SIZE:
+      parse_count (env, arg, &stream_buffer_size);
+      break;
+
+    case KW_CONNECT_TIMEOUT:
+      parse_count (env, arg, &connect_timeout);
+      break;
+
+    case KW_UPSTREAM_MAX_REUSE:
+      parse_count (env, arg, &upstream_max_reuse);
+      break;
+
+    case KW_UPSTREAM_IDLE_TIMEOUT:
+      parse_count (env, arg, &upstream_idle_timeout);
+      break;
+
+    case KW_UPSTREAM_MAX_CONNECTIONS:
+      parse_count (env, arg, &upstream_max_connections);
+      break;
+
+    case KW_RESOLVER_CACHE_TTL:
+      parse_count (env, arg, &resolver_cache_ttl);
+      break;
+
+    case KW_RESOLVER_NEGATIVE_TTL:
+      parse_count (env, arg, &resolver_negative_ttl);
+      break;
+
+    case KW_BODY_MEMORY_LIMIT:
+      parse_count (env, arg, &body_memory_limit);
+      break;
+
+    case KW_BODY_SPOOL_DIRECTORY:
+      assign_string (&body_spool_directory, arg);
+      break;
+
+    case KW_MAX_CLIENTS:
+      parse_count (env, arg, &max_clients);
+      break;
+
+    case KW_MAX_CLIENTS_PER_IP:
+      parse_count (env, arg, &max_clients_per_ip);
+      break;
+
+    case KW_CONNECTION_RATE_PER_IP:
+      parse_count (env, arg, &connection_rate_count);
+      if (list_count (arglist) > 1)
+	{
+	  unsigned n = 0;
+	  
+	  parse_count (env, list_item (arglist, 1), &n);
+	  if (n == 0)
+	    eval_error (0, env, _("interval must be positive"));
+	  else
+	    connection_rate_interval = n;
+	}
+      break;
+      
     case KW_ALLOW_HANG:
       {
 	char *p;
@@ -654,10 +873,14 @@ control_parser (EVAL_ENV env, int key, ANUBIS_LIST arglist, void *inv_data)
 
 static struct rc_kwdef init_kw[] = {
   { "bind",         KW_BIND },
+  { "listen-backlog", KW_LISTEN_BACKLOG },
+  { "reuseport-groups", KW_REUSEPORT_GROUPS },
+  { "scoreboard-file", KW_SCOREBOARD_FILE },
   { "local-domain", KW_LOCAL_DOMAIN },
   { "mode",         KW_MODE },
   { "incoming-mail-rule", KW_INCOMING_MAIL_RULE },
   { "outgoing-mail-rule", KW_OUTGOING_MAIL_RULE },
+  { "mda-max-deliveries", KW_MDA_MAX_DELIVERIES },
   { "smtp-command-rule", KW_SMTP_COMMAND_RULE },
   { "log-facility", KW_LOG_FACILITY },
   { "log-tag", KW_LOG_TAG },
@@ -681,6 +904,22 @@ static struct rc_kwdef init_supervisor_kw[] = {
   { "control-priority",   KW_CONTROL_PRIORITY },
   { "logfile",            KW_LOGFILE },
   { "loglevel",           KW_LOGLEVEL },
+  { "min-spare-workers",  KW_MIN_SPARE_WORKERS },
+  { "max-spare-workers",  KW_MAX_SPARE_WORKERS },
+  { "max-workers",        KW_MAX_WORKERS },
+  { "max-sessions-per-worker", KW_MAX_SESSIONS_PER_WORKER },
+  { "drain-timeout",      KW_DRAIN_TIMEOUT },
+  { "stream-buffer-size", KW_STREAM_BUFFER_SIZE },
+  { "upstream-max-reuse", KW_UPSTREAM_MAX_REUSE },
+  { "upstream-idle-timeout", KW_UPSTREAM_IDLE_TIMEOUT },
+  { "upstream-max-connections", KW_UPSTREAM_MAX_CONNECTIONS },
+  { "resolver-cache-ttl", KW_RESOLVER_CACHE_TTL },
+  { "resolver-negative-ttl", KW_RESOLVER_NEGATIVE_TTL },
+  { "body-memory-limit",  KW_BODY_MEMORY_LIMIT },
+  { "body-spool-directory", KW_BODY_SPOOL_DIRECTORY },
+  { "max-clients",        KW_MAX_CLIENTS },
+  { "max-clients-per-ip", KW_MAX_CLIENTS_PER_IP },
+  { "connection-rate-per-ip", KW_CONNECTION_RATE_PER_IP },
   { NULL }
 };
 
@@ -709,6 +948,7 @@ static struct rc_secdef_child client_sect_child = {
 
 struct rc_kwdef control_kw[] = {
   { "remote-mta",   KW_REMOTE_MTA },
+  { "connect-timeout", KW_CONNECT_TIMEOUT },
   { "local-mta",    KW_LOCAL_MTA },
   { "tracefile",    KW_TRACEFILE },
   { "esmtp-auth",   KW_ESMTP_AUTH, KWF_HIDDEN },
@@ -1014,16 +1254,163 @@ rcfile_process_section (int method, char *name, void *data, MESSAGE msg)
     rc_run_section (method, sec, anubis_rc_sections, NULL, data, msg);
 }
 
+/* Return the generation number of the parse tree.  It changes each
+   time sections are added to or removed from the tree, so that
+   references to sections may be cached. */
+unsigned
+rcfile_generation (void)
+{
+  return parse_tree_gen;
+}
+
+RC_SECTION *
+rcfile_find_section (char *name)
+{
+  return rc_section_lookup (parse_tree, name);
+}
+
+/* Run the section `sec', found under the name `name' */
 void
-rcfile_call_section (int method, char *name, char *class,
-		     void *data, MESSAGE msg)
+rcfile_run_section (int method, RC_SECTION *sec, char *name, char *class,
+		    void *data, MESSAGE msg)
 {
-  RC_SECTION *sec = rc_section_lookup (parse_tree, name);
   if (!sec)
     info (VERBOSE, _("No such section: %s"), name);
   rc_run_section (method, sec, anubis_rc_sections, class, data, msg);
 }
 
+void
+rcfile_call_section (int method, char *name, char *class,
+		     void *data, MESSAGE msg)
+{
+  rcfile_run_section (method, rcfile_find_section (name), name, class,
+		      data, msg);
+}
+
+/* Maximum nesting of `call' statements followed by section_body_use */
+#define MAX_CALL_DEPTH 16
+
+/* RULE statements that only replace the body or append text to it.
+   They can be applied to the body while it is being transferred (see
+   message_defer_body). */
+static char *streamed_body_kw[] = {
+  "signature-file-append",
+  "body-append",
+  "body-clear-append",
+  "body-clear",
+  NULL
+};
+
+static int stmt_body_use (RC_STMT *stmt, int depth);
+
+static int
+node_body_use (RC_NODE *node)
+{
+  if (!node)
+    return body_unused;
+  switch (node->type)
+    {
+    case rc_node_bool:
+      if (node_body_use (node->v.bool.left) == body_needed)
+	return body_needed;
+      return node_body_use (node->v.bool.right);
+
+    case rc_node_expr:
+      /* Conditions are evaluated before the body is read */
+      return node->v.expr.part == BODY ? body_needed : body_unused;
+    }
+  return body_needed;
+}
+
+static int
+asgn_body_use (RC_ASGN *asgn)
+{
+  int i;
+
+  for (i = 0; streamed_body_kw[i]; i++)
+    if (strcmp (asgn->lhs, streamed_body_kw[i]) == 0)
+      return body_streamed;
+  /* Other RULE statements may operate on the whole body */
+  return body_needed;
+}
+
+static int
+stmt_body_use (RC_STMT *stmt, int depth)
+{
+  int use = body_unused;
+
+  for (; stmt && use != body_needed; stmt = stmt->next)
+    {
+      int u = body_unused;
+
+      switch (stmt->type)
+	{
+	case rc_stmt_asgn:
+	  u = asgn_body_use (&stmt->v.asgn);
+	  break;
+
+	case rc_stmt_cond:
+	  u = node_body_use (stmt->v.cond.node);
+	  if (u != body_needed)
+	    u = stmt_body_use (stmt->v.cond.iftrue, depth);
+	  if (u != body_needed)
+	    {
+	      int v = stmt_body_use (stmt->v.cond.iffalse, depth);
+	      if (v > u)
+		u = v;
+	    }
+	  break;
+
+	case rc_stmt_rule:
+	  u = node_body_use (stmt->v.rule.node);
+	  if (u != body_needed)
+	    u = stmt_body_use (stmt->v.rule.stmt, depth);
+	  break;
+
+	case rc_stmt_inst:
+	  if (stmt->v.inst.part == BODY)
+	    /* ADD and MODIFY BODY work line by line */
+	    u = body_streamed;
+	  else if (stmt->v.inst.opcode == inst_call)
+	    {
+	      RC_SECTION *sec;
+
+	      if (depth >= MAX_CALL_DEPTH)
+		u = body_needed;
+	      else if ((sec = rc_section_lookup (parse_tree, stmt->v.inst.arg)))
+		u = stmt_body_use (sec->stmt, depth + 1);
+	    }
+	  break;
+	}
+      if (u > use)
+	use = u;
+    }
+  return use;
+}
+
+/* Return how running the section `name' uses the message body:
+   body_unused if it does not look at it at all, so that the body can
+   be relayed as is; body_streamed if the section only modifies the
+   body in ways that can be applied to it line by line as it is being
+   transferred; and body_needed if the whole body must be collected
+   before running the section. */
+int
+rcfile_section_body_use (char *name)
+{
+  RC_SECTION *sec = rc_section_lookup (parse_tree, name);
+
+  return sec ? stmt_body_use (sec->stmt, 0) : body_unused;
+}
+
+/* Return true if running the section `name' may inspect or modify the
+   message body.  If it does not, the body can be relayed without
+   collecting it. */
+int
+rcfile_section_needs_body (char *name)
+{
+  return rcfile_section_body_use (name) != body_unused;
+}
+
 char *
 user_rcfile_name (void)
 {
@@ -59,6 +59,7 @@ struct rc_section
   RC_SECTION *next;		/* Link to the next section */
   char *name;			/* Section name */
   RC_STMT *stmt;		/* List of parsed statements */
+  struct rc_prog *prog;		/* Compiled statements */
 };
 
 enum rc_stmt_type
@@ -104,6 +105,8 @@ struct rc_expr
 				   a same key, using this string as a separator
 				   before matching */
   char *key;
+  int atom;                     /* Header name atom of `key' (HEADER),
+				   or -1 */
   RC_REGEX *re;
 };
 
@@ -231,6 +234,10 @@ int rc_run_cond (char *, int, char *);
 void rc_run_section (int, RC_SECTION *, struct rc_secdef *, const char *,
 		     void *, MESSAGE);
 void rc_set_debug_level (char *);
+
+unsigned rcfile_generation (void);
+RC_SECTION *rcfile_find_section (char *);
+void rcfile_run_section (int, RC_SECTION *, char *, char *, void *, MESSAGE);
 int rc_open (char *);
 struct rc_secdef *anubis_add_section (char *);
 struct rc_secdef *anubis_find_section (char *);
@@ -24,7 +24,10 @@
 
 #include <regex.h>
 #ifdef HAVE_PCRE
-# ifdef HAVE_PCRE_H
+# ifdef HAVE_PCRE2
+#  define PCRE2_CODE_UNIT_WIDTH 8
+#  include <pcre2.h>
+# elif defined (HAVE_PCRE_H)
 #  include <pcre.h>
 # elif defined (HAVE_PCRE_PCRE_H)
 #  include <pcre/pcre.h>
@@ -35,8 +38,8 @@
  Regular Expressions support
 *****************************/
 
-typedef int (*_match_fp) (RC_REGEX *, const char *,
-			  int *, char ***, int *, int *);
+typedef int (*_match_fp) (RC_REGEX *, const char *, size_t,
+			  struct regex_match *);
 typedef int (*_refcnt_fp) (RC_REGEX *);
 typedef int (*_compile_fp) (RC_REGEX *, char *, int);
 typedef void (*_free_fp) (RC_REGEX *);
@@ -52,20 +55,20 @@ struct regex_vtab
 
 static int exact_compile (RC_REGEX *, char *, int);
 static void exact_free (RC_REGEX *);
-static int exact_match (RC_REGEX *, const char *,
-			int *, char ***, int *, int *);
+static int exact_match (RC_REGEX *, const char *, size_t,
+			struct regex_match *);
 static int exact_refcnt (RC_REGEX *);
 
 static int posix_compile (RC_REGEX *, char *, int);
 static void posix_free (RC_REGEX *);
-static int posix_match (RC_REGEX *, const char *,
-			int *, char ***, int *, int *);
+static int posix_match (RC_REGEX *, const char *, size_t,
+			struct regex_match *);
 static int posix_refcnt (RC_REGEX *);
 #ifdef HAVE_PCRE
 static int perl_compile (RC_REGEX *, char *, int);
 static void perl_free (RC_REGEX *);
-static int perl_match (RC_REGEX *, const char *,
-		       int *, char ***, int *, int *);
+static int perl_match (RC_REGEX *, const char *, size_t,
+		       struct regex_match *);
 static int perl_refcnt (RC_REGEX *);
 #endif /* HAVE_PCRE */
 
@@ -82,10 +85,18 @@ struct rc_regex
 {				/* Regular expression */
   char *src;			/* Raw-text representation */
   int flags;			/* Compilation flags */
+  const char *lit;		/* Literal required by the regex (points
+				   into src), or NULL */
+  size_t litlen;		/* Its length */
+  unsigned hash;		/* Hash of src and flags */
+  size_t refcnt;		/* Number of references to it */
+  struct rc_regex *next;	/* Next regex in the same cache bucket */
   union
   {
     regex_t re;			/* POSIX regex */
-#ifdef HAVE_PCRE
+#ifdef HAVE_PCRE2
+    pcre2_code *pre;		/* Perl */
+#elif defined (HAVE_PCRE)
     pcre *pre;			/* Perl */
 #endif
   }
@@ -106,6 +117,353 @@ regex_vtab_lookup (int flags)
 }
 
 
+/* ************************* Required literals **************************** */
+
+/* Most regexes can only match a text that contains some literal
+   string, e.g. "foo" in "^x*foo[0-9]+".  Such a string is found when
+   the regex is compiled, and a text is searched for it before the
+   regex is run on it, which is much cheaper than running a regex that
+   does not match.  Only top-level runs of ASCII characters outside any
+   group are considered, and none at all if the regex has alternatives
+   or, for Perl regexes, inline options.  The longest such run is
+   taken. */
+
+/* Return the length of the longest literal required by the regex
+   `src' compiled with `flags', and store its start in `*start'. */
+static size_t
+regex_required_literal (const char *src, int flags, const char **start)
+{
+  int basic = re_typeof (flags) == R_POSIX && (flags & R_BASIC);
+  int perl = re_typeof (flags) == R_PERLRE;
+  const char *p = src, *run = NULL;
+  size_t len = 0, best = 0;
+  int depth = 0;
+
+#define END_RUN(drop)				\
+  do						\
+    {						\
+      if ((drop) && len > 0)			\
+	len--;					\
+      if (depth == 0 && len > best)		\
+	{					\
+	  best = len;				\
+	  *start = run;				\
+	}					\
+      len = 0;					\
+    }						\
+  while (0)
+
+  if (strchr (src, '|') || (perl && strstr (src, "(?")))
+    return 0;
+  while (*p)
+    {
+      u_char c = *p;
+
+      switch (c)
+	{
+	case '\\':
+	  if (basic && p[1] == '(')
+	    {
+	      END_RUN (0);
+	      depth++;
+	    }
+	  else if (basic && p[1] == ')')
+	    {
+	      END_RUN (0);
+	      if (depth > 0)
+		depth--;
+	    }
+	  else if (basic && p[1] == '{')
+	    {
+	      /* Skip the interval */
+	      const char *q = strstr (p + 2, "\\}");
+	      END_RUN (1);
+	      if (!q)
+		return best;
+	      p = q;
+	    }
+	  else
+	    /* An escaped character may be a quantifier (in basic regexes)
+	       or a class, so it ends the run, making the last character
+	       optional if needed. */
+	    END_RUN (basic && p[1] == '?');
+	  p += p[1] ? 2 : 1;
+	  continue;
+
+	case '[':
+	  END_RUN (0);
+	  p++;
+	  if (*p == '^')
+	    p++;
+	  if (*p == ']')
+	    p++;
+	  while (*p && *p != ']')
+	    {
+	      if (*p == '[' && p[1] && strchr (":=.", p[1]))
+		{
+		  const char *q = strchr (p + 2, ']');
+		  if (!q)
+		    return 0;
+		  p = q;
+		}
+	      else if (perl && *p == '\\' && p[1])
+		p++;
+	      p++;
+	    }
+	  if (*p)
+	    p++;
+	  continue;
+
+	case '(':
+	  END_RUN (0);
+	  if (!basic)
+	    depth++;
+	  break;
+
+	case ')':
+	  END_RUN (0);
+	  if (!basic && depth > 0)
+	    depth--;
+	  break;
+
+	case '{':
+	  if (!basic)
+	    {
+	      /* Skip the interval */
+	      const char *q = strchr (p, '}');
+	      END_RUN (1);
+	      if (!q)
+		return best;
+	      p = q;
+	    }
+	  else
+	    END_RUN (1);
+	  break;
+
+	case '*':
+	case '?':
+	  /* The last character may occur zero times */
+	  END_RUN (1);
+	  break;
+
+	case '+':
+	case '.':
+	case '^':
+	case '$':
+	case ']':
+	case '}':
+	  END_RUN (0);
+	  break;
+
+	default:
+	  if (!isascii (c))
+	    END_RUN (0);
+	  else
+	    {
+	      if (len == 0)
+		run = p;
+	      len++;
+	    }
+	}
+      p++;
+    }
+  END_RUN (0);
+  return best;
+#undef END_RUN
+}
+
+#define ASCII_LOWER(c) ((c) >= 'A' && (c) <= 'Z' ? (c) - 'A' + 'a' : (c))
+
+/* Return true if `text' certainly contains no match of `re', because
+   it lacks the literal `re' requires.  Case-insensitive search is
+   only done in ASCII text, since the regex engine folds the case of
+   other characters according to the locale. */
+static int
+regex_literal_absent (RC_REGEX *re, const char *text)
+{
+  const u_char *p, *lit = (const u_char *) re->lit;
+  size_t n = re->litlen;
+
+  if (n == 0)
+    return 0;
+  if (re->flags & R_SCASE)
+    return memmem (text, strlen (text), lit, n) == NULL;
+  for (p = (const u_char *) text; *p; p++)
+    {
+      size_t i;
+
+      if (!isascii (*p))
+	return 0;
+      for (i = 0; i < n && ASCII_LOWER (p[i]) == ASCII_LOWER (lit[i]); i++)
+	;
+      if (i == n)
+	return 0;
+    }
+  return 1;
+}
+
+/* Run `re' on `line' from the offset `start', unless its required
+   literal shows that it cannot match.  Arguments and return value are
+   as for the match method. */
+static int
+regex_exec (struct regex_vtab *vp, RC_REGEX *re, const char *line,
+	    size_t start, struct regex_match *m)
+{
+  if (regex_literal_absent (re, line + start))
+    return 1;
+  return vp->match (re, line, start, m);
+}
+
+
+/* **************************** Match results ***************************** */
+
+/* A successful match stores in a `struct regex_match' the spans of the
+   match and of its back-references, as offsets into the matched
+   string, rather than copies of the substrings.  The spans, the saved
+   back-references (see anubis_regex_match_save) and the results of
+   substitutions are kept in buffers that belong to the structure and
+   are reused by the following matches, so that once they have grown
+   to the needed size, matching and substituting allocate no memory.
+   A failed match leaves the structure unchanged. */
+
+void
+anubis_regex_match_free (struct regex_match *m)
+{
+  free (m->span);
+  free (m->save);
+  free (m->out);
+  memset (m, 0, sizeof (*m));
+}
+
+/* Make room for `n' spans in `m' */
+static void
+regex_match_reserve (struct regex_match *m, size_t n)
+{
+  if (n > m->max)
+    {
+      m->max = n;
+      m->span = xrealloc (m->span, n * sizeof (m->span[0]));
+    }
+}
+
+/* Grow the buffer `*pbuf' of `*psize' bytes to hold at least `size'
+   bytes */
+static void
+regex_buf_reserve (char **pbuf, size_t *psize, size_t size)
+{
+  if (size > *psize)
+    {
+      size_t n = *psize ? *psize : 64;
+
+      while (n < size)
+	n *= 2;
+      *pbuf = xrealloc (*pbuf, n);
+      *psize = n;
+    }
+}
+
+/* Copy the back-references of the last match to the buffer of `m', so
+   that they remain valid after the matched string is changed or
+   freed.  The span of the whole match is not kept. */
+void
+anubis_regex_match_save (struct regex_match *m)
+{
+  size_t i, size = 1, off = 0;
+  char *p;
+
+  if (m->subject == m->save)
+    return;
+  m->span[0].so = m->span[0].eo = REGEX_UNSET;
+  if (m->count == 0)
+    {
+      /* Nothing to keep */
+      m->subject = NULL;
+      return;
+    }
+  for (i = 1; i <= m->count; i++)
+    if (m->span[i].so != REGEX_UNSET)
+      size += m->span[i].eo - m->span[i].so;
+  regex_buf_reserve (&m->save, &m->savesize, size);
+  p = m->save;
+  for (i = 1; i <= m->count; i++)
+    if (m->span[i].so != REGEX_UNSET)
+      {
+	size_t len = m->span[i].eo - m->span[i].so;
+
+	memcpy (p + off, m->subject + m->span[i].so, len);
+	m->span[i].so = off;
+	m->span[i].eo = off += len;
+      }
+  p[off] = 0;
+  m->subject = m->save;
+}
+
+/* Append `len' bytes of `text' to the output buffer of `m', which
+   holds `*plen' bytes */
+static void
+regex_out_append (struct regex_match *m, size_t *plen,
+		  const char *text, size_t len)
+{
+  regex_buf_reserve (&m->out, &m->outsize, *plen + len + 1);
+  memcpy (m->out + *plen, text, len);
+  *plen += len;
+}
+
+/* Append `templ' to the output buffer of `m', replacing each
+   back-reference \1 to \9 with the corresponding substring of the
+   last match.  References to substrings the regex does not have are
+   left as they are. */
+static void
+regex_out_expand (struct regex_match *m, size_t *plen, const char *templ)
+{
+  const char *p;
+
+  while ((p = strchr (templ, '\\')) != NULL)
+    {
+      size_t n = p[1] - '0';
+
+      if (p[1] >= '1' && p[1] <= '9' && n <= m->count)
+	{
+	  regex_out_append (m, plen, templ, p - templ);
+	  if (m->span[n].so != REGEX_UNSET)
+	    regex_out_append (m, plen, m->subject + m->span[n].so,
+			      m->span[n].eo - m->span[n].so);
+	  templ = p + 2;
+	}
+      else
+	{
+	  regex_out_append (m, plen, templ, p - templ + 1);
+	  templ = p + 1;
+	}
+    }
+  regex_out_append (m, plen, templ, strlen (templ));
+}
+
+/* Return `templ' with its back-references replaced by the substrings
+   of the last match recorded in `m'.  The result is kept in the output
+   buffer of `m', and remains valid until `m' is used again. */
+char *
+anubis_regex_expand (struct regex_match *m, const char *templ)
+{
+  size_t len = 0;
+
+  regex_out_expand (m, &len, templ);
+  m->out[len] = 0;
+  return m->out;
+}
+
+/* Record in `m' the failure of `re' to match, as far as the
+   back-references are concerned: exact strings have none, so they
+   drop those of the previous match, whereas a failed regex keeps
+   them. */
+void
+anubis_regex_nomatch (RC_REGEX *re, struct regex_match *m)
+{
+  if (re_typeof (re->flags) == R_EXACT)
+    m->count = 0;
+}
+
+
 /* ************************** Interface Functions ************************** */
 #define ASSERT_RE(re,vp) \
  if (!(re) || (vp = regex_vtab_lookup((re)->flags)) == NULL) {\
@@ -138,86 +496,64 @@ anubis_regex_print (RC_REGEX *re)
   printf (" [%s]", anubis_regex_source (re));
 }
 
+/* Match `re' against `line'.  On success, record the match in `m',
+   unless it is NULL, and return true. */
 int
-anubis_regex_match (RC_REGEX *re, const char *line, int *refc, char ***refv)
+anubis_regex_match (RC_REGEX *re, const char *line, struct regex_match *m)
 {
-  int so, eo;
   struct regex_vtab *vp;
 
   ASSERT_RE (re, vp);
-  return vp->match (re, line, refc, refv, &so, &eo) == 0;
+  return regex_exec (vp, re, line, 0, m) == 0;
 }
 
+/* Replace each match of `re' in `line' with `repl', in which
+   back-references are expanded.  The search resumes after the end of
+   each match.  Return the resulting string, which is kept in the
+   output buffer of `m', or NULL if `re' does not match. */
 char *
-anubis_regex_replace (RC_REGEX *re, char *line, char *repl)
-{
-  int so, eo;
-  int refc;
-  char **refv;
-  char *newstr = NULL;
-  char *savep = NULL;
-  int newlen;
-  int off = 0;
-  int alloc = 0;
+anubis_regex_replace (RC_REGEX *re, const char *line, const char *repl,
+		      struct regex_match *m)
+{
+  size_t linelen = strlen (line);
+  size_t start = 0, len = 0, prev = REGEX_UNSET;
+  int matched = 0;
   struct regex_vtab *vp;
 
   ASSERT_RE (re, vp);
-  while (vp->match (re, line + off, &refc, &refv, &so, &eo) == 0)
+  while (start <= linelen && regex_exec (vp, re, line, start, m) == 0)
     {
-      char *p;
-      int plen;
+      size_t so = m->span[0].so, eo = m->span[0].eo;
 
-      if (so == -1)
+      if (eo == so && so == prev)
 	{
-	  char *q;
-
-	  q = strstr (line + off, anubis_regex_source (re));
-
-	  if (q)
-	    {
-	      alloc = 0;
-	      p = repl;
-	      so = (q - (line + off));
-	      eo = so + strlen (anubis_regex_source (re));
-	    }
-	  else
-	    {
-	      char *x[2];
-
-	      x[0] = line + off;
-	      x[1] = NULL;
-
-	      alloc = 1;
-	      p = substitute (repl, x);
-	      
-	      so = 0;
-	      eo = strlen (line + off);
-	    }
+	  /* An empty match right after the previous match is not a new
+	     match, as in sed: "[a-z]*" turns "abc" into one "x", not two */
+	  if (so < linelen)
+	    regex_out_append (m, &len, line + so, 1);
+	  start = so + 1;
+	  continue;
 	}
-      else
+      regex_out_append (m, &len, line + start, so - start);
+      regex_out_expand (m, &len, repl);
+      matched = 1;
+      prev = eo;
+      if (eo == so)
 	{
-	  alloc = 1;
-	  p = substitute (repl, refv);
-	  argcv_free (-1, refv);
+	  /* Step over an empty match */
+	  if (so < linelen)
+	    regex_out_append (m, &len, line + so, 1);
+	  start = so + 1;
 	}
-
-      plen = strlen (p);
-      
-      savep = newstr;
-      newlen = strlen (line) - (eo - so) + plen + 1;
-      newstr = xmalloc (newlen);
-      memcpy (newstr, line, off + so);
-      memcpy (newstr + off + so, p, plen);
-      strcpy (newstr + off + so + plen, line + off + eo);
-
-      if (alloc)
-	xfree (p);
-      if (savep)
-	xfree (savep);
-      line = newstr;
-      off += so;
+      else
+	start = eo;
     }
-  return newstr;
+  if (!matched)
+    return NULL;
+  if (start < linelen)
+    regex_out_append (m, &len, line + start, linelen - start);
+  m->out[len] = 0;
+  return m->out;
 }
 
 int
@@ -229,14 +565,101 @@ anubis_regex_refcnt (RC_REGEX *re)
   return vp->refcnt (re);
 }
 
+/* Regex cache.
+
+   The same regexes tend to appear in many configuration files, e.g.
+   in the RULE sections of user files.  Compiled regexes are therefore
+   kept in a hash table keyed by their source and flags, and shared by
+   all references to them: anubis_regex_compile returns the cached
+   regex if there is one, and anubis_regex_free frees it only when its
+   last reference goes away.  The regexes of the system configuration
+   file are compiled by the master process, so the worker processes
+   get them with their memory, and find them there when they parse the
+   user configuration files.  Compiled regexes are never modified
+   once created, which makes sharing them safe. */
+
+static RC_REGEX **regex_cache;	/* Hash buckets */
+static size_t regex_cache_size;	/* Number of buckets, a power of 2 */
+static size_t regex_cache_count; /* Number of regexes in the cache */
+
+static unsigned
+regex_hash (const char *src, int flags)
+{
+  unsigned h = 2166136261u ^ flags;
+
+  for (; *src; src++)
+    h = (h ^ *(u_char *) src) * 16777619u;
+  return h;
+}
+
+static RC_REGEX **
+regex_cache_bucket (unsigned hash)
+{
+  return &regex_cache[hash & (regex_cache_size - 1)];
+}
+
+static void
+regex_cache_insert (RC_REGEX *re)
+{
+  RC_REGEX **bucket;
+
+  if (regex_cache_count >= regex_cache_size)
+    {
+      size_t i, oldsize = regex_cache_size;
+      RC_REGEX **old = regex_cache;
+
+      regex_cache_size = oldsize ? oldsize * 2 : 64;
+      regex_cache = xcalloc (regex_cache_size, sizeof (regex_cache[0]));
+      for (i = 0; i < oldsize; i++)
+	while (old[i])
+	  {
+	    RC_REGEX *p = old[i];
+	    old[i] = p->next;
+	    bucket = regex_cache_bucket (p->hash);
+	    p->next = *bucket;
+	    *bucket = p;
+	  }
+      free (old);
+    }
+  bucket = regex_cache_bucket (re->hash);
+  re->next = *bucket;
+  *bucket = re;
+  regex_cache_count++;
+}
+
+static void
+regex_cache_remove (RC_REGEX *re)
+{
+  RC_REGEX **p;
+
+  for (p = regex_cache_bucket (re->hash); *p; p = &(*p)->next)
+    if (*p == re)
+      {
+	*p = re->next;
+	regex_cache_count--;
+	break;
+      }
+}
+
 RC_REGEX *
 anubis_regex_compile (char *line, int opt)
 {
   struct regex_vtab *vp = regex_vtab_lookup (opt);
   RC_REGEX *p;
+  unsigned hash;
 
   if (!vp)
     return 0;
+
+  hash = regex_hash (line, opt);
+  if (regex_cache_size)
+    for (p = *regex_cache_bucket (hash); p; p = p->next)
+      if (p->hash == hash && p->flags == opt && strcmp (p->src, line) == 0)
+	{
+	  p->refcnt++;
+	  return p;
+	}
+
   p = xmalloc (sizeof (*p));
   if (vp->compile (p, line, opt))
     {
@@ -246,6 +669,13 @@ anubis_regex_compile (char *line, int opt)
     {
       p->src = strdup (line);
       p->flags = opt;
+      p->lit = NULL;
+      p->litlen = 0;
+      if (re_typeof (opt) != R_EXACT)
+	p->litlen = regex_required_literal (p->src, opt, &p->lit);
+      p->hash = hash;
+      p->refcnt = 1;
+      regex_cache_insert (p);
     }
   return p;
 }
@@ -258,6 +688,12 @@ anubis_regex_free (RC_REGEX **pre)
   if (!*pre)
     return;
   ASSERT_RE (*pre, vp);
+  if (--(*pre)->refcnt)
+    {
+      *pre = NULL;
+      return;
+    }
+  regex_cache_remove (*pre);
   free ((*pre)->src);
   vp->free (*pre);
   xfree (*pre);
@@ -270,6 +706,37 @@ anubis_regex_source (RC_REGEX *re)
     return NULL;
   return re->src;
 }
+
+int
+anubis_regex_flags (RC_REGEX *re)
+{
+  return re->flags;
+}
+
+/* Return the length of a literal string that occurs in every string
+   matched by `re', or 0 if none is found.  The literal starts at
+   `*start'.  For an exact string, it is the string itself.  For a
+   regular expression, it is the literal found when it was compiled.
+   Only ASCII characters are taken, so that matching the literal
+   case-insensitively is equivalent to matching it with the regex
+   engine in any locale. */
+size_t
+anubis_regex_literal (RC_REGEX *re, const char **start)
+{
+  const char *p = re->src;
+  size_t len = 0;
+
+  if (re_typeof (re->flags) == R_EXACT)
+    {
+      for (; p[len]; len++)
+	if (!isascii ((u_char) p[len]))
+	  return 0;
+      *start = p;
+      return len;
+    }
+  *start = re->lit;
+  return re->litlen;
+}
 
 
 /* **************************** Exact strings ***************************** */
@@ -286,20 +753,27 @@ exact_free (RC_REGEX *regex)
 }
 
 
+/* An exact string matches the whole line, and has no back-references */
 static int
-exact_match (RC_REGEX *regex, const char *line, int *refc, char ***refv,
-	     int *so, int *eo)
+exact_match (RC_REGEX *regex, const char *line, size_t start,
+	     struct regex_match *m)
 {
   int code;
 
-  *eo = *so = -1;
-  *refc = 0;
-  *refv = NULL;
-
+  if (start > 0)
+    return 1;
   if (regex->flags & R_SCASE)
     code = strcmp (line, regex->src);
   else
     code = strcasecmp (line, regex->src);
+  if (code == 0 && m)
+    {
+      regex_match_reserve (m, 1);
+      m->subject = line;
+      m->count = 0;
+      m->span[0].so = 0;
+      m->span[0].eo = strlen (line);
+    }
   return code;
 }
 
@@ -340,44 +814,53 @@ posix_free (RC_REGEX *regex)
   regfree (&regex->v.re);
 }
 
+/* Offsets of the last POSIX match, reused by all matches */
+static regmatch_t *posix_pmatch;
+static size_t posix_nmatch;
+
 static int
-posix_match (RC_REGEX *regex, const char *line, int *refc, char ***refv,
-	     int *so, int *eo)
+posix_match (RC_REGEX *regex, const char *line, size_t start,
+	     struct regex_match *m)
 {
-  regmatch_t *rmp;
-  int rc;
   regex_t *re = &regex->v.re;
+  size_t i, n = m ? re->re_nsub + 1 : 0;
+  int rc;
 
-  rmp = xmalloc ((re->re_nsub + 1) * sizeof (*rmp));
-  rc = regexec (re, line, re->re_nsub + 1, rmp, 0);
-  if (rc == 0)
+  if (n > posix_nmatch)
     {
-      int i;
-      *refv = xmalloc ((re->re_nsub + 2) * sizeof (**refv));
-      *eo = rmp[0].rm_eo;
-      *so = rmp[0].rm_so;
-      for (i = 0; i <= re->re_nsub; i++)
+      posix_nmatch = n;
+      posix_pmatch = xrealloc (posix_pmatch,
+			       n * sizeof (posix_pmatch[0]));
+    }
+  rc = regexec (re, line + start, n, posix_pmatch,
+		start > 0 ? REG_NOTBOL : 0);
+  if (rc == 0 && m)
+    {
+      regex_match_reserve (m, n);
+      m->subject = line;
+      m->count = re->re_nsub;
+      for (i = 0; i < n; i++)
 	{
-	  if (rmp[i].rm_so != -1)
+	  struct regex_span *sp = &m->span[i];
+
+	  if (posix_pmatch[i].rm_so == -1)
 	    {
-	      size_t matchlen = rmp[i].rm_eo - rmp[i].rm_so;
-	      (*refv)[i] = xmalloc (matchlen + 1);
-	      memcpy ((*refv)[i], line + rmp[i].rm_so, matchlen);
-	      (*refv)[i][matchlen] = 0;
-	      remcrlf ((*refv)[i]);
+	      sp->so = sp->eo = REGEX_UNSET;
+	      continue;
+	    }
+	  sp->so = start + posix_pmatch[i].rm_so;
+	  sp->eo = start + posix_pmatch[i].rm_eo;
+	  /* Back-references do not include the line terminator */
+	  if (i > 0 && sp->eo > sp->so)
+	    {
+	      if (sp->eo - sp->so >= 2
+		  && line[sp->eo - 2] == '\r' && line[sp->eo - 1] == '\n')
+		sp->eo -= 2;
+	      else if (line[sp->eo - 1] == '\n' || line[sp->eo - 1] == '\r')
+		sp->eo--;
 	    }
-	  else
-	    (*refv)[i] = strdup ("");
 	}
-      (*refv)[i] = NULL;
-      *refc = re->re_nsub;
     }
-  else
-    {
-      *eo = *so = -1;
-      *refc = 0;
-    }
-  xfree (rmp);
   return rc;
 }
 
@@ -390,7 +873,131 @@ posix_refcnt (RC_REGEX *regex)
 
 /* ********************* PERL Regular Expressions ************************ */
 
-#ifdef HAVE_PCRE
+#ifdef HAVE_PCRE2
+
+/* With PCRE2, patterns are compiled to machine code by the JIT
+   compiler, if it is available on the platform, when the
+   configuration is loaded.  The match data block, which receives the
+   offsets of the captured substrings, and the JIT stack are allocated
+   once per process and reused by all matches. */
+
+static pcre2_match_data *perl_match_data;
+static uint32_t perl_match_size;	/* Number of pairs in perl_match_data */
+static pcre2_match_context *perl_match_context;
+
+#define PERL_JIT_STACK_MIN (32 * 1024)
+#define PERL_JIT_STACK_MAX (1024 * 1024)
+
+static int
+perl_compile (RC_REGEX *regex, char *line, int opt)
+{
+  int error;
+  PCRE2_SIZE error_offset;
+  uint32_t cflags = 0;
+
+  if (!(opt & R_SCASE))
+    cflags |= PCRE2_CASELESS;
+  regex->v.pre = pcre2_compile ((PCRE2_SPTR) line, PCRE2_ZERO_TERMINATED,
+				cflags, &error, &error_offset, NULL);
+  if (regex->v.pre == NULL)
+    {
+      PCRE2_UCHAR errbuf[256];
+
+      pcre2_get_error_message (error, errbuf, sizeof (errbuf));
+      anubis_error (0, 0,
+		    _("pcre2_compile() failed at offset %lu: %s."),
+		    (unsigned long) error_offset, (char *) errbuf);
+      return 1;
+    }
+  /* Without JIT support, the interpreter is used */
+  pcre2_jit_compile (regex->v.pre, PCRE2_JIT_COMPLETE);
+  return 0;
+}
+
+static void
+perl_free (RC_REGEX *regex)
+{
+  pcre2_code_free (regex->v.pre);
+}
+
+static int
+perl_refcnt (RC_REGEX *regex)
+{
+  uint32_t count = 0;
+
+  pcre2_pattern_info (regex->v.pre, PCRE2_INFO_CAPTURECOUNT, &count);
+  return count;
+}
+
+/* Return a match data block for `count' captured substrings */
+static pcre2_match_data *
+perl_get_match_data (uint32_t count)
+{
+  if (!perl_match_context)
+    {
+      pcre2_jit_stack *stack;
+
+      perl_match_context = pcre2_match_context_create (NULL);
+      stack = pcre2_jit_stack_create (PERL_JIT_STACK_MIN, PERL_JIT_STACK_MAX,
+				      NULL);
+      if (perl_match_context && stack)
+	pcre2_jit_stack_assign (perl_match_context, NULL, stack);
+    }
+  if (count + 1 > perl_match_size)
+    {
+      pcre2_match_data_free (perl_match_data);
+      perl_match_size = count + 1;
+      perl_match_data = pcre2_match_data_create (perl_match_size, NULL);
+      if (!perl_match_data)
+	xalloc_die ();
+    }
+  return perl_match_data;
+}
+
+static int
+perl_match (RC_REGEX *regex, const char *line, size_t start,
+	    struct regex_match *m)
+{
+  int rc;
+  uint32_t count = perl_refcnt (regex);
+  pcre2_match_data *md = perl_get_match_data (count);
+
+  rc = pcre2_match (regex->v.pre, (PCRE2_SPTR) line, PCRE2_ZERO_TERMINATED,
+		    start, 0, md, perl_match_context);
+  if (rc > 0)
+    {
+      if (m)
+	{
+	  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer (md);
+	  uint32_t i;
+
+	  regex_match_reserve (m, count + 1);
+	  m->subject = line;
+	  m->count = count;
+	  for (i = 0; i <= count; i++)
+	    {
+	      if ((int) i < rc && ovector[2 * i] != PCRE2_UNSET)
+		{
+		  m->span[i].so = ovector[2 * i];
+		  m->span[i].eo = ovector[2 * i + 1];
+		}
+	      else
+		m->span[i].so = m->span[i].eo = REGEX_UNSET;
+	    }
+	}
+      return 0;
+    }
+
+  if (rc != PCRE2_ERROR_NOMATCH)
+    {
+      PCRE2_UCHAR errbuf[256];
+
+      pcre2_get_error_message (rc, errbuf, sizeof (errbuf));
+      anubis_error (0, 0, _("pcre2_match() failed: %s."), (char *) errbuf);
+    }
+  return 1;
+}
+#elif defined (HAVE_PCRE)
 
 static int
 perl_compile (RC_REGEX *regex, char *line, int opt)
@@ -418,13 +1025,16 @@ perl_free (RC_REGEX *regex)
     pcre_free (regex->v.pre);
 }
 
+/* Offset vector of the last match, reused by all matches */
+static int *perl_ovector;
+static int perl_ovsize;
+
 static int
-perl_match (RC_REGEX *regex, const char *line, int *refc, char ***refv,
-	    int *so, int *eo)
+perl_match (RC_REGEX *regex, const char *line, size_t start,
+	    struct regex_match *m)
 {
   int rc;
   int ovsize, count;
-  int *ovector;
   pcre *re = regex->v.pre;
 
   rc = pcre_fullinfo (re, NULL, PCRE_INFO_CAPTURECOUNT, &count);
@@ -436,41 +1046,41 @@ perl_match (RC_REGEX *regex, const char *line, int *refc, char ***refv,
 
   /* According to pcre docs: */
   ovsize = (count + 1) * 3;
-  ovector = xmalloc (ovsize * sizeof (*ovector));
+  if (ovsize > perl_ovsize)
+    {
+      perl_ovsize = ovsize;
+      perl_ovector = xrealloc (perl_ovector,
+			       ovsize * sizeof (perl_ovector[0]));
+    }
 
-  rc = pcre_exec (re, 0, line, strlen (line), 0, 0, ovector, ovsize);
+  rc = pcre_exec (re, 0, line, strlen (line), start, 0, perl_ovector, ovsize);
   if (rc == 0)
     {
       /* shouldn't happen, but still ... */
       anubis_error (0, 0, _("Matched, but too many substrings."));
-      *so = *eo = -1;
-      *refc = 0;
+      rc = ovsize / 3;
     }
-  else if (rc > 0)
+  if (rc < 0)
+    return 1;
+  if (m)
     {
-      /* Collect captured substrings */
       int i;
 
-      *refv = xmalloc ((rc + 1) * sizeof (**refv));
-      for (i = 0; i < rc; i++)
+      regex_match_reserve (m, count + 1);
+      m->subject = line;
+      m->count = count;
+      for (i = 0; i <= count; i++)
 	{
-	  int c = pcre_get_substring (line, ovector, ovsize, i,
-				      (const char **) &(*refv)[i]);
-	  if (c < 0)
-	    anubis_error (0, 0, _("Get substring %d failed (%d)."), i, c);
+	  if (i < rc && perl_ovector[2 * i] != -1)
+	    {
+	      m->span[i].so = perl_ovector[2 * i];
+	      m->span[i].eo = perl_ovector[2 * i + 1];
+	    }
+	  else
+	    m->span[i].so = m->span[i].eo = REGEX_UNSET;
 	}
-      (*refv)[i] = NULL;
-      *refc = count;
-      *so = ovector[0];
-      *eo = ovector[1];
-    }
-  else
-    {
-      *so = *eo = -1;
-      *refc = 0;
     }
-  xfree (ovector);
-  return rc < 0;
+  return 0;
 }
 
 static int
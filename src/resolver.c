@@ -0,0 +1,537 @@
+/*
+   resolver.c
+
+   This file is part of GNU Anubis.
+   Copyright (C) 2001-2020 The Anubis Team.
+
+   GNU Anubis is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   GNU Anubis is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU Anubis.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "headers.h"
+#include "extern.h"
+#include <sys/mman.h>
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETPSHARED
+# include <pthread.h>
+#endif
+
+/* Host name resolver cache.
+
+   Host names are resolved on each session: the remote MTA when
+   connecting to it and when checking for a loop, and the addresses in
+   the TRANSLATION section.  To spare the round trips to the name
+   server, the results are kept in a cache shared by the master and all
+   workers.
+
+   The cache is a table in a shared memory segment created by the
+   master before it starts any workers, protected by a process-shared
+   mutex, as the admission table is.  Entries are looked up by the host
+   name and the address family, in an open-addressing hash table of
+   fixed size.
+
+   getaddrinfo does not report the time to live of the records, so the
+   entries are kept for `resolver-cache-ttl' seconds.  Failures to find
+   the host are cached as well, for `resolver-negative-ttl' seconds;
+   temporary failures are not.
+
+   An entry that is used within the last RESOLVER_REFRESH_FRACTION of
+   its lifetime gets marked for refreshing.  The master checks for such
+   entries once a second and starts a process that resolves them anew,
+   so that the names in use never expire and the sessions do not wait
+   for the name server.
+
+   The numbers of hits and misses are dumped to the log along with the
+   scoreboard, upon SIGUSR1. */
+
+unsigned resolver_cache_ttl = 300;
+unsigned resolver_negative_ttl = 30;
+
+#define RESOLVER_TABLE_SIZE      512
+#define RESOLVER_PROBE_MAX       16
+#define RESOLVER_MAX_ADDRS       8
+#define RESOLVER_NAME_MAX        256
+#define RESOLVER_REFRESH_FRACTION 5
+
+#ifndef MAP_ANONYMOUS
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+struct resolver_addr
+{
+  int family;                  /* AF_INET or AF_INET6 */
+  unsigned char addr[16];      /* Address */
+};
+
+struct resolver_entry
+{
+  char name[RESOLVER_NAME_MAX];/* Host name, empty if unused */
+  int family;                  /* Requested address family */
+  int error;                   /* getaddrinfo error code, 0 on success */
+  time_t expires;              /* Expiration time */
+  int refresh;                 /* Refreshing requested */
+  unsigned naddrs;             /* Number of addresses */
+  struct resolver_addr addr[RESOLVER_MAX_ADDRS];
+};
+
+struct resolver_table
+{
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETPSHARED
+  pthread_mutex_t mutex;
+#endif
+  unsigned ttl;                /* Copies of the configuration settings */
+  unsigned negative_ttl;
+  unsigned long hits;          /* Statistics */
+  unsigned long negative_hits;
+  unsigned long misses;
+  unsigned long refreshes;
+  struct resolver_entry entry[RESOLVER_TABLE_SIZE];
+};
+
+static struct resolver_table *table;
+static pid_t refresh_pid;      /* PID of the refreshing process */
+
+static void
+table_lock (void)
+{
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETPSHARED
+  int rc = pthread_mutex_lock (&table->mutex);
+# ifdef HAVE_PTHREAD_MUTEX_CONSISTENT
+  if (rc == EOWNERDEAD)
+    pthread_mutex_consistent (&table->mutex);
+# endif
+#endif
+}
+
+static void
+table_unlock (void)
+{
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETPSHARED
+  pthread_mutex_unlock (&table->mutex);
+#endif
+}
+
+/* Create the resolver cache.  Called by the master before starting
+   workers. */
+void
+resolver_init (void)
+{
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETPSHARED
+  pthread_mutexattr_t attr;
+  void *p;
+
+  p = mmap (NULL, sizeof (*table), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    {
+      anubis_error (0, errno,
+		    _("cannot create resolver cache; caching disabled"));
+      return;
+    }
+  table = p;
+  pthread_mutexattr_init (&attr);
+  pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+# ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+  pthread_mutexattr_setrobust (&attr, PTHREAD_MUTEX_ROBUST);
+# endif
+  pthread_mutex_init (&table->mutex, &attr);
+  pthread_mutexattr_destroy (&attr);
+  resolver_configure ();
+#endif
+}
+
+/* Copy the configured settings to the cache and drop its contents, so
+   that a configuration reload starts with fresh data. */
+void
+resolver_configure (void)
+{
+  unsigned i;
+
+  if (!table)
+    return;
+  table_lock ();
+  table->ttl = resolver_cache_ttl;
+  table->negative_ttl = resolver_negative_ttl;
+  for (i = 0; i < RESOLVER_TABLE_SIZE; i++)
+    table->entry[i].name[0] = 0;
+  table_unlock ();
+}
+
+static unsigned
+name_hash (const char *name, int family)
+{
+  unsigned h = 2166136261u ^ family;
+
+  for (; *name; name++)
+    h = (h ^ tolower ((unsigned char) *name)) * 16777619u;
+  return h;
+}
+
+/* Find the entry for `name' and `family'.  If there is none, return
+   NULL and, if `avail' is not NULL, store there the entry to be used
+   for it.  Must be called with the table locked. */
+static struct resolver_entry *
+entry_lookup (const char *name, int family, time_t now,
+	      struct resolver_entry **avail)
+{
+  unsigned i, n;
+  struct resolver_entry *ent, *victim = NULL;
+
+  i = name_hash (name, family) % RESOLVER_TABLE_SIZE;
+  for (n = 0; n < RESOLVER_PROBE_MAX; n++)
+    {
+      ent = &table->entry[(i + n) % RESOLVER_TABLE_SIZE];
+      if (ent->name[0] == 0)
+	{
+	  if (!victim)
+	    victim = ent;
+	  break;
+	}
+      if (ent->family == family && strcasecmp (ent->name, name) == 0)
+	return ent;
+      /* Prefer an expired entry, then the one that expires first */
+      if (!victim || (victim->expires > now && ent->expires < victim->expires))
+	victim = ent;
+    }
+  if (avail)
+    *avail = victim;
+  return NULL;
+}
+
+/* Look up `name' in the cache.  On a hit, copy the addresses to `addr'
+   and their number to `*naddrs', store the cached result code in `*rc'
+   and return true. */
+static int
+cache_lookup (const char *name, int family,
+	      struct resolver_addr *addr, unsigned *naddrs, int *rc)
+{
+  struct resolver_entry *ent;
+  time_t now = time (NULL);
+  int found = 0;
+
+  table_lock ();
+  ent = entry_lookup (name, family, now, NULL);
+  if (ent && ent->expires > now)
+    {
+      found = 1;
+      *rc = ent->error;
+      *naddrs = ent->naddrs;
+      memcpy (addr, ent->addr, ent->naddrs * sizeof (addr[0]));
+      table->hits++;
+      if (ent->error)
+	table->negative_hits++;
+      else if ((ent->expires - now) * RESOLVER_REFRESH_FRACTION
+	       <= table->ttl)
+	ent->refresh = 1;
+    }
+  else
+    table->misses++;
+  table_unlock ();
+  return found;
+}
+
+/* Return true if the result code `rc' may be cached */
+static int
+cacheable_error (int rc)
+{
+  switch (rc)
+    {
+    case 0:
+    case EAI_NONAME:
+#ifdef EAI_NODATA
+# if EAI_NODATA != EAI_NONAME
+    case EAI_NODATA:
+# endif
+#endif
+      return 1;
+    }
+  return 0;
+}
+
+static void
+cache_store (const char *name, int family, int rc,
+	     struct resolver_addr *addr, unsigned naddrs)
+{
+  struct resolver_entry *ent, *avail;
+  time_t now = time (NULL);
+  unsigned ttl;
+
+  table_lock ();
+  ttl = rc ? table->negative_ttl : table->ttl;
+  ent = entry_lookup (name, family, now, &avail);
+  if (!ent)
+    ent = avail;
+  if (ent && ttl)
+    {
+      strcpy (ent->name, name);
+      ent->family = family;
+      ent->error = rc;
+      ent->expires = now + ttl;
+      ent->refresh = 0;
+      ent->naddrs = naddrs;
+      memcpy (ent->addr, addr, naddrs * sizeof (addr[0]));
+    }
+  table_unlock ();
+}
+
+/* Resolve `name' by asking the system */
+static int
+lookup (const char *name, int family,
+	struct resolver_addr *addr, unsigned *naddrs)
+{
+  struct addrinfo hints, *res, *ai;
+  unsigned n = 0;
+  int rc;
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_STREAM;
+  if (family == AF_UNSPEC)
+    hints.ai_flags = AI_ADDRCONFIG;
+  rc = getaddrinfo (name, NULL, &hints, &res);
+  if (rc)
+    return rc;
+  for (ai = res; ai && n < RESOLVER_MAX_ADDRS; ai = ai->ai_next)
+    {
+      switch (ai->ai_family)
+	{
+	case AF_INET:
+	  addr[n].family = AF_INET;
+	  memcpy (addr[n].addr,
+		  &((struct sockaddr_in *) ai->ai_addr)->sin_addr, 4);
+	  n++;
+	  break;
+#ifdef AF_INET6
+	case AF_INET6:
+	  addr[n].family = AF_INET6;
+	  memcpy (addr[n].addr,
+		  &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr, 16);
+	  n++;
+	  break;
+#endif
+	}
+    }
+  freeaddrinfo (res);
+  *naddrs = n;
+  return n ? 0 : EAI_NONAME;
+}
+
+/* Return true if `name' is a numeric address, which is not worth
+   caching. */
+static int
+numeric_address (const char *name)
+{
+  unsigned char buf[16];
+
+  return inet_pton (AF_INET, name, buf) == 1
+#ifdef AF_INET6
+         || inet_pton (AF_INET6, name, buf) == 1
+#endif
+    ;
+}
+
+/* Build the address list returned by resolve_host */
+static struct addrinfo *
+make_addrinfo (struct resolver_addr *addr, unsigned naddrs, unsigned port)
+{
+  struct addrinfo *head = NULL, **tail = &head;
+  unsigned i;
+
+  for (i = 0; i < naddrs; i++)
+    {
+      struct addrinfo *ai = xzalloc (sizeof (*ai)
+				     + sizeof (struct sockaddr_storage));
+      ai->ai_addr = (struct sockaddr *) (ai + 1);
+      ai->ai_family = addr[i].family;
+      ai->ai_socktype = SOCK_STREAM;
+      switch (addr[i].family)
+	{
+	case AF_INET:
+	  {
+	    struct sockaddr_in *s = (struct sockaddr_in *) ai->ai_addr;
+	    s->sin_family = AF_INET;
+	    s->sin_port = htons (port);
+	    memcpy (&s->sin_addr, addr[i].addr, 4);
+	    ai->ai_addrlen = sizeof (*s);
+	  }
+	  break;
+#ifdef AF_INET6
+	case AF_INET6:
+	  {
+	    struct sockaddr_in6 *s = (struct sockaddr_in6 *) ai->ai_addr;
+	    s->sin6_family = AF_INET6;
+	    s->sin6_port = htons (port);
+	    memcpy (&s->sin6_addr, addr[i].addr, 16);
+	    ai->ai_addrlen = sizeof (*s);
+	  }
+	  break;
+#endif
+	}
+      *tail = ai;
+      tail = &ai->ai_next;
+    }
+  return head;
+}
+
+/* Resolve the host `name' to a list of addresses of the given `family'
+   (AF_INET or AF_UNSPEC), with the port set to `port'.  On success,
+   store the list in `*res' and return 0.  Otherwise, return a
+   getaddrinfo error code.  The list must be freed by resolve_free. */
+int
+resolve_host (const char *name, unsigned port, int family,
+	      struct addrinfo **res)
+{
+  struct resolver_addr addr[RESOLVER_MAX_ADDRS];
+  unsigned naddrs = 0;
+  int rc;
+
+  if (!table || strlen (name) >= RESOLVER_NAME_MAX
+      || numeric_address (name))
+    rc = lookup (name, family, addr, &naddrs);
+  else if (!cache_lookup (name, family, addr, &naddrs, &rc))
+    {
+      rc = lookup (name, family, addr, &naddrs);
+      if (cacheable_error (rc))
+	cache_store (name, family, rc, addr, naddrs);
+    }
+  if (rc == 0)
+    *res = make_addrinfo (addr, naddrs, port);
+  return rc;
+}
+
+void
+resolve_free (struct addrinfo *res)
+{
+  while (res)
+    {
+      struct addrinfo *next = res->ai_next;
+      free (res);
+      res = next;
+    }
+}
+
+/* Return a textual description of the resolve_host error `rc' */
+const char *
+resolve_strerror (int rc)
+{
+  return rc == EAI_SYSTEM ? strerror (errno) : gai_strerror (rc);
+}
+
+/* Refreshing */
+
+/* Resolve anew the entries marked for refreshing.  Runs in a separate
+   process. */
+static void
+refresh_entries (void)
+{
+  unsigned i;
+
+  for (i = 0; i < RESOLVER_TABLE_SIZE; i++)
+    {
+      struct resolver_entry *ent = &table->entry[i];
+      struct resolver_addr addr[RESOLVER_MAX_ADDRS];
+      char name[RESOLVER_NAME_MAX];
+      unsigned naddrs = 0;
+      int family, rc;
+
+      table_lock ();
+      if (!ent->refresh || ent->name[0] == 0)
+	{
+	  table_unlock ();
+	  continue;
+	}
+      strcpy (name, ent->name);
+      family = ent->family;
+      ent->refresh = 0;
+      table_unlock ();
+
+      rc = lookup (name, family, addr, &naddrs);
+      /* Upon a temporary failure, let the entry live out its time */
+      if (cacheable_error (rc))
+	{
+	  cache_store (name, family, rc, addr, naddrs);
+	  table_lock ();
+	  table->refreshes++;
+	  table_unlock ();
+	}
+    }
+}
+
+/* Start refreshing the entries that need it, unless it is already in
+   progress.  Called periodically by the master. */
+void
+resolver_refresh (void)
+{
+  unsigned i;
+  pid_t pid;
+
+  if (!table || refresh_pid)
+    return;
+  for (i = 0; i < RESOLVER_TABLE_SIZE; i++)
+    if (table->entry[i].refresh && table->entry[i].name[0])
+      break;
+  if (i == RESOLVER_TABLE_SIZE)
+    return;
+
+  pid = fork ();
+  if (pid == -1)
+    anubis_error (0, errno, _("cannot start resolver refresh process"));
+  else if (pid == 0)
+    {
+      signal (SIGHUP, SIG_DFL);
+      signal (SIGQUIT, SIG_DFL);
+      signal (SIGUSR1, SIG_IGN);
+      signal (SIGUSR2, SIG_IGN);
+      refresh_entries ();
+      _exit (0);
+    }
+  else
+    refresh_pid = pid;
+}
+
+/* Return true if `pid' is the refreshing process, which the master has
+   just reaped. */
+int
+resolver_reaped (pid_t pid)
+{
+  if (!refresh_pid || pid != refresh_pid)
+    return 0;
+  refresh_pid = 0;
+  return 1;
+}
+
+/* Dump the cache statistics to the log */
+void
+resolver_log (void)
+{
+  unsigned i, n = 0;
+  unsigned long hits, negative_hits, misses, refreshes;
+  time_t now = time (NULL);
+
+  if (!table)
+    return;
+  table_lock ();
+  for (i = 0; i < RESOLVER_TABLE_SIZE; i++)
+    if (table->entry[i].name[0] && table->entry[i].expires > now)
+      n++;
+  hits = table->hits;
+  negative_hits = table->negative_hits;
+  misses = table->misses;
+  refreshes = table->refreshes;
+  table_unlock ();
+  info (NORMAL,
+	_("resolver cache: %u entries, %lu hits (%lu negative), "
+	  "%lu misses, %lu refreshes"),
+	n, hits, negative_hits, misses, refreshes);
+}
+
+/* EOF */
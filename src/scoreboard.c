@@ -0,0 +1,623 @@
+/*
+   scoreboard.c
+
+   This file is part of GNU Anubis.
+   Copyright (C) 2001-2020 The Anubis Team.
+
+   GNU Anubis is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   GNU Anubis is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU Anubis.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "headers.h"
+#include "extern.h"
+#include <sys/mman.h>
+
+/* The scoreboard.
+
+   The scoreboard is a shared memory segment holding one slot per
+   worker process.  The master allocates a slot before starting a
+   worker and frees it when the worker is reaped.  The worker records
+   in its slot the state it is in, the current SMTP phase and the time
+   it was entered, the peer address, the authenticated user and the
+   number of bytes transferred in the current session.  It also notes
+   whether the worker holds a connection to the MTA.
+
+   The header keeps the number of workers, and the number of idle and
+   busy workers in each group and in total.  These counters are updated
+   atomically along with the slot state, so that the master obtains
+   them in constant time.  Changes of the slot state are done with
+   compare-and-swap, because both the worker (idle <-> busy) and the
+   master (-> stopping) may change it.
+
+   If `scoreboard-file' is set, the segment is a memory-mapped file,
+   which can be examined by `anubis --status'.  Otherwise, it is an
+   anonymous mapping, and its contents can only be dumped to the log
+   by sending SIGUSR1 to the master. */
+
+char *scoreboard_file;
+
+#define SCOREBOARD_MAGIC   0x416e5362
+#define SCOREBOARD_VERSION 4
+
+#ifndef MAP_ANONYMOUS
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+struct scoreboard_count
+{
+  unsigned idle;               /* Number of idle workers */
+  unsigned busy;               /* Number of busy workers */
+};
+
+struct scoreboard_slot
+{
+  pid_t pid;                   /* Worker PID; 0 if the slot is free */
+  int state;                   /* Worker state (SB_*) */
+  int group;                   /* Worker group */
+  int phase;                   /* SMTP phase (SB_PHASE_*) */
+  time_t phase_start;          /* When the phase was entered */
+  unsigned long sessions;      /* Number of sessions served */
+  unsigned long long bytes_in; /* Bytes received in this session */
+  unsigned long long bytes_out;/* Bytes sent in this session */
+  int admitted;                /* The session passed admission control */
+  int upstream;                /* The worker holds a connection to the MTA */
+  struct sockaddr_storage addr;/* Peer address */
+  char peer[64];               /* Printable peer address */
+  char user[64];               /* User name */
+};
+
+struct scoreboard
+{
+  unsigned magic;
+  unsigned version;
+  size_t size;                 /* Total size of the segment */
+  pid_t master;                /* PID of the master process */
+  time_t start;                /* Startup time */
+  unsigned long reloads;       /* Number of configuration reloads */
+  unsigned long reload_usec;   /* Duration of the last one, in
+				  microseconds */
+  unsigned long sessions;      /* Total number of sessions served */
+  unsigned nslots;             /* Number of slots */
+  unsigned ngroups;            /* Number of worker groups */
+  unsigned nworkers;           /* Number of running workers */
+  unsigned upstream;           /* Number of connections to the MTA */
+  unsigned long spills;        /* Message texts moved to disk */
+  unsigned long long spill_bytes; /* Their total size */
+  struct scoreboard_count total;
+  /* Followed by ngroups struct scoreboard_count and nslots
+     struct scoreboard_slot */
+};
+
+static struct scoreboard *sb;
+static struct scoreboard_count *sb_group;
+static struct scoreboard_slot *sb_slot;
+static struct scoreboard_slot *my_slot;  /* Slot of this worker */
+
+static void
+scoreboard_layout (struct scoreboard *p)
+{
+  sb = p;
+  sb_group = (struct scoreboard_count *) (sb + 1);
+  sb_slot = (struct scoreboard_slot *) (sb_group + sb->ngroups);
+}
+
+static size_t
+scoreboard_size (unsigned nslots, unsigned ngroups)
+{
+  return sizeof (struct scoreboard)
+         + ngroups * sizeof (struct scoreboard_count)
+         + nslots * sizeof (struct scoreboard_slot);
+}
+
+/* Create the scoreboard with `nslots' slots for workers divided into
+   `ngroups' groups.  Called by the master at startup. */
+void
+scoreboard_init (unsigned nslots, unsigned ngroups)
+{
+  size_t size = scoreboard_size (nslots, ngroups);
+  void *p = MAP_FAILED;
+
+  if (scoreboard_file)
+    {
+      int fd;
+
+      /* Another master may still be using the old file during a binary
+	 upgrade: create a new one instead of truncating it. */
+      unlink (scoreboard_file);
+      fd = open (scoreboard_file, O_RDWR | O_CREAT | O_EXCL, 0640);
+
+      if (fd == -1)
+	anubis_error (0, errno, _("cannot open scoreboard file %s"),
+		      scoreboard_file);
+      else
+	{
+	  if (ftruncate (fd, size))
+	    anubis_error (0, errno, _("cannot set size of %s"),
+			  scoreboard_file);
+	  else
+	    p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	  close (fd);
+	}
+    }
+  if (p == MAP_FAILED)
+    p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+	      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    anubis_error (EXIT_FAILURE, errno, _("cannot create scoreboard"));
+
+  memset (p, 0, size);
+  ((struct scoreboard *) p)->ngroups = ngroups;
+  scoreboard_layout (p);
+  sb->magic = SCOREBOARD_MAGIC;
+  sb->version = SCOREBOARD_VERSION;
+  sb->size = size;
+  sb->master = getpid ();
+  sb->start = time (NULL);
+  sb->nslots = nslots;
+}
+
+/* Return the number of slots. */
+unsigned
+scoreboard_slots (void)
+{
+  return sb ? sb->nslots : 0;
+}
+
+static struct scoreboard_count *
+slot_count (struct scoreboard_slot *slot)
+{
+  return &sb_group[slot->group];
+}
+
+/* Adjust the counters for a worker leaving `state' in `slot' (`inc' is
+   -1) or entering it (`inc' is 1). */
+static void
+count_state (struct scoreboard_slot *slot, int state, int inc)
+{
+  switch (state)
+    {
+    case SB_IDLE:
+      __sync_fetch_and_add (&slot_count (slot)->idle, inc);
+      __sync_fetch_and_add (&sb->total.idle, inc);
+      break;
+
+    case SB_BUSY:
+      __sync_fetch_and_add (&slot_count (slot)->busy, inc);
+      __sync_fetch_and_add (&sb->total.busy, inc);
+      break;
+    }
+}
+
+/* Change the state of `slot' from `from' to `to'.  Return true on
+   success, and false if the slot was not in state `from'. */
+static int
+change_state (struct scoreboard_slot *slot, int from, int to)
+{
+  if (!__sync_bool_compare_and_swap (&slot->state, from, to))
+    return 0;
+  count_state (slot, from, -1);
+  count_state (slot, to, 1);
+  return 1;
+}
+
+/* Return the number of workers in `state' (SB_IDLE or SB_BUSY) within
+   `group', or within all groups if `group' is -1. */
+unsigned
+scoreboard_count (int state, int group)
+{
+  struct scoreboard_count *cnt = group == -1 ? &sb->total : &sb_group[group];
+  return state == SB_IDLE ? cnt->idle : cnt->busy;
+}
+
+/* Return the number of running workers */
+unsigned
+scoreboard_workers (void)
+{
+  return sb->nworkers;
+}
+
+/* Allocate a slot for a new idle worker in `group'.  Return the slot
+   number, or -1 if all slots are in use. */
+int
+scoreboard_alloc (int group)
+{
+  unsigned i;
+
+  for (i = 0; i < sb->nslots; i++)
+    if (sb_slot[i].state == SB_FREE)
+      {
+	struct scoreboard_slot *slot = &sb_slot[i];
+
+	memset (slot, 0, sizeof (*slot));
+	slot->group = group;
+	slot->state = SB_IDLE;
+	slot->phase = SB_PHASE_IDLE;
+	slot->phase_start = time (NULL);
+	count_state (slot, SB_IDLE, 1);
+	sb->nworkers++;
+	return i;
+      }
+  return -1;
+}
+
+/* Record the PID of the worker that occupies slot `n'. */
+void
+scoreboard_set_pid (int n, pid_t pid)
+{
+  sb_slot[n].pid = pid;
+}
+
+/* Return the number of the slot occupied by `pid', or -1. */
+int
+scoreboard_find (pid_t pid)
+{
+  unsigned i;
+
+  for (i = 0; i < sb->nslots; i++)
+    if (sb_slot[i].state != SB_FREE && sb_slot[i].pid == pid)
+      return i;
+  return -1;
+}
+
+/* Return the PID of the worker in slot `n', or 0 if the slot is free. */
+pid_t
+scoreboard_slot_pid (int n)
+{
+  return sb_slot[n].state == SB_FREE ? 0 : sb_slot[n].pid;
+}
+
+/* Return the PID of a worker in `state' within `group', or 0. */
+pid_t
+scoreboard_find_state (int state, int group)
+{
+  unsigned i;
+
+  for (i = 0; i < sb->nslots; i++)
+    if (sb_slot[i].state == state && sb_slot[i].pid
+	&& (group == -1 || sb_slot[i].group == group))
+      return sb_slot[i].pid;
+  return 0;
+}
+
+/* Mark the worker in slot `n' as stopping.  Return true if it was
+   running. */
+int
+scoreboard_stop (int n)
+{
+  struct scoreboard_slot *slot = &sb_slot[n];
+
+  return change_state (slot, SB_IDLE, SB_STOPPING)
+         || change_state (slot, SB_BUSY, SB_STOPPING);
+}
+
+/* Free slot `n' after its worker has terminated.  If the worker died
+   with an admitted session, store its peer address in `addr' (unless
+   it is NULL) and return true, so that the caller can release the
+   admission. */
+int
+scoreboard_free (int n, struct sockaddr_storage *addr)
+{
+  struct scoreboard_slot *slot = &sb_slot[n];
+  int state, admitted = slot->admitted;
+
+  do
+    state = slot->state;
+  while (!__sync_bool_compare_and_swap (&slot->state, state, SB_FREE));
+  count_state (slot, state, -1);
+  sb->nworkers--;
+  if (slot->upstream)
+    __sync_fetch_and_sub (&sb->upstream, 1);
+  if (admitted && addr)
+    memcpy (addr, &slot->addr, sizeof (*addr));
+  return admitted;
+}
+
+/* Record the number of configuration reloads and the duration of the
+   last one (see rcfile_reload_stat). */
+void
+scoreboard_reloaded (unsigned long count, unsigned long usec)
+{
+  if (sb)
+    {
+      sb->reloads = count;
+      sb->reload_usec = usec;
+    }
+}
+
+/* Worker side */
+
+/* Attach the calling worker to slot `n' */
+void
+scoreboard_attach (int n)
+{
+  my_slot = &sb_slot[n];
+  my_slot->pid = getpid ();
+}
+
+/* Mark the worker busy serving a session from `addr'. */
+void
+scoreboard_begin_session (struct sockaddr *addr, socklen_t addrlen)
+{
+  if (!my_slot)
+    return;
+  change_state (my_slot, SB_IDLE, SB_BUSY);
+  my_slot->bytes_in = my_slot->bytes_out = 0;
+  my_slot->user[0] = 0;
+  if (addrlen > sizeof (my_slot->addr))
+    addrlen = sizeof (my_slot->addr);
+  memcpy (&my_slot->addr, addr, addrlen);
+  format_sockaddr (my_slot->peer, sizeof my_slot->peer, addr);
+  my_slot->sessions++;
+  __sync_fetch_and_add (&sb->sessions, 1);
+  scoreboard_phase (SB_PHASE_CONNECT);
+}
+
+/* Mark the session as having passed (`admitted' is 1) or released
+   (0) the admission control. */
+void
+scoreboard_admitted (int admitted)
+{
+  if (my_slot)
+    my_slot->admitted = admitted;
+}
+
+/* Mark the worker idle. */
+void
+scoreboard_end_session (void)
+{
+  if (!my_slot)
+    return;
+  change_state (my_slot, SB_BUSY, SB_IDLE);
+  my_slot->peer[0] = 0;
+  my_slot->user[0] = 0;
+  scoreboard_phase (SB_PHASE_IDLE);
+}
+
+/* Account for a connection to the MTA opened by this worker.  Return
+   false if `max' (unless 0) connections are open already. */
+int
+scoreboard_upstream_open (unsigned max)
+{
+  unsigned n;
+
+  if (!my_slot)
+    return 1;
+  do
+    {
+      n = sb->upstream;
+      if (max && n >= max)
+	return 0;
+    }
+  while (!__sync_bool_compare_and_swap (&sb->upstream, n, n + 1));
+  my_slot->upstream = 1;
+  return 1;
+}
+
+/* Account for closing the connection to the MTA. */
+void
+scoreboard_upstream_close (void)
+{
+  if (my_slot && my_slot->upstream)
+    {
+      my_slot->upstream = 0;
+      __sync_fetch_and_sub (&sb->upstream, 1);
+    }
+}
+
+/* Return the number of connections to the MTA held by all workers. */
+unsigned
+scoreboard_upstream_count (void)
+{
+  return sb ? sb->upstream : 0;
+}
+
+void
+scoreboard_phase (int phase)
+{
+  if (my_slot && my_slot->phase != phase)
+    {
+      my_slot->phase = phase;
+      my_slot->phase_start = time (NULL);
+    }
+}
+
+/* Set the phase according to the SMTP command `cmd'. */
+void
+scoreboard_smtp_command (const char *cmd)
+{
+  static struct
+  {
+    const char *name;
+    int phase;
+  } tab[] = {
+    { "ehlo", SB_PHASE_HELO },
+    { "helo", SB_PHASE_HELO },
+    { "starttls", SB_PHASE_HELO },
+    { "auth", SB_PHASE_HELO },
+    { "mail", SB_PHASE_MAIL },
+    { "rcpt", SB_PHASE_RCPT },
+    { "data", SB_PHASE_DATA },
+    { "bdat", SB_PHASE_DATA },
+    { "quit", SB_PHASE_QUIT },
+    { NULL }
+  };
+  int i;
+
+  if (!my_slot)
+    return;
+  for (i = 0; tab[i].name; i++)
+    if (strncasecmp (cmd, tab[i].name, strlen (tab[i].name)) == 0)
+      {
+	scoreboard_phase (tab[i].phase);
+	break;
+      }
+}
+
+void
+scoreboard_user (const char *user)
+{
+  if (my_slot && user)
+    {
+      strncpy (my_slot->user, user, sizeof my_slot->user - 1);
+      my_slot->user[sizeof my_slot->user - 1] = 0;
+    }
+}
+
+void
+scoreboard_bytes (size_t in, size_t out)
+{
+  if (my_slot)
+    {
+      my_slot->bytes_in += in;
+      my_slot->bytes_out += out;
+    }
+}
+
+/* Account for a message text of `size' bytes that has been moved to
+   disk. */
+void
+scoreboard_spill (size_t size)
+{
+  if (!sb)
+    return;
+  __sync_fetch_and_add (&sb->spills, 1);
+  __sync_fetch_and_add (&sb->spill_bytes, (unsigned long long) size);
+}
+
+/* Status output */
+
+static const char *state_str[] = {
+  "free", "idle", "busy", "stopping"
+};
+
+static const char *phase_str[] = {
+  "idle", "connect", "helo", "mail", "rcpt", "data", "quit"
+};
+
+#define STATUS_HEADER \
+  "SLOT   PID     GRP STATE    PHASE   SECS   SESS  BYTES-IN BYTES-OUT PEER / USER"
+
+static void
+format_slot (char *buf, size_t size, unsigned n, struct scoreboard_slot *slot,
+	     time_t now)
+{
+  snprintf (buf, size, "%-6u %-7lu %-3d %-8s %-7s %-6lu %-5lu %-9llu %-9llu %s%s%s",
+	    n, (unsigned long) slot->pid, slot->group,
+	    (unsigned) slot->state < sizeof state_str / sizeof state_str[0]
+	      ? state_str[slot->state] : "?",
+	    (unsigned) slot->phase < sizeof phase_str / sizeof phase_str[0]
+	      ? phase_str[slot->phase] : "?",
+	    (unsigned long) (now - slot->phase_start),
+	    slot->sessions, slot->bytes_in, slot->bytes_out,
+	    slot->peer, slot->user[0] ? " / " : "", slot->user);
+}
+
+static void
+format_summary (char *buf, size_t size, struct scoreboard *p, time_t now)
+{
+  snprintf (buf, size,
+	    _("master %lu, up %lu s, %u workers (%u idle, %u busy), "
+	      "%u MTA connections, %lu sessions, "
+	      "%lu reloads (last %lu.%06lu s), "
+	      "%lu body spills (%llu bytes)"),
+	    (unsigned long) p->master, (unsigned long) (now - p->start),
+	    p->nworkers, p->total.idle, p->total.busy,
+	    p->upstream, p->sessions,
+	    p->reloads, p->reload_usec / 1000000, p->reload_usec % 1000000,
+	    p->spills, p->spill_bytes);
+}
+
+/* Dump the scoreboard to the log.  Called by the master on SIGUSR1. */
+void
+scoreboard_log (void)
+{
+  char buf[LINEBUFFER];
+  time_t now = time (NULL);
+  unsigned i;
+
+  if (!sb)
+    return;
+  format_summary (buf, sizeof buf, sb, now);
+  info (NORMAL, "%s", buf);
+  info (NORMAL, "%s", STATUS_HEADER);
+  for (i = 0; i < sb->nslots; i++)
+    if (sb_slot[i].state != SB_FREE)
+      {
+	format_slot (buf, sizeof buf, i, &sb_slot[i], now);
+	info (NORMAL, "%s", buf);
+      }
+}
+
+/* Print the scoreboard of the running daemon to stdout.  This
+   implements the --status option. */
+int
+scoreboard_status (void)
+{
+  struct stat st;
+  struct scoreboard *p;
+  char buf[LINEBUFFER];
+  time_t now = time (NULL);
+  int fd;
+  unsigned i;
+
+  if (!scoreboard_file)
+    {
+      anubis_error (0, 0, _("scoreboard-file is not set"));
+      return EXIT_FAILURE;
+    }
+  fd = open (scoreboard_file, O_RDONLY);
+  if (fd == -1)
+    {
+      anubis_error (0, errno, _("cannot open scoreboard file %s"),
+		    scoreboard_file);
+      return EXIT_FAILURE;
+    }
+  if (fstat (fd, &st) || st.st_size < sizeof (*p))
+    {
+      anubis_error (0, 0, _("%s: invalid scoreboard file"), scoreboard_file);
+      close (fd);
+      return EXIT_FAILURE;
+    }
+  p = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (p == MAP_FAILED)
+    {
+      anubis_error (0, errno, _("cannot map %s"), scoreboard_file);
+      return EXIT_FAILURE;
+    }
+  if (p->magic != SCOREBOARD_MAGIC || p->version != SCOREBOARD_VERSION
+      || p->size != st.st_size
+      || scoreboard_size (p->nslots, p->ngroups) != p->size)
+    {
+      anubis_error (0, 0, _("%s: invalid scoreboard file"), scoreboard_file);
+      munmap (p, st.st_size);
+      return EXIT_FAILURE;
+    }
+  if (kill (p->master, 0) && errno == ESRCH)
+    printf (_("GNU Anubis is not running (stale scoreboard)\n"));
+
+  scoreboard_layout (p);
+  format_summary (buf, sizeof buf, p, now);
+  printf ("%s\n%s\n", buf, STATUS_HEADER);
+  for (i = 0; i < p->nslots; i++)
+    if (sb_slot[i].state != SB_FREE)
+      {
+	format_slot (buf, sizeof buf, i, &sb_slot[i], now);
+	printf ("%s\n", buf);
+      }
+  munmap (p, st.st_size);
+  sb = NULL;
+  return 0;
+}
+
+/* EOF */
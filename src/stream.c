@@ -21,6 +21,32 @@
 #include "headers.h"
 #include "extern.h"
 
+/* Input buffering.
+
+   Each stream has an input buffer of `stream-buffer-size' bytes,
+   allocated on the first buffered read.  Incoming data are appended at
+   `end' and consumed from `start'.  Line boundaries are located with
+   memchr, remembering in `scan' how far the pending data have been
+   searched, so that each byte is examined once regardless of how many
+   reads it takes to complete a line.  When more data are needed, the
+   unconsumed tail is moved to the beginning of the buffer; the buffer
+   is enlarged only if a single line does not fit into it.
+
+   stream_getline_ref returns the next line as a pointer into the
+   buffer, avoiding any copying.  The pointer remains valid until the
+   next read from the stream.
+
+   Output is buffered as well: stream_write appends data to the output
+   buffer of the same size, which is written out when it fills up, by
+   stream_flush, and before each read from the stream that has to wait
+   for input.  The latter is what makes buffering transparent to the
+   SMTP dialog: a command or reply is never held back while waiting for
+   the response to it.  When the data do not fit into the buffer, the
+   buffered and the new data are sent at once with writev.  Pending
+   output of open streams is also flushed upon exit. */
+
+unsigned stream_buffer_size = STREAM_BUFFER_SIZE;
+
 enum stream_state
   {
     state_open,
@@ -36,9 +62,19 @@ struct net_stream
   stream_close_t close;
   stream_destroy_t destroy;
 
-  char buf[LINEBUFFER + 1];	/* Input buffer */
-  size_t level;			/* Buffer fill level */
-  char *read_ptr;		/* Current buffer pointer */
+  char *buf;			/* Input buffer */
+  size_t bufsize;		/* Size of the buffer */
+  size_t start;			/* Offset of the first unconsumed byte */
+  size_t end;			/* Offset past the last byte read */
+  size_t scan;			/* Offset up to which no newline was found */
+  int eof;			/* End of input has been seen */
+
+  char *obuf;			/* Output buffer */
+  size_t obufsize;		/* Size of the output buffer */
+  size_t olevel;		/* Amount of data in the output buffer */
+
+  pid_t owner;			/* Process that created the stream */
+  struct net_stream *prev, *next; /* Links in the list of streams */
 
   void *data;
 };
@@ -74,6 +110,26 @@ _def_read (void *sd, char *data, size_t size, size_t * nbytes)
   return errno;
 }
 
+static int
+_def_writev (void *sd, const char *buf1, size_t size1,
+	     const char *buf2, size_t size2, size_t *nbytes)
+{
+  struct iovec iov[2];
+  ssize_t rc;
+
+  iov[0].iov_base = (char *) buf1;
+  iov[0].iov_len = size1;
+  iov[1].iov_base = (char *) buf2;
+  iov[1].iov_len = size2;
+  rc = writev ((int) (ptrdiff_t) sd, iov, 2);
+  if (rc >= 0)
+    {
+      *nbytes = rc;
+      return 0;
+    }
+  return errno;
+}
+
 static int
 _def_close (void *sd)
 {
@@ -81,10 +137,130 @@ _def_close (void *sd)
   return 0;
 }
 
+/* Memory streams.  Data written to a memory stream are appended to a
+   text buffer, and reads return them starting from the beginning. */
+
+struct memory_stream
+{
+  struct textbuf text;		/* Stored data */
+  size_t pos;			/* Offset of the first unread byte */
+};
+
+static int
+_mem_read (void *data, char *buf, size_t size, size_t *nbytes)
+{
+  struct memory_stream *mem = data;
+
+  if (size > mem->text.level - mem->pos)
+    size = mem->text.level - mem->pos;
+  if (size)
+    memcpy (buf, mem->text.buf + mem->pos, size);
+  mem->pos += size;
+  *nbytes = size;
+  return 0;
+}
+
+static int
+_mem_write (void *data, const char *buf, size_t size, size_t *nbytes)
+{
+  struct memory_stream *mem = data;
+
+  textbuf_append (&mem->text, buf, size);
+  *nbytes = size;
+  return 0;
+}
+
+static int
+_mem_close (void *data)
+{
+  return 0;
+}
+
+static int
+_mem_destroy (void *data)
+{
+  struct memory_stream *mem = data;
+
+  textbuf_free (&mem->text);
+  free (mem);
+  return 0;
+}
+
+/* Data passing through memory streams do not go over the network */
+#define COUNTED(str) ((str)->read != _mem_read)
+
+/* All existing streams */
+static struct net_stream *stream_list;
+
+/* Write out the contents of the output buffer of `str', followed by
+   `size' bytes from `data'. */
+static int
+output_flush (struct net_stream *str, const char *data, size_t size)
+{
+  while (str->olevel + size > 0)
+    {
+      size_t n;
+      int rc;
+
+      if (str->olevel && size && str->write == _def_write)
+	rc = _def_writev (str->data, str->obuf, str->olevel, data, size, &n);
+      else if (str->olevel)
+	rc = str->write (str->data, str->obuf, str->olevel, &n);
+      else
+	rc = str->write (str->data, data, size, &n);
+      if (rc == EINTR)
+	continue;
+      if (rc)
+	return rc;
+      if (n == 0)
+	return EIO;
+      if (COUNTED (str))
+	scoreboard_bytes (0, n);
+
+      if (n < str->olevel)
+	{
+	  memmove (str->obuf, str->obuf + n, str->olevel - n);
+	  str->olevel -= n;
+	}
+      else
+	{
+	  n -= str->olevel;
+	  str->olevel = 0;
+	  data += n;
+	  size -= n;
+	}
+    }
+  return 0;
+}
+
+/* Flush pending output of the streams created by this process. */
+static void
+flush_streams (void)
+{
+  struct net_stream *str;
+  pid_t pid = getpid ();
+
+  for (str = stream_list; str; str = str->next)
+    if (str->owner == pid && str->state == state_open && str->olevel)
+      output_flush (str, NULL, 0);
+}
+
 void
 stream_create (struct net_stream **str)
 {
+  static int registered;
+
+  if (!registered)
+    {
+      atexit (flush_streams);
+      registered = 1;
+    }
   *str = xzalloc (sizeof **str);
+  (*str)->owner = getpid ();
+  (*str)->next = stream_list;
+  if (stream_list)
+    stream_list->prev = *str;
+  stream_list = *str;
 }
 
 int
@@ -106,6 +282,38 @@ stream_set_io (struct net_stream *str,
   return 0;
 }
 
+/* Create in `*str' a memory stream.  Its initial contents are taken
+   over from the text buffer `tb', which is left empty.  `tb' may be
+   NULL. */
+void
+stream_create_memory (NET_STREAM *str, struct textbuf *tb)
+{
+  struct memory_stream *mem = xzalloc (sizeof (*mem));
+
+  if (tb)
+    {
+      mem->text = *tb;
+      textbuf_init (tb);
+    }
+  else
+    textbuf_init (&mem->text);
+  stream_create (str);
+  stream_set_io (*str, mem, _mem_read, _mem_write, _mem_close,
+		 _mem_destroy, NULL);
+}
+
+/* Store in `*pbuf' a pointer to the unread contents of the memory
+   stream `str', and return their size. */
+size_t
+stream_memory_contents (NET_STREAM str, const char **pbuf)
+{
+  struct memory_stream *mem = str->data;
+
+  stream_flush (str);
+  *pbuf = mem->text.buf + mem->pos;
+  return mem->text.level - mem->pos;
+}
+
 int
 stream_set_read (struct net_stream *str, stream_read_t read)
 {
@@ -140,6 +348,7 @@ stream_close (struct net_stream *str)
     return EINVAL;
   if (str->state != state_open)
     return 0;
+  output_flush (str, NULL, 0);
   str->state = state_closed;
   return str->close (str->data);
 }
@@ -151,6 +360,14 @@ stream_destroy (struct net_stream **str)
     return EINVAL;
   if ((*str)->destroy)
     (*str)->destroy ((*str)->data);
+  if ((*str)->prev)
+    (*str)->prev->next = (*str)->next;
+  else
+    stream_list = (*str)->next;
+  if ((*str)->next)
+    (*str)->next->prev = (*str)->prev;
+  free ((*str)->buf);
+  free ((*str)->obuf);
   xfree (*str);
   return 0;
 }
@@ -166,40 +383,176 @@ stream_strerror (struct net_stream *str, int errcode)
 int
 stream_read (struct net_stream *str, char *buf, size_t size, size_t * nbytes)
 {
+  int rc;
+  
   if (!str)
     return EINVAL;
-  return str->read (str->data, buf, size, nbytes);
+  if (str->start < str->end)
+    {
+      /* Return the data left over from a buffered read first */
+      if (size > str->end - str->start)
+	size = str->end - str->start;
+      memcpy (buf, str->buf + str->start, size);
+      str->start += size;
+      if (str->scan < str->start)
+	str->scan = str->start;
+      *nbytes = size;
+      return 0;
+    }
+  if (str->olevel && (rc = output_flush (str, NULL, 0)))
+    return rc;
+  rc = str->read (str->data, buf, size, nbytes);
+  if (rc == 0 && COUNTED (str))
+    scoreboard_bytes (*nbytes, 0);
+  return rc;
 }
 
 int
 stream_write (struct net_stream *str, const char *buf, size_t size,
 	      size_t *nbytes)
 {
+  int rc;
+  
   if (!str)
     return EINVAL;
-  return str->write (str->data, buf, size, nbytes);
+  if (!str->obuf)
+    {
+      str->obufsize = stream_buffer_size > LINEBUFFER
+	                ? stream_buffer_size : LINEBUFFER;
+      str->obuf = xmalloc (str->obufsize);
+    }
+  if (str->olevel + size > str->obufsize)
+    rc = output_flush (str, buf, size);
+  else
+    {
+      memcpy (str->obuf + str->olevel, buf, size);
+      str->olevel += size;
+      rc = 0;
+    }
+  if (rc == 0)
+    *nbytes = size;
+  return rc;
+}
+
+/* Return the file descriptor `str' reads from and writes to, or -1 if
+   it uses other I/O functions (e.g. TLS). */
+int
+stream_fd (struct net_stream *str)
+{
+  if (!str || str->read != _def_read || str->write != _def_write)
+    return -1;
+  return (int) (ptrdiff_t) str->data;
 }
 
+/* Store in `*pbuf' a pointer to the input data buffered in `str' and
+   return their amount.  The data remain in the buffer until consumed
+   by stream_consume. */
+size_t
+stream_buffered (struct net_stream *str, const char **pbuf)
+{
+  *pbuf = str->buf + str->start;
+  return str->end - str->start;
+}
+
+/* Drop `size' bytes of the buffered input of `str'. */
+void
+stream_consume (struct net_stream *str, size_t size)
+{
+  str->start += size;
+  if (str->scan < str->start)
+    str->scan = str->start;
+}
+
+/* Write out the pending output of `str'. */
+int
+stream_flush (struct net_stream *str)
+{
+  if (!str)
+    return EINVAL;
+  if (str->state != state_open)
+    return 0;
+  return output_flush (str, NULL, 0);
+}
+
+/* Read more data into the input buffer of `str', making room for
+   them if necessary.  Sets str->eof if no more data are available. */
 static int
-read_char (struct net_stream *str, char *ptr, size_t * pcount)
+fill_buffer (struct net_stream *str)
+{
+  size_t n;
+  int rc;
+
+  /* The peer may be waiting for our output before sending anything */
+  if (str->olevel && (rc = output_flush (str, NULL, 0)))
+    return rc;
+
+  if (str->start > 0)
+    {
+      /* Move the unconsumed data to the beginning of the buffer */
+      str->end -= str->start;
+      str->scan -= str->start;
+      if (str->end)
+	memmove (str->buf, str->buf + str->start, str->end);
+      str->start = 0;
+    }
+  if (str->end == str->bufsize)
+    {
+      /* The buffer is full: a single line does not fit into it */
+      if (str->bufsize == 0)
+	str->bufsize = stream_buffer_size > LINEBUFFER
+	                 ? stream_buffer_size : LINEBUFFER;
+      else
+	str->bufsize *= 2;
+      str->buf = xrealloc (str->buf, str->bufsize);
+    }
+
+  rc = str->read (str->data, str->buf + str->end, str->bufsize - str->end,
+		  &n);
+  if (rc)
+    return rc;
+  if (COUNTED (str))
+    scoreboard_bytes (n, 0);
+  if (n == 0)
+    str->eof = 1;
+  str->end += n;
+  return 0;
+}
+
+/* Get the next line from `str'.  On success, store a pointer to it in
+   `*pline' and its length, including the terminating newline, in
+   `*plen'.  The line is not null-terminated and remains valid until the
+   next read from `str'.  At the end of input, the last incomplete line
+   is returned, and then an empty one. */
+int
+stream_getline_ref (struct net_stream *str, const char **pline,
+		    size_t *plen)
 {
-  if (str->level <= 0)
+  char *p;
+
+  if (!str)
+    return EINVAL;
+
+  while (str->scan == str->end
+	 || !(p = memchr (str->buf + str->scan, '\n', str->end - str->scan)))
     {
-      int rc = str->read (str->data, str->buf, sizeof str->buf,
-			  &str->level);
-      if (rc)
-	return rc;
+      int rc;
 
-      if (str->level == 0)
+      str->scan = str->end;
+      if (str->eof)
 	{
-	  *pcount = 0;
+	  /* Return whatever is left */
+	  *pline = str->buf + str->start;
+	  *plen = str->end - str->start;
+	  str->start = str->end;
 	  return 0;
 	}
-      str->read_ptr = str->buf;
+      rc = fill_buffer (str);
+      if (rc)
+	return rc;
     }
-  str->level--;
-  *ptr = *str->read_ptr++;
-  *pcount = 1;
+  *pline = str->buf + str->start;
+  *plen = p + 1 - *pline;
+  str->start = str->scan = p + 1 - str->buf;
   return 0;
 }
 
@@ -207,65 +560,70 @@ int
 stream_readline (struct net_stream *str, char *buf, size_t size,
 		 size_t *nbytes)
 {
-  int rc = 0;
-  size_t n;
-  char c, *ptr;
+  size_t off = 0;
 
   if (!str)
     return EINVAL;
 
-  ptr = buf;
-  for (n = 1; n < size; n++)
+  while (off + 1 < size)
     {
-      size_t count;
+      size_t n;
+      char *p;
 
-      rc = read_char (str, &c, &count);
-      if (rc)
-	break;
-      
-      if (count == 1)
+      if (str->start == str->end)
 	{
-	  *ptr++ = c;
-	  if (c == '\n')
+	  int rc;
+
+	  if (str->eof)
 	    break;
+	  rc = fill_buffer (str);
+	  if (rc)
+	    {
+	      buf[off] = 0;
+	      *nbytes = off;
+	      return rc;
+	    }
+	  continue;
 	}
-      else			/* if (count == 0) */
+      n = str->end - str->start;
+      if (n > size - off - 1)
+	n = size - off - 1;
+      p = memchr (str->buf + str->start, '\n', n);
+      if (p)
+	n = p + 1 - (str->buf + str->start);
+      memcpy (buf + off, str->buf + str->start, n);
+      off += n;
+      str->start += n;
+      if (str->scan < str->start)
+	str->scan = str->start;
+      if (p)
 	break;
     }
-  *ptr = 0;
-  *nbytes = ptr - buf;
-  return rc;
+  buf[off] = 0;
+  *nbytes = off;
+  return 0;
 }
 
-#define INIT_GETLINE_SIZE 128
-
 int
 stream_getline (NET_STREAM sd, char **vptr, size_t *maxlen, size_t *nread)
 {
+  const char *line;
+  size_t len;
   int rc;
-  size_t off = 0;
 
-  while (1)
+  rc = stream_getline_ref (sd, &line, &len);
+  if (rc)
+    return rc;
+  if (*maxlen < len + 1)
     {
-      size_t nbytes;
-
-      if (*maxlen - off <= 1)
-	{
-	  *maxlen += INIT_GETLINE_SIZE;
-	  *vptr = xrealloc (*vptr, *maxlen);
-	}
-      rc = stream_readline (sd, *vptr + off, *maxlen - off, &nbytes);
-      if (rc)
-        return rc;
-      if (nbytes == 0)
-	break;
-      off += nbytes;
-      if ((*vptr)[off - 1] == '\n')
-	break;
+      *maxlen = len + 1;
+      *vptr = xrealloc (*vptr, *maxlen);
     }
-  (*vptr)[off] = 0;
+  memcpy (*vptr, line, len);
+  (*vptr)[len] = 0;
   if (nread)
-    *nread = off;
+    *nread = len;
   return 0;
 }
 
+/* EOF */
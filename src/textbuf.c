@@ -0,0 +1,236 @@
+/*
+   textbuf.c
+
+   This file is part of GNU Anubis.
+   Copyright (C) 2020 The Anubis Team.
+
+   GNU Anubis is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   GNU Anubis is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU Anubis.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "headers.h"
+#include "extern.h"
+#include <sys/mman.h>
+
+/* Text buffers.
+
+   A text buffer holds a message body or a message being received, as
+   a single null-terminated string that grows as text is appended to
+   it.  It starts on the heap.  Once it grows past `body-memory-limit'
+   bytes, it is moved to a temporary file in `body-spool-directory',
+   which is unlinked at once and mapped into memory.  The text is still
+   accessed through the `buf' pointer, so that the rule engine, GPG and
+   the rest see no difference, but its pages are backed by the file and
+   can be written out instead of swapped when memory gets short.
+
+   The mapping is larger than the text, and is enlarged by doubling
+   the file size and mapping it anew.  The disk blocks are allocated
+   before the file is mapped, so that running out of space shows up as
+   an error rather than as SIGBUS on a write to the mapping.  When the
+   file cannot be enlarged, the text that does not fit is discarded and
+   the `error' flag of the buffer is set, for the caller to reject the
+   message.  Each text buffer that has been moved to disk is logged
+   when freed, and counted in the scoreboard. */
+
+unsigned body_memory_limit = BODY_MEMORY_LIMIT;
+char *body_spool_directory;
+
+void
+textbuf_init (struct textbuf *tb)
+{
+  tb->buf = NULL;
+  tb->size = tb->level = 0;
+  tb->fd = -1;
+  tb->error = 0;
+}
+
+/* Create an unlinked temporary file.  Return its descriptor, or -1 on
+   error. */
+static int
+spool_open (void)
+{
+  const char *dir = body_spool_directory;
+  char *name;
+  int fd;
+
+  if (!dir && !(dir = getenv ("TMPDIR")))
+    dir = "/tmp";
+  name = xmalloc (strlen (dir) + sizeof "/anubis.XXXXXX");
+  sprintf (name, "%s/anubis.XXXXXX", dir);
+  fd = mkstemp (name);
+  if (fd == -1)
+    anubis_error (0, errno, _("cannot create temporary file in %s"), dir);
+  else
+    unlink (name);
+  free (name);
+  return fd;
+}
+
+/* Allocate the disk blocks of the first `size' bytes of the file
+   `fd'.  Return 0 on success, and an error code otherwise. */
+static int
+spool_allocate (int fd, size_t size)
+{
+#ifdef HAVE_POSIX_FALLOCATE
+  return posix_fallocate (fd, 0, size);
+#else
+  static char zeros[4096];
+  struct stat st;
+  off_t off;
+
+  if (fstat (fd, &st))
+    return errno;
+  for (off = st.st_size; off < size; )
+    {
+      size_t n = size - off < sizeof zeros ? size - off : sizeof zeros;
+      ssize_t rc = pwrite (fd, zeros, n, off);
+      if (rc < 0)
+	return errno;
+      off += rc;
+    }
+  return 0;
+#endif
+}
+
+/* Map `size' bytes of the temporary file of `tb', replacing the
+   previous mapping.  Return 0 on success. */
+static int
+textbuf_map (struct textbuf *tb, size_t size)
+{
+  void *p;
+  int rc;
+
+  if ((rc = spool_allocate (tb->fd, size)) != 0)
+    {
+      anubis_error (0, rc, _("cannot extend temporary file"));
+      return -1;
+    }
+  p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, tb->fd, 0);
+  if (p == MAP_FAILED)
+    {
+      anubis_error (0, errno, _("cannot map temporary file"));
+      return -1;
+    }
+  if (tb->buf)
+    munmap (tb->buf, tb->size);
+  tb->buf = p;
+  tb->size = size;
+  return 0;
+}
+
+/* Move the text of `tb' to a temporary file, reserving `size' bytes.
+   Return 0 on success.  On failure, the text stays on the heap. */
+static int
+textbuf_spill (struct textbuf *tb, size_t size)
+{
+  char *text = tb->buf;
+
+  if ((tb->fd = spool_open ()) == -1)
+    return -1;
+  tb->buf = NULL;
+  if (textbuf_map (tb, size))
+    {
+      close (tb->fd);
+      tb->fd = -1;
+      tb->buf = text;
+      return -1;
+    }
+  if (text)
+    {
+      memcpy (tb->buf, text, tb->level + 1);
+      free (text);
+    }
+  return 0;
+}
+
+/* Make room for `len' more bytes of text plus the terminating null.
+   Return 0 on success. */
+static int
+textbuf_reserve (struct textbuf *tb, size_t len)
+{
+  size_t size = tb->size;
+
+  if (tb->level + len + 1 <= size)
+    return 0;
+  if (size == 0)
+    size = LINEBUFFER;
+  while (tb->level + len + 1 > size)
+    size *= 2;
+
+  if (tb->fd == -1 && body_memory_limit && size > body_memory_limit
+      && textbuf_spill (tb, size) == 0)
+    return 0;
+  if (tb->fd != -1)
+    {
+      if (textbuf_map (tb, size) == 0)
+	return 0;
+      anubis_error (0, 0, _("cannot grow message text"));
+      tb->error = 1;
+      return -1;
+    }
+  tb->buf = xrealloc (tb->buf, size);
+  tb->size = size;
+  return 0;
+}
+
+/* Append `len' bytes of `text' to `tb'.  If there is no room for them,
+   set the error flag of `tb'.  Once it is set, nothing more is
+   appended. */
+void
+textbuf_append (struct textbuf *tb, const char *text, size_t len)
+{
+  if (tb->error || textbuf_reserve (tb, len))
+    return;
+  memcpy (tb->buf + tb->level, text, len);
+  tb->level += len;
+  tb->buf[tb->level] = 0;
+}
+
+/* Make `tb' hold `text', a string allocated with malloc */
+void
+textbuf_adopt (struct textbuf *tb, char *text)
+{
+  size_t len = strlen (text);
+
+  textbuf_free (tb);
+  if (body_memory_limit && len + 1 > body_memory_limit)
+    {
+      /* Move it to disk right away */
+      textbuf_append (tb, text, len);
+      free (text);
+    }
+  else
+    {
+      tb->buf = text;
+      tb->size = len + 1;
+      tb->level = len;
+    }
+}
+
+void
+textbuf_free (struct textbuf *tb)
+{
+  if (tb->fd != -1)
+    {
+      info (NORMAL, _("Message text of %lu bytes was kept on disk"),
+	    (unsigned long) tb->level);
+      scoreboard_spill (tb->level);
+      munmap (tb->buf, tb->size);
+      close (tb->fd);
+    }
+  else
+    free (tb->buf);
+  textbuf_init (tb);
+}
+
+/* EOF */
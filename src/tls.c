@@ -133,6 +133,9 @@ _tls_fd_push (gnutls_transport_ptr_t fd, const void *buf, size_t size)
       rc = stream_write (stream, buf, size, &wrbytes);
     }
   while (rc != 0 && errno == EAGAIN);
+  /* GnuTLS has already coalesced the data into records */
+  while (rc == 0 && (rc = stream_flush (stream)) != 0 && errno == EAGAIN)
+    rc = 0;
   if (rc)
     return -1;
   return wrbytes;
@@ -21,74 +21,97 @@
 #include "headers.h"
 #include "extern.h"
 
-static unsigned long 
-string_to_ipaddr (const char *str)
+/* Return true if the socket addresses `a' and `b' have the same
+   family and host address.  Ports are not compared. */
+static int
+same_host_address (struct sockaddr *a, struct sockaddr *b)
 {
-  unsigned long inaddr;
-  struct sockaddr_in ad;
+  if (a->sa_family != b->sa_family)
+    return 0;
+  switch (a->sa_family)
+    {
+    case AF_INET:
+      return memcmp (&((struct sockaddr_in *) a)->sin_addr,
+		     &((struct sockaddr_in *) b)->sin_addr,
+		     sizeof (struct in_addr)) == 0;
+#ifdef AF_INET6
+    case AF_INET6:
+      return memcmp (&((struct sockaddr_in6 *) a)->sin6_addr,
+		     &((struct sockaddr_in6 *) b)->sin6_addr,
+		     sizeof (struct in6_addr)) == 0;
+#endif
+    }
+  return 0;
+}
 
-  memset (&ad, 0, sizeof (ad));
-  inaddr = inet_addr (str);
-  if (inaddr != INADDR_NONE)
-    memcpy (&ad.sin_addr, &inaddr, sizeof (inaddr));
-  else
+/* Return true if the hosts `h1' and `h2' have an address in common.
+   If either of them cannot be resolved, the check is skipped: a
+   remote-mta that does not resolve will fail to connect anyway. */
+static int
+same_host (const char *h1, const char *h2)
+{
+  struct addrinfo *res1, *res2, *p, *q;
+  int rc;
+
+  rc = resolve_host (h1, 0, AF_UNSPEC, &res1);
+  if (rc)
     {
-      struct hostent *hp = 0;
-      hp = gethostbyname (str);
-      if (hp == 0)
-	hostname_error (str);
-      else
-	{
-	  if (hp->h_length != 4 && hp->h_length != 8)
-	    {
-	      anubis_error (EXIT_FAILURE, 0,
-			    _("Illegal address length received for host %s"),
-			    str);
-	    }
-	  else
-	    memcpy ((char *) &ad.sin_addr.s_addr, hp->h_addr, hp->h_length);
-	}
+      info (VERBOSE, _("Cannot resolve %s: %s"), h1, resolve_strerror (rc));
+      return 0;
+    }
+  rc = resolve_host (h2, 0, AF_UNSPEC, &res2);
+  if (rc)
+    {
+      info (VERBOSE, _("Cannot resolve %s: %s"), h2, resolve_strerror (rc));
+      resolve_free (res1);
+      return 0;
     }
 
-  return inaddr;
+  for (p = res1, rc = 0; p && !rc; p = p->ai_next)
+    for (q = res2; q && !rc; q = q->ai_next)
+      rc = same_host_address (p->ai_addr, q->ai_addr);
+
+  resolve_free (res1);
+  resolve_free (res2);
+  return rc;
 }
 
-void
+/* Connect to the MTA.  On failure, send the client a 421 reply,
+   close its connection and return -1. */
+int
 session_prologue ()
 {
   ASSERT_MTA_CONFIG ();
+  scoreboard_user (session.clientname);
   if (!(topt & T_LOCAL_MTA)
       && session.anubis 
-      && string_to_ipaddr (session.mta) == string_to_ipaddr (session.anubis)
-      && session.anubis_port == session.mta_port)
+      && session.anubis_port == session.mta_port
+      && same_host (session.mta, session.anubis))
     anubis_error (EXIT_FAILURE, 0, _("remote-mta loops back to Anubis"));
   
   alarm (300);
   if (topt & T_LOCAL_MTA)
-    {
-      remote_server = make_local_connection (session.execpath,
-					     session.execargs);
-      if (!remote_server)
-	{
-	  service_unavailable (&remote_client);
-	  return;
-	}
-    }
+    remote_server = make_local_connection (session.execpath,
+					   session.execargs);
   else
+    remote_server = upstream_open (session.mta, session.mta_port);
+  if (!remote_server)
     {
-      remote_server = make_remote_connection (session.mta, session.mta_port);
-      if (!remote_server)
-	service_unavailable (&remote_client);
+      service_unavailable (&remote_client);
+      alarm (0);
+      return -1;
     }
   
   alarm (900);
+  return 0;
 }
 
 int
-anubis_transparent_mode (struct sockaddr_in *addr)
+anubis_transparent_mode (struct sockaddr *addr)
 {
   int rs = 0;
   int cs = 0;
+  char buf[LINEBUFFER];
 
   rs = auth_ident (addr, &session.clientname);
 
@@ -100,14 +123,14 @@ anubis_transparent_mode (struct sockaddr_in *addr)
 
   parse_transmap (&cs,
 		  rs ? session.clientname : 0,
-		  inet_ntoa (addr->sin_addr),
+		  format_sockaddr_host (buf, sizeof buf, addr),
 		  &session.clientname);
 
   if (cs == 1)
     {
       anubis_changeowner (session.clientname);
     }
-  else if (rs && cs == -1 && ntohl (addr->sin_addr.s_addr) == INADDR_LOOPBACK)
+  else if (rs && cs == -1 && sockaddr_is_local (addr))
     {
       if (check_username (session.clientname))
 	anubis_changeowner (session.clientname);
@@ -119,11 +142,13 @@ anubis_transparent_mode (struct sockaddr_in *addr)
 
   auth_tunnel ();
 
-  session_prologue ();
-  smtp_session_transparent ();
-  alarm (0);
+  if (session_prologue () == 0)
+    {
+      smtp_session_transparent ();
+      alarm (0);
+    }
 
-  net_close_stream (&remote_server);
+  upstream_close (&remote_server);
   net_close_stream (&remote_client);
 
   info (NORMAL, _("Connection closed successfully."));
@@ -146,18 +171,20 @@ anubis_transparent_mode (struct sockaddr_in *addr)
 }
 
 int
-anubis_proxy_mode (struct sockaddr_in *addr)
+anubis_proxy_mode (struct sockaddr *addr)
 {
   ASSERT_MTA_CONFIG ();
 
   set_unprivileged_user ();
 
   info (NORMAL, _("Initiated proxy mode."));
-  session_prologue ();
-  smtp_session_transparent ();
-  alarm (0);
+  if (session_prologue () == 0)
+    {
+      smtp_session_transparent ();
+      alarm (0);
+    }
 
-  net_close_stream (&remote_server);
+  upstream_close (&remote_server);
   net_close_stream (&remote_client);
 
   info (NORMAL, _("Connection closed successfully."));
@@ -21,19 +21,20 @@
 #include "headers.h"
 #include "extern.h"
 
-#define obstack_chunk_alloc malloc
-#define obstack_chunk_free free
-#include <obstack.h>
-
 static int transfer_command (MESSAGE);
 static int process_command (MESSAGE, char *);
-static void process_data (MESSAGE);
+static int process_data (MESSAGE);
 static int handle_ehlo (ANUBIS_SMTP_REPLY );
+static void pipelining_capability (ANUBIS_SMTP_REPLY);
+static void chunking_capability (ANUBIS_SMTP_REPLY);
+static int handle_bdat (MESSAGE, char *);
+static void bdat_reset (void);
 
 
 
 static char *smtp_ehlo_domain_name = NULL;
 static ANUBIS_SMTP_REPLY ehlo_reply = NULL;
+static int mta_chunking;	/* The MTA offers CHUNKING */
 
 char *
 get_ehlo_domain (void)
@@ -42,6 +43,19 @@ get_ehlo_domain (void)
 }
 
 
+/* Reset the per-session state of the tunnel.  This is called by a
+   worker process before it proceeds to the next session. */
+void
+smtp_session_cleanup (void)
+{
+  xfree (smtp_ehlo_domain_name);
+  smtp_reply_free (ehlo_reply);
+  ehlo_reply = NULL;
+  mta_chunking = 0;
+  bdat_reset ();
+}
+
+
 /* Collect and send headers */
 
 /* Headers spanning multiple lines are wrapped into a single line, preserving
@@ -80,10 +94,10 @@ get_boundary (MESSAGE msg, char *line)
 }
 
 static void
-add_header (ANUBIS_LIST list, char *line)
+add_header (MESSAGE msg, char *line)
 {
   ASSOC *asc = header_assoc (line);
-  list_append (list, asc);
+  message_append_header (msg, asc);
   if (asc->key && strcasecmp (asc->key, "subject") == 0)
     {
       char *p = strstr (asc->value, BEGIN_TRIGGER);
@@ -96,7 +110,7 @@ add_header (ANUBIS_LIST list, char *line)
 	  p += sizeof (BEGIN_TRIGGER) - 1;
 	  asc->key = strdup (X_ANUBIS_RULE_HEADER);
 	  asc->value = strdup (p);
-	  list_append (list, asc);
+	  message_append_header (msg, asc);
 	}
     }
 }
@@ -106,19 +120,35 @@ collect_headers (MESSAGE msg, char *line)
 {
   char *buf = NULL;
   size_t size = 0;
+  size_t len = 0;		/* Length of `line' */
+  size_t max = 0;		/* Allocated size of `line', if known */
   
+  if (line)
+    len = strlen (line);
   while (recvline (SERVER, remote_client, &buf, &size))
     {
       remcrlf (buf);
       if (isspace ((u_char) buf[0]))
 	{
+	  size_t n;
+
 	  if (!line)
 	    /* Something wrong, assume we've got no
 	       headers */
 	    break;
-	  line = xrealloc (line, strlen (line) + strlen (buf) + 2);
-	  strcat (line, "\n");
-	  strcat (line, buf);
+	  /* Append the continuation line, keeping track of the length
+	     so that folded headers are collected in linear time */
+	  n = strlen (buf);
+	  if (len + n + 2 > max)
+	    {
+	      max = len + n + 2;
+	      if (max < 2 * len)
+		max = 2 * len;
+	      line = xrealloc (line, max);
+	    }
+	  line[len++] = '\n';
+	  memcpy (line + len, buf, n + 1);
+	  len += n;
 	}
       else
 	{
@@ -126,12 +156,14 @@ collect_headers (MESSAGE msg, char *line)
 	    {
 	      if (!(topt & T_ENTIRE_BODY) && message_get_boundary (msg))
 		get_boundary (msg, line);
-	      add_header (message_get_header (msg), line);
+	      add_header (msg, line);
 	      xfree (line);
 	    }
 	  if (buf[0] == 0)
 	    break;
 	  line = strdup (buf);
+	  len = strlen (buf);
+	  max = len + 1;
 	}
     }
 }
@@ -202,26 +234,41 @@ send_string_list (NET_STREAM sd_server, ANUBIS_LIST list)
 #define ST_BODY  2
 #define ST_DONE  3
 
+/* Return the length of the line `buf' of `len' bytes without its
+   terminating CRLF, LF or CR (cf. remcrlf). */
+static size_t
+chomp_length (const char *buf, size_t len)
+{
+  if (len > 0 && buf[len - 1] == '\n')
+    len--;
+  if (len > 0 && buf[len - 1] == '\r')
+    len--;
+  return len;
+}
+
+/* True if the line `buf' of `len' bytes is the end-of-message mark */
+#define IS_EOM(buf, len) ((len) == 1 && (buf)[0] == '.')
+
+/* The body is collected directly into the text buffer that becomes
+   the message body, so that it is never copied as a whole, and is
+   moved to disk if it grows too large (see textbuf.c). */
 void
 collect_body (MESSAGE msg)
 {
-  int nread;
-  char *buf = NULL;
-  size_t size = 0;
-  struct obstack stk;
+  size_t nread;
+  const char *buf;
+  struct textbuf body = TEXTBUF_INITIALIZER;
   int state = 0;
-  int len;
+  size_t len;
   const char *boundary = message_get_boundary (msg);
   
   if (boundary)
     len = strlen (boundary);
-  obstack_init (&stk);
   while (state != ST_DONE
-	 && (nread = recvline (SERVER, remote_client, &buf, &size)))
+	 && (nread = recvline_ref (SERVER, remote_client, &buf)))
     {
-      remcrlf (buf);
-
-      if (strcmp (buf, ".") == 0)	/* EOM */
+      nread = chomp_length (buf, nread);
+      if (IS_EOM (buf, nread))
 	break;
 
       if (boundary)
@@ -229,38 +276,42 @@ collect_body (MESSAGE msg)
 	  switch (state)
 	    {
 	    case ST_INIT:
-	      if (strcmp (buf, boundary) == 0)
+	      if (nread == len && memcmp (buf, boundary, len) == 0)
 		state = ST_HDR;
 	      break;
 
 	    case ST_HDR:
-	      if (buf[0] == 0)
+	      if (nread == 0)
 		state = ST_BODY;
 	      else
-		message_append_mime_header (msg, buf);
+		{
+		  char *hdr = xmalloc (nread + 1);
+		  memcpy (hdr, buf, nread);
+		  hdr[nread] = 0;
+		  message_append_mime_header (msg, hdr);
+		  free (hdr);
+		}
 	      break;
 
 	    case ST_BODY:
-	      if (strncmp (buf, boundary, len) == 0)
+	      if (nread >= len && memcmp (buf, boundary, len) == 0)
 		state = ST_DONE;
 	      else
 		{
-		  obstack_grow (&stk, buf, strlen (buf));
-		  obstack_1grow (&stk, '\n');
+		  textbuf_append (&body, buf, nread);
+		  textbuf_append (&body, "\n", 1);
 		}
 	    }
 	}
       else
 	{
-	  obstack_grow (&stk, buf, strlen (buf));
-	  obstack_1grow (&stk, '\n');
+	  textbuf_append (&body, buf, nread);
+	  textbuf_append (&body, "\n", 1);
 	}
     }
-  free (buf);
-  obstack_1grow (&stk, 0);
-  /* FIXME: Use message_proc_body to avoid spurious reallocations */
-  message_replace_body (msg, xstrdup (obstack_finish (&stk)));
-  obstack_free (&stk, NULL);
+  /* Make sure the body is not NULL */
+  textbuf_append (&body, "", 0);
+  message_take_body (msg, &body);
 }
 
 void
@@ -309,6 +360,7 @@ smtp_session_transparent (void)
   size_t size = 0;
   ANUBIS_SMTP_REPLY reply;
   MESSAGE msg;
+  int rc;
 
   /*
      First of all, transfer a welcome message.
@@ -316,7 +368,11 @@ smtp_session_transparent (void)
 
   reply = smtp_reply_new ();
   info (VERBOSE, _("Transferring messages..."));
-  smtp_reply_get (CLIENT, remote_server, reply);
+  mta_chunking = upstream_chunking ();
+  if (upstream_reused ())
+    smtp_reply_set (reply, upstream_greeting ());
+  else
+    smtp_reply_get (CLIENT, remote_server, reply);
 
   if (smtp_reply_code_eq (reply, "220")
       && !smtp_reply_has_string (reply, 0, version, NULL))
@@ -342,6 +398,7 @@ smtp_session_transparent (void)
       free (str);
       free (banner_copy);
     }
+  upstream_set_greeting (smtp_reply_string (reply));
   swrite (SERVER, remote_client, smtp_reply_string (reply));
   smtp_reply_free (reply);
   
@@ -354,7 +411,10 @@ smtp_session_transparent (void)
     {
       remcrlf (command);
 
-      if (process_command (msg, command))
+      rc = process_command (msg, command);
+      if (rc < 0)
+	break;
+      if (rc)
 	continue;
 
       if (transfer_command (msg) == 0)
@@ -388,6 +448,7 @@ smtp_session (void)
   char *command = NULL;
   size_t size = 0;
   MESSAGE msg;
+  int rc;
 
   info (VERBOSE, _("Starting SMTP session..."));
   smtp_begin ();
@@ -398,7 +459,10 @@ smtp_session (void)
     {
       remcrlf (command);
       
-      if (process_command (msg, command))
+      rc = process_command (msg, command);
+      if (rc < 0)
+	break;
+      if (rc)
 	continue;
 
       if (transfer_command (msg) == 0)
@@ -478,7 +542,7 @@ handle_starttls (char *command)
 
   info (NORMAL, _("Using the TLS/SSL encryption..."));
 
-  if (!(topt & T_LOCAL_MTA))
+  if (!(topt & T_LOCAL_MTA) && !upstream_tls ())
     {
       NET_STREAM stream;
       ANUBIS_SMTP_REPLY reply = smtp_reply_new ();
@@ -503,6 +567,7 @@ handle_starttls (char *command)
       stream = start_ssl_client (remote_server, options.termlevel > NORMAL);
       if (!stream)
 	return 0;
+      upstream_set_tls (stream);
       remote_server = stream;
     }
   
@@ -561,6 +626,9 @@ process_command (MESSAGE msg, char *command)
     return handle_starttls (command);
   else if (!strncasecmp (command, "xdatabase", 9))
     return xdatabase (command + 9);
+  else if (!strncasecmp (command, "bdat", 4)
+	   && (command[4] == 0 || isspace ((unsigned char) command[4])))
+    return handle_bdat (msg, command);
   return 0;
 }
 
@@ -646,6 +714,7 @@ handle_ehlo (ANUBIS_SMTP_REPLY reply)
 	  return 1;
 	}
 
+      upstream_set_tls (stream);
       remote_server = stream;
       topt |= T_SSL_FINISHED;
 
@@ -694,22 +763,53 @@ handle_ehlo (ANUBIS_SMTP_REPLY reply)
 	topt &= ~T_ESMTP_AUTH;
     }
 
+  pipelining_capability (ehlo_reply);
+  chunking_capability (ehlo_reply);
   smtp_reply_set (reply, smtp_reply_string (ehlo_reply));
 
   return 0;
 }
 
+/* Reply to the EHLO `command' on a connection taken from the pool, if
+   the client introduces itself with the same domain the connection was
+   opened with.  Return 1 if the reply has been stored in `reply', and
+   0 if the command must be passed to the MTA. */
 static int
-transfer_command (MESSAGE msg)
+reuse_ehlo (const char *command, ANUBIS_SMTP_REPLY reply)
+{
+  const char *domain, *text;
+
+  if (!(text = upstream_ehlo (&domain)))
+    return 0;
+  save_ehlo_domain (command);
+  if (strcasecmp (smtp_ehlo_domain_name, domain))
+    return 0;
+
+  smtp_reply_free (ehlo_reply);
+  ehlo_reply = smtp_reply_new ();
+  smtp_reply_set (ehlo_reply, text);
+
+  /* The saved reply lacks STARTTLS if TLS is already in effect between
+     Anubis and the MTA, but the client may still use it. */
+  if ((topt & T_SSL) && (topt & T_STARTTLS)
+      && !(topt & (T_SSL_ONEWAY | T_SSL_FINISHED))
+      && !smtp_reply_has_capa (ehlo_reply, "STARTTLS", NULL))
+    smtp_reply_add_line (ehlo_reply, "STARTTLS");
+
+  smtp_reply_set (reply, smtp_reply_string (ehlo_reply));
+  return 1;
+}
+
+/* Apply the SMTP command rules to the last command saved in `msg' and
+   return the resulting command line.  Its lowercase copy is stored in
+   `*lcmd'. */
+static char *
+make_command (MESSAGE msg, char **lcmd)
 {
-  char *buf = NULL;
-  int rc = 1; /* OK */
-  ANUBIS_SMTP_REPLY reply = smtp_reply_new ();
-  const char *rstr;
   ASSOC *asc;
   char *command;
-  int len;
-  
+  char *buf = NULL;
+
   rcfile_call_section (CF_CLIENT, smtp_command_rule, "SMTP", NULL, msg);
   asc = list_tail_item (message_get_commands (msg));
   if (!asc->value)
@@ -724,6 +824,8 @@ transfer_command (MESSAGE msg)
 	      const char *p = smtp_reply_line (ehlo_reply, n);
 	      esmtp_auth (&remote_server, p + 9);
 	      smtp_reply_remove_line (ehlo_reply, n);
+	      /* The credentials may depend on the sender */
+	      upstream_taint ();
 	    }
 	  topt &= ~T_ESMTP_AUTH;
 	}
@@ -736,23 +838,21 @@ transfer_command (MESSAGE msg)
 	    
   assign_string (&buf, command);
   make_lowercase (buf);
+  scoreboard_smtp_command (buf);
+  *lcmd = buf;
+  return command;
+}
 
-  swrite (CLIENT, remote_server, command);
-  swrite (CLIENT, remote_server, CRLF);
+/* Pass the `reply' to `command' to the client and act upon it.  Return
+   0 if the session is over. */
+static int
+finish_command (MESSAGE msg, const char *command, const char *buf,
+		ANUBIS_SMTP_REPLY reply)
+{
+  int rc = 1; /* OK */
+  const char *rstr;
+  int len;
 
-  if (!strncmp (buf, "ehlo", 4))
-    {
-      smtp_reply_set (reply, command);
-      if (handle_ehlo (reply))
-	{
-	  smtp_reply_free (reply);
-	  free (command);
-	  return 0;
-	}
-    }
-  else
-    smtp_reply_get (CLIENT, remote_server, reply);
-  
   swrite (SERVER, remote_client, smtp_reply_string (reply));
 
   rstr = smtp_reply_line_ptr (reply, 0);
@@ -768,19 +868,558 @@ transfer_command (MESSAGE msg)
       else if (strncmp (buf, "rset", 4) == 0)
 	{
 	  message_reset (msg);
+	  bdat_reset ();
 	}
       else if (strncmp (buf, "data", 4) == 0)
 	{
-	  process_data (msg);
+	  if (process_data (msg))
+	    rc = 0;
+	}
+    }
+  return rc;
+}
+
+
+/* Command pipelining (RFC 2920).
+
+   Anubis always offers PIPELINING to the client.  Pipelined commands
+   need no special treatment on input: they are read from the client
+   stream one at a time, and the replies are collected in its output
+   buffer until Anubis has to wait for more input.
+
+   If the MTA supports pipelining as well, a MAIL or RCPT command
+   followed by more commands already received from the client starts
+   a group.  The group takes in the subsequent MAIL and RCPT commands
+   found in the input buffer, up to and including DATA, but at most
+   PIPELINE_MAX commands, so that the replies of the MTA never fill the
+   socket buffers.  The SMTP command rules are applied to each command
+   in turn, as usual, and the commands are sent to the MTA in a single
+   write.  Then the replies are read and passed to the client in the
+   same order.  RSET, EHLO, STARTTLS and the rest are never grouped, as
+   Anubis acts upon their replies before reading the next command. */
+
+#define PIPELINE_MAX 100
+
+static void
+pipelining_capability (ANUBIS_SMTP_REPLY reply)
+{
+  if (smtp_reply_has_capa (reply, "PIPELINING", NULL))
+    topt |= T_PIPELINING;
+  else
+    {
+      topt &= ~T_PIPELINING;
+      smtp_reply_add_line (reply, "PIPELINING");
+    }
+}
+
+/* If the client input buffer holds a complete line with a command that
+   may be added to a group, read it, save it in `msg' and return 1.
+   Otherwise, return 0. */
+static int
+next_group_command (MESSAGE msg)
+{
+  const char *p, *eol;
+  size_t len = stream_buffered (remote_client, &p);
+  char *line = NULL;
+  size_t size = 0;
+
+  if (!(eol = memchr (p, '\n', len)) || eol - p < 4
+      || !isspace ((unsigned char) p[4]))
+    return 0;
+  if (!(strncasecmp (p, "rcpt", 4) == 0
+	|| strncasecmp (p, "data", 4) == 0
+	|| (strncasecmp (p, "mail", 4) == 0 && !(topt & T_ESMTP_AUTH))))
+    return 0;
+
+  recvline (SERVER, remote_client, &line, &size);
+  remcrlf (line);
+  save_command (msg, line);
+  free (line);
+  return 1;
+}
+
+struct pending_command
+{
+  char *command;		/* Command as sent to the MTA */
+  char *lcmd;			/* Its lowercase copy */
+};
+
+/* Send a group of commands beginning with `command' to the MTA and
+   pass the replies to the client. */
+static int
+transfer_group (MESSAGE msg, char *command, char *buf)
+{
+  struct pending_command pend[PIPELINE_MAX];
+  size_t n = 0, i;
+  int rc = 1;
+
+  for (;;)
+    {
+      swrite (CLIENT, remote_server, command);
+      swrite (CLIENT, remote_server, CRLF);
+      pend[n].command = command;
+      pend[n].lcmd = buf;
+      n++;
+      if (n == PIPELINE_MAX || strncmp (buf, "data", 4) == 0
+	  || !next_group_command (msg))
+	break;
+      command = make_command (msg, &buf);
+    }
+
+  info (VERBOSE, _("Pipelined %lu commands"), (unsigned long) n);
+  for (i = 0; i < n; i++)
+    {
+      ANUBIS_SMTP_REPLY reply = smtp_reply_new ();
+
+      smtp_reply_get (CLIENT, remote_server, reply);
+      if (rc)
+	rc = finish_command (msg, pend[i].command, pend[i].lcmd, reply);
+      smtp_reply_free (reply);
+      free (pend[i].command);
+      free (pend[i].lcmd);
+    }
+  return rc;
+}
+
+/* Commands whose effect on the MTA lasts at most until RSET.  Any
+   other command passed to the MTA, e.g. AUTH, prevents the connection
+   from being reused (see upstream_taint). */
+static char *resettable_commands[] = {
+  "helo", "ehlo", "mail", "rcpt", "data", "bdat", "rset", "noop",
+  "vrfy", "expn", "help", "quit", NULL
+};
+
+static int
+resettable_command (const char *buf)
+{
+  size_t len = strcspn (buf, " \t");
+  int i;
+
+  for (i = 0; resettable_commands[i]; i++)
+    if (strlen (resettable_commands[i]) == len
+	&& memcmp (buf, resettable_commands[i], len) == 0)
+      return 1;
+  return 0;
+}
+
+static int
+transfer_command (MESSAGE msg)
+{
+  char *buf;
+  int rc;
+  ANUBIS_SMTP_REPLY reply;
+  char *command;
+  
+  command = make_command (msg, &buf);
+  if (!resettable_command (buf))
+    upstream_taint ();
+
+  if ((topt & T_PIPELINING)
+      && (!strncmp (buf, "mail", 4) || !strncmp (buf, "rcpt", 4)))
+    return transfer_group (msg, command, buf);
+
+  reply = smtp_reply_new ();
+  if (!strncmp (buf, "quit", 4)
+      && upstream_park (smtp_ehlo_domain_name, ehlo_reply))
+    /* The connection to the MTA is kept for the next session */
+    smtp_reply_set (reply,
+		    "221 2.0.0 Service closing transmission channel");
+  else if (!strncmp (buf, "ehlo", 4) && reuse_ehlo (command, reply))
+    ;
+  else
+    {
+      swrite (CLIENT, remote_server, command);
+      swrite (CLIENT, remote_server, CRLF);
+
+      if (!strncmp (buf, "ehlo", 4))
+	{
+	  smtp_reply_set (reply, command);
+	  if (handle_ehlo (reply))
+	    {
+	      smtp_reply_free (reply);
+	      free (command);
+	      free (buf);
+	      return 0;
+	    }
 	}
+      else
+	smtp_reply_get (CLIENT, remote_server, reply);
     }
+  
+  rc = finish_command (msg, command, buf, reply);
   free (buf);
   free (command);
   smtp_reply_free (reply);
   return rc;
 }
 
-void
+#ifdef HAVE_SPLICE
+/* Pass-through relay of the message body.
+
+   If the RULE section does not need the message body and both
+   connections are plain sockets, the body is moved from the client to
+   the server with splice(2), without copying it to user space and back.
+   The incoming data are only inspected, using MSG_PEEK, for the line
+   containing a single dot that ends the body.  That line itself is
+   consumed and replaced with ".\r\n" as usual. */
+
+/* States of the end-of-message scanner */
+enum
+  {
+    EOM_MID,			/* Inside a line */
+    EOM_LS,			/* At the start of a line */
+    EOM_DOT,			/* After a dot at the start of a line */
+    EOM_DOTCR			/* After a dot and CR */
+  };
+
+#define EOM_PENDING(s) ((s) == EOM_DOT || (s) == EOM_DOTCR)
+
+/* Scan `len' bytes of `buf' for the end-of-message line, continuing in
+   the scanner state `*state'.  Return the offset past the end of that
+   line, or 0 if it was not found.  In the latter case, if the state is
+   EOM_PENDING, `*dot' is set to the offset of the line that may turn
+   out to be the end-of-message line. */
+static size_t
+find_eom (int *state, const char *buf, size_t len, size_t *dot)
+{
+  size_t i = 0;
+
+  while (i < len)
+    {
+      const char *p;
+
+      switch (*state)
+	{
+	case EOM_MID:
+	  p = memchr (buf + i, '\n', len - i);
+	  if (!p)
+	    return 0;
+	  i = p - buf + 1;
+	  *state = EOM_LS;
+	  break;
+
+	case EOM_LS:
+	  *dot = i;
+	  if (buf[i] == '.')
+	    {
+	      *state = EOM_DOT;
+	      i++;
+	    }
+	  else if (buf[i] == '\n')
+	    i++;
+	  else
+	    *state = EOM_MID;
+	  break;
+
+	case EOM_DOT:
+	  if (buf[i] == '\n')
+	    return i + 1;
+	  if (buf[i] == '\r')
+	    {
+	      *state = EOM_DOTCR;
+	      i++;
+	    }
+	  else
+	    *state = EOM_MID;
+	  break;
+
+	case EOM_DOTCR:
+	  if (buf[i] == '\n')
+	    return i + 1;
+	  *state = EOM_MID;
+	  break;
+	}
+    }
+  return 0;
+}
+
+/* Read a line that starts with a dot through the client stream.
+   Return 1 if it ends the message, 0 otherwise. */
+static int
+transfer_dot_line (int *state)
+{
+  const char *line;
+  size_t len;
+
+  len = recvline_ref (SERVER, remote_client, &line);
+  if (len == 0 || IS_EOM (line, chomp_length (line, len)))
+    return 1;
+  swrite_n (CLIENT, remote_server, line, len);
+  *state = line[len - 1] == '\n' ? EOM_LS : EOM_MID;
+  return 0;
+}
+
+/* Relay the input already buffered in the client stream.  Return 1 if
+   it contains the end of the message. */
+static int
+transfer_buffered (int *state)
+{
+  const char *buf;
+  size_t len, end, dot;
+
+  while ((len = stream_buffered (remote_client, &buf)) > 0)
+    {
+      end = find_eom (state, buf, len, &dot);
+      if (end)
+	{
+	  swrite_n (CLIENT, remote_server, buf, dot);
+	  stream_consume (remote_client, end);
+	  return 1;
+	}
+      if (EOM_PENDING (*state))
+	{
+	  swrite_n (CLIENT, remote_server, buf, dot);
+	  stream_consume (remote_client, dot);
+	  if (transfer_dot_line (state))
+	    return 1;
+	}
+      else
+	{
+	  swrite_n (CLIENT, remote_server, buf, len);
+	  stream_consume (remote_client, len);
+	}
+    }
+  return 0;
+}
+
+/* Move `len' bytes from socket `in' to socket `out' through the pipe
+   `pfd'.  If splice is not available, copy them using `buf' instead. */
+static void
+move_data (int in, int out, int *pfd, char *buf, size_t len)
+{
+  static int no_splice;
+
+  scoreboard_bytes (len, len);
+  while (len > 0 && pfd[0] != -1 && !no_splice)
+    {
+      ssize_t n = splice (in, NULL, pfd[1], NULL, len,
+			  SPLICE_F_MOVE | SPLICE_F_MORE);
+
+      if (n == -1 && (errno == EINVAL || errno == ENOSYS))
+	{
+	  /* Splicing is not supported for these descriptors */
+	  no_splice = 1;
+	  break;
+	}
+      if (n <= 0)
+	socket_error (n ? NULL : _("unexpected end of input"));
+      len -= n;
+      while (n > 0)
+	{
+	  ssize_t k = splice (pfd[0], NULL, out, NULL, n,
+			      SPLICE_F_MOVE | SPLICE_F_MORE);
+	  if (k <= 0)
+	    socket_error (NULL);
+	  n -= k;
+	}
+    }
+
+  while (len > 0)
+    {
+      ssize_t n = recv (in, buf, len, 0);
+      ssize_t k;
+
+      if (n <= 0)
+	socket_error (n ? NULL : _("unexpected end of input"));
+      for (k = 0; k < n; )
+	{
+	  ssize_t rc = send (out, buf + k, n - k, 0);
+	  if (rc <= 0)
+	    socket_error (NULL);
+	  k += rc;
+	}
+      len -= n;
+    }
+}
+
+static void
+splice_transfer (void)
+{
+  int in = stream_fd (remote_client);
+  int out = stream_fd (remote_server);
+  int state = EOM_LS;
+  int pfd[2];
+  size_t bufsize = stream_buffer_size > LINEBUFFER
+                     ? stream_buffer_size : LINEBUFFER;
+  char *buf;
+
+  if (transfer_buffered (&state))
+    return;
+
+  if (pipe (pfd))
+    {
+      anubis_error (0, errno, _("cannot create pipe"));
+      pfd[0] = pfd[1] = -1;
+    }
+  buf = xmalloc (bufsize);
+  stream_flush (remote_server);
+  for (;;)
+    {
+      ssize_t n = recv (in, buf, bufsize, MSG_PEEK);
+      size_t end, dot;
+
+      if (n <= 0)
+	{
+	  if (n == -1 && errno == EINTR)
+	    continue;
+	  if (n == 0)
+	    break;
+	  socket_error (NULL);
+	}
+
+      end = find_eom (&state, buf, n, &dot);
+      if (end)
+	{
+	  move_data (in, out, pfd, buf, dot);
+	  /* Consume the end-of-message line */
+	  recv (in, buf, end - dot, 0);
+	  break;
+	}
+      if (!EOM_PENDING (state))
+	move_data (in, out, pfd, buf, n);
+      else if (dot > 0)
+	{
+	  /* Leave the possible end-of-message line for the next round */
+	  move_data (in, out, pfd, buf, dot);
+	  state = EOM_LS;
+	}
+      else if (transfer_dot_line (&state) || transfer_buffered (&state))
+	break;
+      else
+	stream_flush (remote_server);
+    }
+  free (buf);
+  if (pfd[0] != -1)
+    {
+      close (pfd[0]);
+      close (pfd[1]);
+    }
+}
+
+/* Return true if the message body can be relayed by splice_transfer */
+static int
+splice_possible (void)
+{
+  return anubis_mode != anubis_mda
+         && options.termlevel != DEBUG
+         && stream_fd (remote_client) != -1
+         && stream_fd (remote_server) != -1
+         && !rcfile_section_needs_body (outgoing_mail_rule);
+}
+#else
+# define splice_possible() 0
+# define splice_transfer()
+#endif /* HAVE_SPLICE */
+
+/* Output function for message_body_begin.  Sends the body text to the
+   MTA, with CRLF line endings.  `data' points to a flag that is set
+   when the text sent ends with a newline. */
+static void
+body_output (const char *text, size_t len, void *data)
+{
+  int *bol = data;
+
+  while (len > 0)
+    {
+      const char *p = memchr (text, '\n', len);
+      size_t n = p ? p - text : len;
+
+      swrite_n (CLIENT, remote_server, text, n);
+      *bol = p != NULL;
+      if (!p)
+	break;
+      send_eol (CLIENT, remote_server);
+      text += n + 1;
+      len -= n + 1;
+    }
+}
+
+/* Relay the message body from the client to the MTA, applying the
+   deferred body operations of the RULE section to it on the way (see
+   message_defer_body).  Only a line at a time is kept in memory. */
+static void
+stream_body (MESSAGE msg)
+{
+  const char *buf;
+  size_t nread;
+  int bol = 1;
+
+  message_body_begin (msg, body_output, &bol);
+  while ((nread = recvline_ref (SERVER, remote_client, &buf)) > 0)
+    {
+      nread = chomp_length (buf, nread);
+      if (IS_EOM (buf, nread))
+	break;
+      message_body_write (msg, buf, nread);
+      message_body_write (msg, "\n", 1);
+    }
+  message_body_end (msg);
+  if (!bol)
+    send_eol (CLIENT, remote_server);
+  swrite (CLIENT, remote_server, "." CRLF);
+  stream_flush (remote_server);
+}
+
+/* Reply to a message that could not be stored (see textbuf.c) */
+#define NO_STORAGE_REPLY "452 4.3.1 Insufficient system storage"
+
+/* Read the message body from the client and apply the RULE section to
+   the message.  Return -1, without running the section, if the body
+   could not be stored. */
+static int
+collect_message (MESSAGE msg)
+{
+  collect_body (msg);
+  if (message_body_error (msg))
+    return -1;
+  rcfile_call_section (CF_CLIENT, outgoing_mail_rule, "RULE", NULL, msg);
+  return 0;
+}
+
+/* Read the message from the client, apply the RULE section to it and
+   send it to the MTA, followed by the end-of-message mark.  Return 0 on
+   success, and -1 if the message body could not be stored, in which
+   case nothing more has been sent to the MTA.
+
+   The whole body is read into memory only if the RULE section needs
+   it.  Otherwise, the body is relayed as it arrives: by splice_transfer
+   if the section does not look at it, and by stream_body if it only
+   modifies it line by line. */
+static int
+transfer_message (MESSAGE msg)
+{
+  collect_headers (msg, NULL);
+  if (splice_possible ())
+    {
+      rcfile_call_section (CF_CLIENT, outgoing_mail_rule, "RULE", NULL, msg);
+      transfer_header (message_get_header (msg));
+      splice_transfer ();
+      swrite (CLIENT, remote_server, "." CRLF);
+      stream_flush (remote_server);
+    }
+  else if (!message_get_boundary (msg)
+	   && rcfile_section_body_use (outgoing_mail_rule) != body_needed)
+    {
+      message_defer_body (msg);
+      rcfile_call_section (CF_CLIENT, outgoing_mail_rule, "RULE", NULL, msg);
+      transfer_header (message_get_header (msg));
+      stream_body (msg);
+    }
+  else
+    {
+      if (collect_message (msg))
+	return -1;
+      transfer_header (message_get_header (msg));
+      transfer_body (msg);
+    }
+  return 0;
+}
+
+/* Transfer the message following the DATA command.  If it cannot be
+   stored, the transaction with the MTA cannot be aborted other than by
+   closing the connection: reply to the client and return -1 to end the
+   session. */
+static int
 process_data (MESSAGE msg)
 {
   char *buf = NULL;
@@ -788,13 +1427,14 @@ process_data (MESSAGE msg)
 
   alarm (1800);
 
-  collect_headers (msg, NULL);
-  collect_body (msg);
-
-  rcfile_call_section (CF_CLIENT, outgoing_mail_rule, "RULE", NULL, msg);
-
-  transfer_header (message_get_header (msg));
-  transfer_body (msg);
+  if (transfer_message (msg))
+    {
+      info (NORMAL, "%s: dot <=> %s", message_id (msg), NO_STORAGE_REPLY);
+      swrite (SERVER, remote_client, NO_STORAGE_REPLY CRLF);
+      message_reset (msg);
+      alarm (0);
+      return -1;
+    }
 
   if (recvline (CLIENT, remote_server, &buf, &size))
     {
@@ -809,6 +1449,7 @@ process_data (MESSAGE msg)
 
   message_reset (msg);
   alarm (0);
+  return 0;
 }
 
 void
@@ -825,17 +1466,17 @@ transfer_header (ANUBIS_LIST header_buf)
 static void
 raw_transfer (void)
 {
-  size_t size = 0;
-  char *buf = NULL;
-  while (recvline (SERVER, remote_client, &buf, &size) > 0)
+  const char *buf;
+  size_t len;
+
+  while ((len = recvline_ref (SERVER, remote_client, &buf)) > 0)
     {
-      remcrlf (buf);
-      if (strcmp (buf, ".") == 0)	/* EOM */
+      len = chomp_length (buf, len);
+      if (IS_EOM (buf, len))
 	break;
-      swrite (CLIENT, remote_server, buf);
+      swrite_n (CLIENT, remote_server, buf, len);
       send_eol (CLIENT, remote_server);
     }
-  free (buf);
 }
 
 void
@@ -852,6 +1493,381 @@ transfer_body (MESSAGE msg)
     send_body (msg, remote_server);
   if (anubis_mode != anubis_mda)
     swrite (CLIENT, remote_server, "." CRLF);
+  stream_flush (remote_server);
+}
+
+
+/* Message transfer in chunks (RFC 3030).
+
+   Anubis always offers CHUNKING to the client.  A message received with
+   BDAT is handled in one of two ways:
+
+   - If the RULE section needs the message body (see
+     rcfile_section_needs_body), or the MTA does not offer CHUNKING, the
+     chunks are accumulated in memory, dot-stuffed, and each one but the
+     last is acknowledged by Anubis itself.  After the last chunk, the
+     message is sent to the MTA with DATA, being processed exactly as if
+     it were received with DATA, and the reply of the MTA is passed to
+     the client.
+
+   - Otherwise, the chunks are accumulated only until the end of the
+     headers.  The RULE section is applied to the headers, which are
+     then sent to the MTA with BDAT, along with the rest of the chunk.
+     Each following chunk is passed to the MTA as is, without looking
+     into it, and the replies of the MTA are passed to the client.
+     Large bodies thus travel in sized chunks, with neither the search
+     for the end-of-message line nor dot-stuffing.
+
+   A message received with DATA is always sent with DATA.
+
+   If the accumulated data cannot be stored (see textbuf.c), the chunks
+   of the message are rejected with a 452 reply up to the last one, and
+   the transaction with the MTA is reset.  If that happens only when the
+   message is being sent to the MTA with DATA, the session ends, as with
+   DATA. */
+
+static void
+chunking_capability (ANUBIS_SMTP_REPLY reply)
+{
+  mta_chunking = smtp_reply_has_capa (reply, "CHUNKING", NULL);
+  upstream_set_chunking (mta_chunking);
+  if (!mta_chunking)
+    smtp_reply_add_line (reply, "CHUNKING");
+}
+
+/* States of the BDAT transfer */
+enum
+  {
+    BDAT_NONE,			/* No transfer in progress */
+    BDAT_SPOOL,			/* Accumulating the message */
+    BDAT_HEADER,		/* Accumulating the headers */
+    BDAT_CHUNK,			/* Passing the chunks to the MTA */
+    BDAT_FAILED			/* Discarding the chunks */
+  };
+
+static struct
+{
+  int state;			/* State of the transfer */
+  struct textbuf spool;		/* Accumulated data */
+  int bol;			/* The next byte begins a line */
+} bdat = { BDAT_NONE, TEXTBUF_INITIALIZER };
+
+static void
+bdat_reset (void)
+{
+  textbuf_free (&bdat.spool);
+  bdat.state = BDAT_NONE;
+  bdat.bol = 0;
+}
+
+static void
+bdat_append (const char *buf, size_t len)
+{
+  textbuf_append (&bdat.spool, buf, len);
+}
+
+/* Accumulate `len' bytes of `buf', doubling the dots that begin
+   lines */
+static void
+bdat_append_stuffed (const char *buf, size_t len)
+{
+  while (len > 0)
+    {
+      const char *p;
+      size_t n;
+
+      if (bdat.bol && buf[0] == '.')
+	bdat_append (".", 1);
+      p = memchr (buf, '\n', len);
+      n = p ? p - buf + 1 : len;
+      bdat_append (buf, n);
+      bdat.bol = p != NULL;
+      buf += n;
+      len -= n;
+    }
+}
+
+static void
+bdat_relay (const char *buf, size_t len)
+{
+  swrite_n (CLIENT, remote_server, buf, len);
+}
+
+static void
+bdat_discard (const char *buf, size_t len)
+{
+}
+
+/* Read `size' bytes of chunk data from the client and pass them to
+   `fun' */
+static void
+read_chunk (size_t size, void (*fun) (const char *, size_t))
+{
+  size_t bufsize = stream_buffer_size > LINEBUFFER
+                     ? stream_buffer_size : LINEBUFFER;
+  char *buf;
+
+  if (size == 0)
+    return;
+  buf = xmalloc (bufsize);
+  while (size > 0)
+    {
+      size_t n = recvdata (SERVER, remote_client, buf,
+			   size < bufsize ? size : bufsize);
+      fun (buf, n);
+      size -= n;
+    }
+  free (buf);
+}
+
+/* Return the offset past the empty line that ends the headers in the
+   `len' bytes of `buf', looking for it from the offset `start' on.
+   Return 0 if there is none. */
+static size_t
+header_end (const char *buf, size_t len, size_t start)
+{
+  size_t i;
+
+  for (i = start; i < len; i++)
+    if (buf[i] == '\n'
+	&& (i == 0 || buf[i - 1] == '\n'
+	    || (buf[i - 1] == '\r' && (i == 1 || buf[i - 2] == '\n'))))
+      return i + 1;
+  return 0;
+}
+
+/* Read the message headers from the first `len' bytes of `buf' */
+static void
+parse_headers (MESSAGE msg, const char *buf, size_t len)
+{
+  NET_STREAM str, client = remote_client;
+  struct textbuf copy = TEXTBUF_INITIALIZER;
+
+  textbuf_append (&copy, buf, len);
+  /* Make sure the headers end with an empty line */
+  if (len == 0 || buf[len - 1] != '\n')
+    textbuf_append (&copy, CRLF, 2);
+  if (header_end (copy.buf, copy.level,
+		  copy.level > 3 ? copy.level - 3 : 0) != copy.level)
+    textbuf_append (&copy, CRLF, 2);
+  stream_create_memory (&str, &copy);
+  remote_client = str;
+  collect_headers (msg, NULL);
+  remote_client = client;
+  net_close_stream (&str);
+}
+
+/* Pass the `reply' to the BDAT chunk to the client.  After the `last'
+   chunk, end the transfer. */
+static void
+bdat_reply (MESSAGE msg, ANUBIS_SMTP_REPLY reply, int last)
+{
+  swrite (SERVER, remote_client, smtp_reply_string (reply));
+  if (last)
+    {
+      const char *rstr = smtp_reply_line_ptr (reply, 0);
+      int len = strcspn (rstr, "\r\n");
+
+      info (NORMAL, "%s: bdat <=> %*.*s", message_id (msg), len, len, rstr);
+      message_reset (msg);
+      bdat_reset ();
+    }
+}
+
+/* Send the accumulated message to the MTA with DATA and return its
+   reply.  The message is parsed and processed by the RULE section
+   before DATA is sent, so that if it cannot be stored, NULL is returned
+   and nothing has been sent to the MTA. */
+static ANUBIS_SMTP_REPLY
+bdat_send_spool (MESSAGE msg)
+{
+  ANUBIS_SMTP_REPLY reply;
+  NET_STREAM str, client = remote_client;
+  int rc;
+
+  if (!bdat.bol)
+    bdat_append (CRLF, 2);
+  bdat_append ("." CRLF, 3);
+
+  stream_create_memory (&str, &bdat.spool);
+  remote_client = str;
+  collect_headers (msg, NULL);
+  rc = collect_message (msg);
+  remote_client = client;
+  net_close_stream (&str);
+  textbuf_free (&bdat.spool);
+  if (rc)
+    return NULL;
+
+  reply = smtp_reply_new ();
+  swrite (CLIENT, remote_server, "DATA" CRLF);
+  smtp_reply_get (CLIENT, remote_server, reply);
+  if (!smtp_reply_code_eq (reply, "354"))
+    return reply;
+
+  transfer_header (message_get_header (msg));
+  transfer_body (msg);
+  smtp_reply_get (CLIENT, remote_server, reply);
+  return reply;
+}
+
+/* Send the modified headers and the rest of the accumulated data past
+   them, `hend', to the MTA as a chunk */
+static void
+bdat_send_header (MESSAGE msg, size_t hend, int last)
+{
+  NET_STREAM str;
+  const char *hdr;
+  size_t hlen;
+  char *command;
+
+  stream_create_memory (&str, NULL);
+  send_header (str, message_get_header (msg));
+  send_eol (CLIENT, str);
+  hlen = stream_memory_contents (str, &hdr);
+
+  asprintf (&command, "BDAT %lu%s" CRLF,
+	    (unsigned long) (hlen + bdat.spool.level - hend), last ? " LAST" : "");
+  swrite (CLIENT, remote_server, command);
+  free (command);
+  swrite_n (CLIENT, remote_server, hdr, hlen);
+  swrite_n (CLIENT, remote_server, bdat.spool.buf + hend, bdat.spool.level - hend);
+  net_close_stream (&str);
+  textbuf_free (&bdat.spool);
+}
+
+/* Parse the arguments `arg' of BDAT.  Return 0 on success. */
+static int
+parse_bdat (const char *arg, unsigned long *size, int *last)
+{
+  char *p;
+
+  while (*arg && isspace ((unsigned char) *arg))
+    arg++;
+  if (!isdigit ((unsigned char) *arg))
+    return -1;
+  errno = 0;
+  *size = strtoul (arg, &p, 10);
+  if (errno)
+    return -1;
+  while (*p && isspace ((unsigned char) *p))
+    p++;
+  *last = strncasecmp (p, "last", 4) == 0;
+  if (*last)
+    p += 4;
+  while (*p && isspace ((unsigned char) *p))
+    p++;
+  return *p ? -1 : 0;
+}
+
+/* Reset the transaction with the MTA after a failed BDAT transfer */
+static void
+bdat_abort (void)
+{
+  ANUBIS_SMTP_REPLY reply = smtp_reply_new ();
+
+  swrite (CLIENT, remote_server, "RSET" CRLF);
+  smtp_reply_get (CLIENT, remote_server, reply);
+  smtp_reply_free (reply);
+}
+
+/* Handle the BDAT `command' received from the client */
+static int
+handle_bdat (MESSAGE msg, char *command)
+{
+  unsigned long size;
+  int last;
+  ANUBIS_SMTP_REPLY reply = NULL;
+
+  scoreboard_smtp_command ("bdat");
+  if (parse_bdat (command + 4, &size, &last))
+    {
+      swrite (SERVER, remote_client,
+	      "501 5.5.4 Syntax: BDAT chunk-size [LAST]" CRLF);
+      return 1;
+    }
+
+  alarm (1800);
+  if (bdat.state == BDAT_NONE)
+    {
+      bdat.bol = 1;
+      if (mta_chunking && !rcfile_section_needs_body (outgoing_mail_rule))
+	bdat.state = BDAT_HEADER;
+      else
+	bdat.state = BDAT_SPOOL;
+    }
+
+  switch (bdat.state)
+    {
+    case BDAT_SPOOL:
+      read_chunk (size, bdat_append_stuffed);
+      if (bdat.spool.error)
+	bdat.state = BDAT_FAILED;
+      else if (last && (reply = bdat_send_spool (msg)) == NULL)
+	bdat.state = BDAT_FAILED;
+      break;
+
+    case BDAT_HEADER:
+      {
+	size_t start = bdat.spool.level > 3 ? bdat.spool.level - 3 : 0;
+	size_t hend;
+
+	read_chunk (size, bdat_append);
+	if (bdat.spool.error)
+	  {
+	    bdat.state = BDAT_FAILED;
+	    break;
+	  }
+	hend = header_end (bdat.spool.buf, bdat.spool.level, start);
+	if (hend || last)
+	  {
+	    if (!hend)
+	      hend = bdat.spool.level;
+	    parse_headers (msg, bdat.spool.buf, hend);
+	    rcfile_call_section (CF_CLIENT, outgoing_mail_rule, "RULE", NULL,
+				 msg);
+	    bdat_send_header (msg, hend, last);
+	    reply = smtp_reply_new ();
+	    smtp_reply_get (CLIENT, remote_server, reply);
+	    bdat.state = BDAT_CHUNK;
+	  }
+      }
+      break;
+
+    case BDAT_CHUNK:
+      swrite (CLIENT, remote_server, command);
+      swrite (CLIENT, remote_server, CRLF);
+      read_chunk (size, bdat_relay);
+      reply = smtp_reply_new ();
+      smtp_reply_get (CLIENT, remote_server, reply);
+      break;
+
+    case BDAT_FAILED:
+      read_chunk (size, bdat_discard);
+      break;
+    }
+
+  if (bdat.state == BDAT_FAILED)
+    {
+      if (last)
+	bdat_abort ();
+      reply = smtp_reply_new ();
+      smtp_reply_set (reply, NO_STORAGE_REPLY);
+    }
+  else if (!reply)
+    {
+      /* Acknowledge the chunk on behalf of the MTA */
+      char *text;
+
+      reply = smtp_reply_new ();
+      asprintf (&text, "250 2.0.0 %lu octets received", size);
+      smtp_reply_set (reply, text);
+      free (text);
+    }
+  bdat_reply (msg, reply, last);
+  smtp_reply_free (reply);
+  alarm (0);
+  return 1;
 }
 
 /* EOF */
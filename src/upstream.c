@@ -0,0 +1,438 @@
+/*
+   upstream.c
+
+   This file is part of GNU Anubis.
+   Copyright (C) 2001-2020 The Anubis Team.
+
+   GNU Anubis is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   GNU Anubis is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU Anubis.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "headers.h"
+#include "extern.h"
+
+/* Reuse of the connections to the remote MTA.
+
+   Opening a session with the MTA takes a TCP handshake, the greeting
+   and EHLO exchange, and possibly a TLS handshake (STARTTLS) and a
+   SASL authentication.  In transparent and proxy modes, a worker may
+   instead keep the connection open after the client has sent QUIT,
+   and use it for the next session it serves:
+
+   - When the client sends QUIT, the command is not passed to the MTA.
+     Anubis replies to it itself and keeps the connection, along with
+     the greeting and EHLO reply of the MTA and the state of the TLS and
+     ESMTP authentication, provided that the connection has served fewer
+     than `upstream-max-reuse' sessions and that the total number of
+     connections to the MTA is below `upstream-max-connections'.
+
+   - While the worker waits for the next client, the connection is
+     closed if it stays unused for `upstream-idle-timeout' seconds, or
+     if the MTA sends anything or closes it.
+
+   - The next session begins with RSET sent to the MTA.  If it succeeds,
+     the client gets the saved greeting, and, if it introduces itself
+     with the same EHLO domain, the saved EHLO reply.  Otherwise, a new
+     connection is opened as usual.
+
+   RSET only resets the mail transaction.  A connection on which the
+   session did anything that outlasts it, such as AUTH sent by the
+   client or by Anubis on behalf of the client (esmtp-auth-delayed),
+   would carry that state over to the next client, so it is never
+   parked (see upstream_taint).
+
+   The total number of connections to the MTA held by all workers is
+   kept in the scoreboard.  A session for which no connection may be
+   opened is refused with a 421 reply.
+
+   The connection lives in the worker process, so it is lost whenever
+   the worker exits after the session (see prefork.c).  In particular,
+   a daemon running as root changes its credentials in each session,
+   and its connections are never reused. */
+
+unsigned upstream_max_reuse;
+unsigned upstream_idle_timeout = 60;
+unsigned upstream_max_connections;
+
+/* Bits of `topt' that describe the state of the connection */
+#define UPSTREAM_TOPT \
+  (T_STARTTLS | T_PIPELINING | T_ESMTP_AUTH | T_SSL_ONEWAY | T_SSL_FINISHED)
+
+static struct
+{
+  NET_STREAM stream;            /* Connection to the MTA, or NULL */
+  NET_STREAM plain;             /* Underlying plain stream, if TLS is
+				   in effect */
+  int fd;                       /* Its socket */
+  char *host;                   /* Host and port it was opened to */
+  unsigned port;
+  int counted;                  /* Accounted for in the scoreboard */
+  int tls;                      /* TLS is in effect */
+  int reused;                   /* Taken from the pool for this session */
+  int keep;                     /* Keep it when the session ends */
+  int parked;                   /* Waiting for the next session */
+  unsigned uses;                /* Number of sessions served */
+  time_t stamp;                 /* When it was parked */
+  char *greeting;               /* Greeting, as sent to the client */
+  char *ehlo_domain;            /* EHLO domain it was introduced with */
+  char *ehlo;                   /* EHLO reply, as sent to the client */
+  unsigned long topt;           /* UPSTREAM_TOPT bits */
+  int chunking;                 /* The MTA offers CHUNKING */
+  int tainted;                  /* Must not be reused (see upstream_taint) */
+} up = { NULL, NULL, -1 };
+
+/* Return true if the connections may be reused in the current mode */
+static int
+upstream_pool_enabled (void)
+{
+  return upstream_max_reuse > 1
+         && (anubis_mode == anubis_transparent || anubis_mode == anubis_proxy)
+         && !(topt & (T_LOCAL_MTA | T_STDINOUT));
+}
+
+/* Close the streams of the current connection */
+static void
+upstream_shutdown (void)
+{
+  if (up.stream)
+    net_close_stream (&up.stream);
+  if (up.plain)
+    net_close_stream (&up.plain);
+}
+
+static void
+upstream_free (void)
+{
+  if (up.counted)
+    scoreboard_upstream_close ();
+  free (up.host);
+  free (up.greeting);
+  free (up.ehlo_domain);
+  free (up.ehlo);
+  memset (&up, 0, sizeof (up));
+  up.fd = -1;
+}
+
+/* Close the pooled connection, saying goodbye to the MTA if it is
+   still in a consistent state. */
+static void
+upstream_drop (int quit)
+{
+  if (up.stream)
+    {
+      if (quit)
+	{
+	  size_t n;
+	  if (stream_write (up.stream, "QUIT" CRLF, 6, &n) == 0)
+	    stream_flush (up.stream);
+	}
+      upstream_shutdown ();
+    }
+  upstream_free ();
+}
+
+static ssize_t
+upstream_reader (void *data, char **sptr, size_t *psize)
+{
+  size_t nread;
+
+  if (stream_getline ((NET_STREAM) data, sptr, psize, &nread))
+    return -1;
+  return nread;
+}
+
+/* Reset the state of the pooled connection.  Unlike swrite and
+   recvline, do not bail out on errors: the MTA may have closed the
+   connection in the meantime. */
+static int
+upstream_reset (void)
+{
+  ANUBIS_SMTP_REPLY reply;
+  size_t n;
+  int rc;
+
+  if (stream_write (up.stream, "RSET" CRLF, 6, &n) || n != 6)
+    return -1;
+  reply = smtp_reply_new ();
+  smtp_reply_read (reply, upstream_reader, up.stream);
+  rc = smtp_reply_code_eq (reply, "250") ? 0 : -1;
+  smtp_reply_free (reply);
+  return rc;
+}
+
+/* Try to take the pooled connection to `host':`port' */
+static NET_STREAM
+upstream_reuse (char *host, unsigned port)
+{
+  if (!up.parked)
+    return NULL;
+  if (!upstream_pool_enabled ()
+      || strcmp (up.host, host) || up.port != port
+      || time (NULL) - up.stamp >= upstream_idle_timeout)
+    {
+      upstream_drop (1);
+      return NULL;
+    }
+  up.parked = 0;
+  if (upstream_reset ())
+    {
+      info (VERBOSE, _("Pooled connection to %s:%u is gone"), host, port);
+      upstream_drop (0);
+      return NULL;
+    }
+  up.reused = 1;
+  up.keep = 0;
+  topt = (topt & ~UPSTREAM_TOPT) | up.topt;
+  info (VERBOSE, _("Reusing connection to %s:%u (session %u)"),
+	host, port, up.uses + 1);
+  return up.stream;
+}
+
+/* Return a connection to the MTA at `host':`port', either taken from
+   the pool or newly opened.  Return NULL on failure. */
+NET_STREAM
+upstream_open (char *host, unsigned port)
+{
+  NET_STREAM str;
+
+  if ((str = upstream_reuse (host, port)) != NULL)
+    return str;
+
+  if (!scoreboard_upstream_open (upstream_max_connections))
+    {
+      info (NORMAL, _("Too many connections to the MTA (%u)"),
+	    upstream_max_connections);
+      return NULL;
+    }
+  str = make_remote_connection (host, port);
+  if (!str)
+    {
+      scoreboard_upstream_close ();
+      return NULL;
+    }
+  up.stream = str;
+  up.fd = stream_fd (str);
+  up.host = xstrdup (host);
+  up.port = port;
+  up.counted = 1;
+  return str;
+}
+
+/* Return true if the current connection has been taken from the pool */
+int
+upstream_reused (void)
+{
+  return up.stream && up.reused;
+}
+
+/* Record that TLS is now in effect on the current connection, which
+   is from now on accessed through `str'.  The MTA forgets the EHLO
+   exchange at that point, so the saved reply is no longer valid. */
+void
+upstream_set_tls (NET_STREAM str)
+{
+  if (!up.stream)
+    return;
+  up.plain = up.stream;
+  up.stream = str;
+  up.tls = 1;
+  up.reused = 0;
+  free (up.ehlo);
+  up.ehlo = NULL;
+}
+
+/* Return true if TLS is in effect on the current connection */
+int
+upstream_tls (void)
+{
+  return up.stream && up.tls;
+}
+
+/* Save the greeting of the MTA, as sent to the client */
+void
+upstream_set_greeting (const char *text)
+{
+  if (!up.stream)
+    return;
+  free (up.greeting);
+  up.greeting = xstrdup (text);
+}
+
+/* Return the saved greeting */
+const char *
+upstream_greeting (void)
+{
+  return up.greeting;
+}
+
+/* Return the saved EHLO reply and store in `*domain' the domain the
+   connection was introduced with.  Return NULL if there is none. */
+const char *
+upstream_ehlo (const char **domain)
+{
+  if (!upstream_reused () || !up.ehlo)
+    return NULL;
+  *domain = up.ehlo_domain;
+  return up.ehlo;
+}
+
+/* Record whether the MTA offers CHUNKING, as found in its EHLO reply */
+void
+upstream_set_chunking (int chunking)
+{
+  if (up.stream)
+    up.chunking = chunking;
+}
+
+/* Return true if the MTA of the pooled connection offers CHUNKING */
+int
+upstream_chunking (void)
+{
+  return upstream_reused () && up.chunking;
+}
+
+/* Record that the current session has changed the state of the
+   connection in a way that RSET does not undo, e.g. by authenticating,
+   so that the connection is not reused by another client. */
+void
+upstream_taint (void)
+{
+  if (up.stream && !up.tainted)
+    {
+      info (VERBOSE, _("Connection to the MTA will not be reused"));
+      up.tainted = 1;
+    }
+}
+
+/* The client has sent QUIT.  If the current connection may be reused,
+   save the state of the session, mark the connection to be kept by
+   upstream_close and return true.  `domain' and `ehlo' are the EHLO
+   domain and reply, or NULL if there was no EHLO. */
+int
+upstream_park (const char *domain, ANUBIS_SMTP_REPLY ehlo)
+{
+  if (!up.stream || remote_server != up.stream || !upstream_pool_enabled ()
+      || up.tainted || up.uses + 1 >= upstream_max_reuse
+      || (upstream_max_connections
+	  && scoreboard_upstream_count () >= upstream_max_connections))
+    return 0;
+
+  free (up.ehlo_domain);
+  free (up.ehlo);
+  up.ehlo_domain = NULL;
+  up.ehlo = NULL;
+  if (domain && ehlo)
+    {
+      up.ehlo_domain = xstrdup (domain);
+      up.ehlo = xstrdup (smtp_reply_string (ehlo));
+    }
+  up.topt = topt & UPSTREAM_TOPT;
+  /* Without ONEWAY, T_SSL_FINISHED refers to the client side */
+  if (!(topt & T_SSL_ONEWAY))
+    up.topt &= ~T_SSL_FINISHED;
+  up.keep = 1;
+  return 1;
+}
+
+/* End the session with the MTA on `*sd'.  The connection is kept for
+   reuse if upstream_park has been called during the session, and
+   closed otherwise. */
+void
+upstream_close (NET_STREAM *sd)
+{
+  if (!*sd)
+    return;
+  if (!up.stream || up.parked)
+    {
+      /* Not a connection returned by upstream_open */
+      net_close_stream (sd);
+      return;
+    }
+  if (*sd != up.stream)
+    {
+      /* The connection has got another layer, e.g. a SASL security
+	 layer, on top of it.  Closing that layer closes the underlying
+	 stream as well. */
+      net_close_stream (sd);
+      up.keep = 0;
+    }
+  *sd = NULL;
+  if (!up.keep || stream_flush (up.stream))
+    {
+      upstream_shutdown ();
+      upstream_free ();
+      return;
+    }
+  up.keep = 0;
+  up.reused = 0;
+  up.parked = 1;
+  up.uses++;
+  up.stamp = time (NULL);
+}
+
+/* Return the number of seconds the pooled connection may still stay
+   unused, or -1 if there is none. */
+int
+upstream_idle_left (void)
+{
+  time_t t;
+
+  if (!up.parked)
+    return -1;
+  t = up.stamp + upstream_idle_timeout - time (NULL);
+  return t > 0 ? t : 0;
+}
+
+/* Add the socket of the pooled connection to `fds' and return the
+   new maximum descriptor. */
+int
+upstream_fdset (fd_set *fds, int maxfd)
+{
+  if (up.parked && up.fd != -1)
+    {
+      FD_SET (up.fd, fds);
+      if (up.fd > maxfd)
+	maxfd = up.fd;
+    }
+  return maxfd;
+}
+
+/* Check the pooled connection after select returned `fds' (NULL on
+   timeout).  A parked connection has nothing to say, so input on it
+   means the MTA is closing it. */
+void
+upstream_check (fd_set *fds)
+{
+  if (!up.parked)
+    return;
+  if (fds && up.fd != -1 && FD_ISSET (up.fd, fds))
+    {
+      info (VERBOSE, _("MTA closed the pooled connection"));
+      upstream_drop (0);
+    }
+  else if (upstream_idle_left () == 0)
+    {
+      info (VERBOSE, _("Closing idle pooled connection"));
+      upstream_drop (1);
+    }
+}
+
+/* Close the pooled connection.  Called by a worker before exiting. */
+void
+upstream_discard (void)
+{
+  if (up.parked)
+    upstream_drop (1);
+}
+
+/* EOF */
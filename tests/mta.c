@@ -33,8 +33,18 @@
    In this case, mta prints the port number on the stdout, prior to
    starting operation. Notice, that in this mode mta does not disconnect
    itself from the controlling terminal, it always stays on the foreground.
+   Connections are served one at a time, until mta is killed.  Each of
+   them is marked in the diagnostics by a line "* connection N".
 
    Option -d in both cases sets the name of the output diagnostics file.
+
+   Option -E CAPA adds CAPA to the list of capabilities announced in
+   reply to EHLO.  It can be given several times.  The BDAT command is
+   accepted only if CHUNKING has been announced this way.
+
+   Recipient addresses beginning with "nobody@" are rejected.  AUTH is
+   accepted, with any credentials, if an AUTH capability has been
+   announced with -E.
    
    Environment variables:
 
@@ -95,6 +105,7 @@ int mta_stdio (int, char **);
 void error (const char *, ...);
 void smtp_reply (int, char *, ...);
 void reset_capa (char *);
+void add_capa (char *);
 
 #define R_CONT     0x8000
 #define R_CODEMASK 0xfff
@@ -113,7 +124,7 @@ main (int argc, char **argv)
   else
     progname++;
 
-  while ((c = getopt (argc, argv, "ac:C:b:d:k:p:")) != EOF)
+  while ((c = getopt (argc, argv, "ac:C:b:d:E:k:p:")) != EOF)
     {
       switch (c) {
       case 'a':
@@ -153,6 +164,10 @@ main (int argc, char **argv)
       case 'd':
 	diag_name = optarg;
 	break;
+
+      case 'E':
+	add_capa (optarg);
+	break;
 	
       case 'p':
 	port = strtoul (optarg, NULL, 0);
@@ -176,6 +191,7 @@ main (int argc, char **argv)
 	  error ("can't open diagnostic output: %s", diag_name);
 	  return 1;
 	}
+      setvbuf (diag, NULL, _IOLBF, 0);
     }
 
   argc -= optind;
@@ -471,6 +487,7 @@ get_input_line (char *buf, size_t bufsize)
 #define STATE_DATA   4
 #define STATE_QUIT   5
 #define STATE_DOT    6
+#define STATE_BDAT   7
 
 #define KW_EHLO      0
 #define KW_HELO      1
@@ -480,6 +497,8 @@ get_input_line (char *buf, size_t bufsize)
 #define KW_HELP      5
 #define KW_QUIT      6
 #define KW_STARTTLS  7
+#define KW_BDAT      8
+#define KW_AUTH      9
 
 int
 smtp_kw (const char *name)
@@ -500,6 +519,8 @@ smtp_kw (const char *name)
     { "quit", KW_QUIT },
     { "help", KW_HELP },
     { "starttls", KW_STARTTLS },
+    { "bdat", KW_BDAT },
+    { "auth", KW_AUTH },
     { NULL },
   };
   int i;
@@ -560,7 +581,9 @@ argcv_free (int argc, char **argv)
   return 1;
 }
 
-char *mta_capa[] = {
+#define MAX_CAPA 16
+
+char *mta_capa[MAX_CAPA + 1] = {
 #ifdef USE_GNUTLS
   "STARTTLS",
 #endif
@@ -574,11 +597,50 @@ reset_capa (char *name)
   for (i = 0; mta_capa[i]; i++)
     if (strcmp (mta_capa[i], name) == 0)
       {
-	mta_capa[i] = NULL;
+	do
+	  mta_capa[i] = mta_capa[i + 1];
+	while (mta_capa[i++]);
 	break;
       }
 }
 
+void
+add_capa (char *name)
+{
+  int i;
+  for (i = 0; mta_capa[i]; i++)
+    if (strcasecmp (mta_capa[i], name) == 0)
+      return;
+  if (i == MAX_CAPA)
+    {
+      error ("too many capabilities");
+      exit (1);
+    }
+  mta_capa[i] = name;
+  mta_capa[i + 1] = NULL;
+}
+
+int
+has_capa (char *name)
+{
+  int i;
+  for (i = 0; mta_capa[i]; i++)
+    if (strcasecmp (mta_capa[i], name) == 0)
+      return 1;
+  return 0;
+}
+
+/* Return true if an AUTH capability has been announced */
+int
+has_auth_capa (void)
+{
+  int i;
+  for (i = 0; mta_capa[i]; i++)
+    if (strncasecmp (mta_capa[i], "AUTH ", 5) == 0)
+      return 1;
+  return 0;
+}
+
 void
 smtp_ehlo (int extended)
 {
@@ -637,6 +699,71 @@ check_address_command(const char *pfx, int *pargc, char ***pargv)
   return 1;
 }
 
+/* Handle the BDAT command.  ARGV[1] is the chunk size, optional ARGV[2]
+   is the word LAST.  Read the chunk and copy it to the diagnostic
+   output, omitting carriage returns.  Return the new state, or STATE
+   if the command is malformed. */
+int
+smtp_bdat (int state, int argc, char **argv)
+{
+  unsigned long size;
+  char *p;
+  int last = 0;
+  
+  if (argc < 2 || argc > 3
+      || (size = strtoul (argv[1], &p, 10), *p)
+      || (argc == 3 && !(last = strcasecmp (argv[2], "last") == 0)))
+    {
+      smtp_reply (501, "Syntax error");
+      return state;
+    }
+
+  while (size)
+    {
+      char buf[512];
+      size_t i, n = size < sizeof buf ? size : sizeof buf;
+      int rc = _mta_read (in, buf, n, &n);
+      if (rc)
+	{
+	  fprintf (stderr, "Read failed: %s\n", _mta_strerror (rc));
+	  abort ();
+	}
+      if (n == 0)
+	exit (1);
+      if (diag)
+	for (i = 0; i < n; i++)
+	  if (buf[i] != '\r')
+	    fputc (buf[i], diag);
+      size -= n;
+    }
+
+  if (last)
+    {
+      smtp_reply (250, "Mail accepted for delivery");
+      return STATE_EHLO;
+    }
+  smtp_reply (250, "%s octets received", argv[1]);
+  return STATE_BDAT;
+}
+
+/* Reply to the RCPT command.  Return 0 if the recipient is accepted. */
+int
+smtp_rcpt (int *pargc, char ***pargv)
+{
+  if (check_address_command("to", pargc, pargv))
+    {
+      smtp_reply (501, "Syntax error");
+      return 1;
+    }
+  if (*pargc >= 3 && strncasecmp ((*pargv)[2], "<nobody@", 8) == 0)
+    {
+      smtp_reply (550, "Mailbox unavailable");
+      return 1;
+    }
+  smtp_reply (250, "Recipient OK");
+  return 0;
+}
+
 void
 smtp (void)
 {
@@ -723,6 +850,16 @@ smtp (void)
 	  smtp_starttls ();
 	  break;
 #endif
+	case KW_AUTH:
+	  if (has_auth_capa ())
+	    {
+	      if (argc >= 2)
+		smtp_reply (235, "Authentication successful");
+	      else
+		smtp_reply (501, "Syntax error");
+	      break;
+	    }
+	  /* fall through */
 	default:
 	  smtp_reply (503, "Need MAIL command");
 	}
@@ -731,13 +868,8 @@ smtp (void)
       case STATE_MAIL:
 	switch (kw) {
 	case KW_RCPT:
-	  if (check_address_command("to", &argc, &argv) == 0)
-	    {
-	      smtp_reply (250, "Recipient OK");
-	      state = STATE_RCPT;
-	    }
-	  else
-	    smtp_reply (501, "Syntax error");
+	  if (smtp_rcpt (&argc, &argv) == 0)
+	    state = STATE_RCPT;
 	  break;
 	  
 	default:
@@ -748,12 +880,7 @@ smtp (void)
       case STATE_RCPT:
 	switch (kw) {
 	case KW_RCPT:
-	  if (argc == 3 && strcasecmp (argv[1], "to:") == 0)
-	    {
-	      smtp_reply (250, "Recipient OK");
-	    }
-	  else
-	    smtp_reply (501, "Syntax error");
+	  smtp_rcpt (&argc, &argv);
 	  break;
 	  
 	case KW_DATA:
@@ -761,10 +888,25 @@ smtp (void)
 		      "Enter mail, end with \".\" on a line by itself");
 	  state = STATE_DATA;
 	  break;
-	  
+
+	case KW_BDAT:
+	  if (has_capa ("CHUNKING"))
+	    {
+	      state = smtp_bdat (state, argc, argv);
+	      break;
+	    }
+	  /* fall through */
 	default:
 	  smtp_reply (501, "Syntax error");
 	}
+	break;
+
+      case STATE_BDAT:
+	if (kw == KW_BDAT)
+	  state = smtp_bdat (state, argc, argv);
+	else
+	  smtp_reply (503, "Need BDAT command");
+	break;
 	
       case STATE_DATA:
 	if (strcmp (buf, ".") == 0)
@@ -783,6 +925,7 @@ mta_daemon (int argc, char **argv)
   int on = 1;
   struct sockaddr_in address;
   int fd;
+  int n = 0;
 
   fd = socket (PF_INET, SOCK_STREAM, 0);
   if (fd < 0)
@@ -854,9 +997,12 @@ mta_daemon (int argc, char **argv)
 	  return 1;
 	}
 
-      in = out = (void *) (ptrdiff_t) fd;
+      if (diag)
+	fprintf (diag, "* connection %d\n", ++n);
+      in = out = (void *) (ptrdiff_t) sfd;
       smtp ();
-      break;
+      smtp_reply (221, "Done");
+      close (sfd);
     }
 
   return 0;
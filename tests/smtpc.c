@@ -0,0 +1,185 @@
+/*
+  NAME
+    smtpc - minimal SMTP client for testing anubis in daemon mode
+
+  SYNOPSIS
+    smtpc PORT < INPUT
+
+  DESCRIPTION
+    Connects to 127.0.0.1:PORT, reads the greeting and sends lines from
+    the standard input, one by one, terminating each with CRLF.  After
+    each command, the reply is read and printed on the standard output,
+    with CRs removed.  A 354 reply switches to the message text: its
+    lines are sent without waiting for a reply, up to and including the
+    line containing a single dot.  Input ends at EOF or after QUIT.
+
+  EXIT STATUS
+    0
+        Success.
+    1
+        Failure.
+    2
+        Command line usage error.
+
+  LICENSE
+    This file is part of GNU Anubis testsuite.
+    Copyright (C) 2003-2020 The Anubis Team.
+
+    GNU Anubis is free software; you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by the
+    Free Software Foundation; either version 3 of the License, or (at your
+    option) any later version.
+
+    GNU Anubis is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with GNU Anubis.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <errno.h>
+
+char const *progname;
+
+/* Exit codes */
+enum
+  {
+    EX_OK = 0,
+    EX_ERROR = 1,
+    EX_USAGE = 2
+  };
+
+static void
+error (char const *fmt, ...)
+{
+  va_list ap;
+
+  fprintf (stderr, "%s: ", progname);
+  va_start (ap, fmt);
+  vfprintf (stderr, fmt, ap);
+  va_end (ap);
+  fputc ('\n', stderr);
+}
+
+/* Read one line into BUF, stripping the line terminator.  Return its
+   length, or -1 on EOF. */
+static int
+read_line (FILE *fp, char *buf, size_t size)
+{
+  int len;
+
+  if (!fgets (buf, size, fp))
+    return -1;
+  len = strlen (buf);
+  if (len > 0 && buf[len - 1] == '\n')
+    buf[--len] = 0;
+  if (len > 0 && buf[len - 1] == '\r')
+    buf[--len] = 0;
+  return len;
+}
+
+/* Read and print a (possibly multi-line) reply.  Return its code. */
+static int
+read_reply (FILE *fp)
+{
+  char buf[1024];
+  int len;
+
+  do
+    {
+      len = read_line (fp, buf, sizeof buf);
+      if (len < 0)
+	{
+	  error ("unexpected EOF");
+	  exit (EX_ERROR);
+	}
+      printf ("%s\n", buf);
+    }
+  while (len > 3 && buf[3] == '-');
+  fflush (stdout);
+  return atoi (buf);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct sockaddr_in address;
+  int fd;
+  FILE *in, *out;
+  char buf[1024];
+  int data = 0;
+
+  progname = strrchr (argv[0], '/');
+  if (!progname)
+    progname = argv[0];
+  else
+    progname++;
+
+  if (argc != 2)
+    {
+      fprintf (stderr, "usage: %s PORT < INPUT\n", progname);
+      return EX_USAGE;
+    }
+
+  memset (&address, 0, sizeof (address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  address.sin_port = htons (atoi (argv[1]));
+
+  fd = socket (PF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      error ("socket: %s", strerror (errno));
+      return EX_ERROR;
+    }
+  if (connect (fd, (struct sockaddr *) &address, sizeof (address)))
+    {
+      error ("connect: %s", strerror (errno));
+      return EX_ERROR;
+    }
+
+  in = fdopen (fd, "r");
+  out = fdopen (dup (fd), "w");
+  if (!in || !out)
+    {
+      error ("fdopen: %s", strerror (errno));
+      return EX_ERROR;
+    }
+
+  read_reply (in);
+  while (read_line (stdin, buf, sizeof buf) >= 0)
+    {
+      fprintf (out, "%s\r\n", buf);
+      fflush (out);
+      if (data)
+	{
+	  if (strcmp (buf, ".") == 0)
+	    {
+	      data = 0;
+	      read_reply (in);
+	    }
+	}
+      else if (read_reply (in) == 354)
+	data = 1;
+      else if (strcasecmp (buf, "QUIT") == 0)
+	break;
+    }
+
+  fclose (out);
+  fclose (in);
+  return EX_OK;
+}